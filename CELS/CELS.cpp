@@ -1,6 +1,11 @@
+#if defined(__APPLE__) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 600       // for ucontext functions
+#define _DARWIN_C_SOURCE        // that shouldn't hide the rest of system API
+#endif
 #include <stdio.h>  // only for debugging
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include "CELS.h"
 
 
@@ -20,39 +25,22 @@ static void* ExtendArray (void** array, int element_size, int* i, int* size)
     return (char*)*array + (*i-1) * element_size;
 }
 
-// Compute hash of the string
-static unsigned StringHash (const char* str)
+// Compute hash of the first len chars of the string
+static unsigned StringHash (const char* str, size_t len)
 {
     unsigned hash = 314159265;
-    do {
-        hash = (hash + *str) * 1234567891;
+    for (;  len > 0;  len--) {
+        hash = (hash + (unsigned char)*str++) * 1234567891;
         hash += hash>>17;
-    } while (*str++);
-    return hash;
-}
-
-//   str  ,   splitter.
-//  -   str splitter   '\0'
-//     result      str  + NULL ( argv)
-//    
-static int SplitStr (char *str, char splitter, char **result_base, int result_size)
-{
-    char **result      = result_base;
-    char **result_last = result_base+result_size-1;
-    *result++ = str;
-    while (*str && result < result_last)
-    {
-        while (*str && *str!=splitter) str++;
-        if (*str) {
-            *str++ = '\0';
-            *result++ = str;
-        }
     }
-    *result = NULL;
-    return result-result_base;
+    return hash;
 }
 
 #ifdef _WIN32
+#if !defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0600
+#undef  _WIN32_WINNT
+#define _WIN32_WINNT 0x0600     // for condition variables
+#endif
 #include <windows.h>
 CelsResult DllUnload (void* dll)
 {
@@ -60,10 +48,132 @@ CelsResult DllUnload (void* dll)
     return CELS_OK;
 }
 #else
+#include <dlfcn.h>
 CelsResult DllUnload (void* dll)
 {
-    return CELS_ERROR_NOT_IMPLEMENTED;
+    return dlclose(dll)==0? CELS_OK : CELS_ERROR_GENERAL;
+}
+#endif
+
+// Minimal spinlock guarding short critical sections, atomic counters and thread ids
+#ifdef _WIN32
+typedef volatile LONG CelsSpinLock;
+static void SpinLock   (CelsSpinLock* lock)  {while (InterlockedExchange(lock,1))  Sleep(0);}
+static void SpinUnlock (CelsSpinLock* lock)  {InterlockedExchange(lock,0);}
+typedef volatile LONG CelsAtomic;
+static long AtomicAdd (CelsAtomic* value, long delta)  {return InterlockedExchangeAdd(value,delta) + delta;}
+typedef volatile LONG64 CelsAtomicNum;
+static void AtomicAddNum (CelsAtomicNum* value, CelsNum delta)  {InterlockedExchangeAdd64(value,delta);}
+static void MemoryFence (void)  {MemoryBarrier();}
+#define AtomicLoad(ptr)         (*(ptr))                // volatile accesses have acquire/release semantics in MSVC
+#define AtomicStore(ptr,value)  (*(ptr) = (value))
+typedef DWORD CelsThreadId;
+static CelsThreadId CurrentThread (void)  {return GetCurrentThreadId();}
+static int SameThread (CelsThreadId a, CelsThreadId b)  {return a==b;}
+#else
+#include <sched.h>
+#include <pthread.h>
+typedef volatile int CelsSpinLock;
+static void SpinLock   (CelsSpinLock* lock)  {while (__sync_lock_test_and_set(lock,1))  sched_yield();}
+static void SpinUnlock (CelsSpinLock* lock)  {__sync_lock_release(lock);}
+typedef volatile long CelsAtomic;
+static long AtomicAdd (CelsAtomic* value, long delta)  {return __sync_add_and_fetch(value,delta);}
+typedef volatile long long CelsAtomicNum;
+static void AtomicAddNum (CelsAtomicNum* value, CelsNum delta)  {__sync_add_and_fetch(value,delta);}
+static void MemoryFence (void)  {__sync_synchronize();}
+#define AtomicLoad(ptr)         __atomic_load_n  (ptr, __ATOMIC_ACQUIRE)
+#define AtomicStore(ptr,value)  __atomic_store_n (ptr, value, __ATOMIC_RELEASE)
+typedef pthread_t CelsThreadId;
+static CelsThreadId CurrentThread (void)  {return pthread_self();}
+static int SameThread (CelsThreadId a, CelsThreadId b)  {return pthread_equal(a,b);}
+#endif
+
+// Lock that may be reentered by the thread owning it (f.e. CELS_LOAD_MODULE registering codecs via Cels(CELS_REGISTER)).
+// The owner is published before the depth, so a thread seeing depth>0 never sees its own stale id left from its previous ownership
+typedef struct {
+    CelsSpinLock           lock;
+    volatile int           depth;
+    volatile CelsThreadId  owner;
+} CelsRecursiveLock;
+
+static void RecursiveLock (CelsRecursiveLock* lock)
+{
+    CelsThreadId self = CurrentThread();
+    if (AtomicLoad (&lock->depth) > 0  &&  SameThread (AtomicLoad (&lock->owner), self))  {lock->depth++;  return;}
+    SpinLock (&lock->lock);
+    AtomicStore (&lock->owner, self);
+    AtomicStore (&lock->depth, 1);
+}
+
+static void RecursiveUnlock (CelsRecursiveLock* lock)
+{
+    int depth = lock->depth - 1;
+    AtomicStore (&lock->depth, depth);
+    if (depth == 0)  SpinUnlock (&lock->lock);
+}
+
+// Threads, mutexes and condition variables for operations that may block for a long time
+#ifdef _WIN32
+typedef CRITICAL_SECTION CelsMutex;
+typedef CONDITION_VARIABLE CelsCond;
+typedef HANDLE CelsThread;
+#define CELS_THREAD_FUNCTION(name)  DWORD WINAPI name (void* arg)
+static void MutexInit    (CelsMutex* mutex)  {InitializeCriticalSection(mutex);}
+static void MutexDestroy (CelsMutex* mutex)  {DeleteCriticalSection(mutex);}
+static void MutexLock    (CelsMutex* mutex)  {EnterCriticalSection(mutex);}
+static void MutexUnlock  (CelsMutex* mutex)  {LeaveCriticalSection(mutex);}
+static void CondInit      (CelsCond* cond)  {InitializeConditionVariable(cond);}
+static void CondDestroy   (CelsCond* cond)  {}
+static void CondWait      (CelsCond* cond, CelsMutex* mutex)  {SleepConditionVariableCS(cond,mutex,INFINITE);}
+static void CondBroadcast (CelsCond* cond)  {WakeAllConditionVariable(cond);}
+static int  StartThread (CelsThread* thread, LPTHREAD_START_ROUTINE function, void* arg)  {return (*thread = CreateThread(NULL,0,function,arg,0,NULL)) != NULL;}
+static void JoinThread  (CelsThread thread)  {WaitForSingleObject(thread,INFINITE);  CloseHandle(thread);}
+static int  NumberOfCores (void)  {SYSTEM_INFO si;  GetSystemInfo(&si);  return si.dwNumberOfProcessors;}
+// Monotonic wall clock and CPU time of the current thread, in nanoseconds
+static CelsNum NanoTime (void)
+{
+    LARGE_INTEGER counter, freq;
+    QueryPerformanceCounter (&counter);
+    QueryPerformanceFrequency (&freq);
+    return (CelsNum) ((double)counter.QuadPart * 1e9 / freq.QuadPart);
+}
+static CelsNum ThreadCpuTime (void)
+{
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes (GetCurrentThread(), &creation, &exit, &kernel, &user))  return 0;
+    return ((((CelsNum)kernel.dwHighDateTime << 32) + kernel.dwLowDateTime) + (((CelsNum)user.dwHighDateTime << 32) + user.dwLowDateTime)) * 100;
 }
+// Thread-local values; the destructor is called on thread exit with non-NULL value
+typedef DWORD CelsThreadLocal;
+#define CELS_THREAD_LOCAL_DESTRUCTOR(name)  VOID WINAPI name (void* value)
+static int   ThreadLocalCreate (CelsThreadLocal* key, PFLS_CALLBACK_FUNCTION destructor)  {return (*key = FlsAlloc(destructor)) != FLS_OUT_OF_INDEXES;}
+static void* ThreadLocalGet    (CelsThreadLocal key)               {return FlsGetValue(key);}
+static void  ThreadLocalSet    (CelsThreadLocal key, void* value)  {FlsSetValue(key,value);}
+#else
+#include <unistd.h>
+#include <time.h>
+typedef pthread_mutex_t CelsMutex;
+typedef pthread_cond_t CelsCond;
+typedef pthread_t CelsThread;
+#define CELS_THREAD_FUNCTION(name)  void* name (void* arg)
+static void MutexInit    (CelsMutex* mutex)  {pthread_mutex_init(mutex,NULL);}
+static void MutexDestroy (CelsMutex* mutex)  {pthread_mutex_destroy(mutex);}
+static void MutexLock    (CelsMutex* mutex)  {pthread_mutex_lock(mutex);}
+static void MutexUnlock  (CelsMutex* mutex)  {pthread_mutex_unlock(mutex);}
+static void CondInit      (CelsCond* cond)  {pthread_cond_init(cond,NULL);}
+static void CondDestroy   (CelsCond* cond)  {pthread_cond_destroy(cond);}
+static void CondWait      (CelsCond* cond, CelsMutex* mutex)  {pthread_cond_wait(cond,mutex);}
+static void CondBroadcast (CelsCond* cond)  {pthread_cond_broadcast(cond);}
+static int  StartThread (CelsThread* thread, void* (*function)(void*), void* arg)  {return pthread_create(thread,NULL,function,arg) == 0;}
+static void JoinThread  (CelsThread thread)  {pthread_join(thread,NULL);}
+static int  NumberOfCores (void)  {long n = sysconf(_SC_NPROCESSORS_ONLN);  return n>0? (int)n : 1;}
+static CelsNum NanoTime (void)       {struct timespec t;  clock_gettime (CLOCK_MONOTONIC, &t);          return (CelsNum)t.tv_sec * 1000000000 + t.tv_nsec;}
+static CelsNum ThreadCpuTime (void)  {struct timespec t;  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &t);  return (CelsNum)t.tv_sec * 1000000000 + t.tv_nsec;}
+typedef pthread_key_t CelsThreadLocal;
+#define CELS_THREAD_LOCAL_DESTRUCTOR(name)  void name (void* value)
+static int   ThreadLocalCreate (CelsThreadLocal* key, void (*destructor)(void*))  {return pthread_key_create(key,destructor) == 0;}
+static void* ThreadLocalGet    (CelsThreadLocal key)               {return pthread_getspecific(key);}
+static void  ThreadLocalSet    (CelsThreadLocal key, void* value)  {pthread_setspecific(key,value);}
 #endif
 
 
@@ -72,33 +182,416 @@ CelsResult DllUnload (void* dll)
 // ****************************************************************************************************************************
 
 typedef struct {
-    const char *name;  void* self;  CelsFunction* CelsMain;  unsigned hash;
+    const char *name;  void* self;  CelsFunction* CelsMain;
+    unsigned hash;      // hash of the name (or of its fixed part for wildcard names like "aes*")
+    unsigned len;       // length of the name (or of its fixed part)
+    int wildcard;       // 1 for wildcard names
+    int prev;           // index of the previously registered codec with the same name (or the same fixed part), or -1
+    CelsStats* stats;   // totals of operations on methods parsed by this codec, shared by the record copies in all snapshots
 } RegCodec;
-static RegCodec* RegisteredCodecs = NULL;
-static int NumRegisteredCodecs = 0;
-static int MaxRegisteredCodecs = 0;
 
-CelsResult CelsRegister (const char* name, void* ud, CelsFunction* CelsMain)
+// Immutable snapshot of the codec registry.
+// Parsing works with the snapshot current at its start and never takes a lock; registration publishes a new snapshot.
+// Arrays are shared between consecutive snapshots as long as possible: codec records are only appended
+// after the last published one, and index slots are updated by a single store after the record is complete,
+// so readers of older snapshot just skip codecs beyond their num_codecs.
+typedef struct CodecRegistry {
+    RegCodec*   codecs;                 // registered codecs in the registration order
+    int         num_codecs;
+    int*        index;                  // open-addressing hash table of codec numbers, see below
+    int         index_size;             // power of 2
+    unsigned*   wildcard_lengths;       // sorted list of distinct fixed part lengths of registered wildcard names
+    int         num_wildcard_lengths;
+    int         num_index_keys;         // number of occupied slots in the index
+    void*       garbage[3];             // arrays replaced by the next snapshot, freed together with this one
+    struct CodecRegistry* next_retired;
+} CodecRegistry;
+
+// The index slot holds number of the last codec registered with given name (or wildcard fixed part), or -1 for empty slot.
+// Earlier codecs with the same key are chained via RegCodec.prev, so the last registered codec is always found first.
+
+static CodecRegistry* volatile Registry = NULL;     // current snapshot
+static CelsRecursiveLock RegistryLock;              // serializes all modifications of the registry and module list
+static int MaxRegisteredCodecs = 0;                 // capacity of Registry->codecs
+
+// Epoch-based reclamation of replaced snapshots: readers announce themselves in ActiveReaders[epoch&1],
+// snapshots replaced during epoch E are freed once no reader of epoch E remains, i.e. when the epoch advances to E+2
+static CelsAtomic RegistryEpoch = 0;
+static CelsAtomic ActiveReaders[2] = {0,0};
+static CodecRegistry* RetiredRegistries[2] = {NULL,NULL};
+
+static void FlushMethodCache (void);
+static void FlushInstancePools (void);
+
+// Services on chain strings like "rep+lzma" passed to Cels(), see the chain section below
+static int IsChainString (const char* str);
+static CelsResult ChainStringService (const char* chain_str, int service, CelsNum insize, void* inbuf, void* outbuf, void* ud, CelsCallback* cb);
+
+// Position in the registration order where codecs are inserted instead of appending them (-1), used by the thread holding
+// RegistryLock while a lazily loaded library registers its codecs, see LoadLazyModule()
+static int RegistryInsertPos = -1;
+
+// Names of codecs registered while recording is enabled (only by the thread holding RegistryLock), see AddLazyLibrary()
+static char* RecordedNames = NULL;
+static size_t RecordedNamesSize = 0;
+static void RecordCodecName (const char* name);
+
+// Stub codecs standing for libraries that CelsLoadLazy() found but didn't load yet
+typedef struct LazyModule LazyModule;
+static CelsResult __cdecl LazyModuleMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
+static int  LazyModuleLoaded (LazyModule* lazy);
+static void LoadLazyModule (LazyModule* lazy);
+
+// Start using the current snapshot
+static CodecRegistry* EnterRegistry (long* epoch)
+{
+    for (;;) {
+        long e = AtomicLoad (&RegistryEpoch);
+        AtomicAdd (&ActiveReaders[e&1], 1);
+        if (AtomicLoad (&RegistryEpoch) == e)  {*epoch = e;  return AtomicLoad (&Registry);}
+        AtomicAdd (&ActiveReaders[e&1], -1);   // epoch advanced meanwhile, retry with the new one
+    }
+}
+
+// Finish using the snapshot returned by EnterRegistry()
+static void LeaveRegistry (long epoch)
+{
+    AtomicAdd (&ActiveReaders[epoch&1], -1);
+}
+
+static void FreeRetiredRegistry (CodecRegistry* r)
+{
+    int i;
+    for (i=0;  i<3;  i++)
+        free (r->garbage[i]);
+    free (r);
+}
+
+// Free snapshots that can't be used by any reader anymore and advance the epoch. Called with RegistryLock held.
+static void ReclaimRegistries (void)
+{
+    int step;
+    for (step=0;  step<2;  step++) {
+        long e = AtomicLoad (&RegistryEpoch);
+        if (AtomicLoad (&ActiveReaders[(e-1)&1]) != 0)  return;   // readers of the previous epoch may still use snapshots retired during it
+        while (RetiredRegistries[(e-1)&1]) {
+            CodecRegistry* r = RetiredRegistries[(e-1)&1];
+            RetiredRegistries[(e-1)&1] = r->next_retired;
+            FreeRetiredRegistry (r);
+        }
+        AtomicAdd (&RegistryEpoch, 1);
+    }
+}
+
+// Return slot of the index holding the (name,len,wildcard) key, or empty slot where this key should be inserted
+static volatile int* FindCodecSlot (const CodecRegistry* r, const char* name, unsigned len, int wildcard, unsigned hash)
+{
+    unsigned mask = r->index_size-1,  i = hash & mask;
+    for (;;  i = (i+1) & mask) {
+        volatile int* slot = &r->index[i];
+        int n = AtomicLoad (slot);
+        if (n < 0)  return slot;
+        const RegCodec* codec = &r->codecs[n];
+        if (codec->hash==hash && codec->len==len && codec->wildcard==wildcard && !memcmp(codec->name, name, len))
+            return slot;
+    }
+}
+
+// Return number of the last codec in the snapshot registered with given key, or -1
+static int FindCodec (const CodecRegistry* r, const char* name, unsigned len, int wildcard)
+{
+    if (r==NULL || r->index_size==0)  return -1;
+    int n = AtomicLoad (FindCodecSlot (r, name, len, wildcard, StringHash(name,len)));
+    while (n >= r->num_codecs)   // skip codecs registered after the snapshot was taken
+        n = r->codecs[n].prev;
+    return n;
+}
+
+// Insert codec number n into the index. With link==0 the record isn't modified, since its prev field is already set
+// (records shared with published snapshots may be read concurrently, so rebuilding the index shouldn't store into them)
+static void IndexCodec (CodecRegistry* r, int n, int link)
+{
+    RegCodec* codec = &r->codecs[n];
+    volatile int* slot = FindCodecSlot (r, codec->name, codec->len, codec->wildcard, codec->hash);
+    if (*slot < 0)  r->num_index_keys++;
+    if (link)  codec->prev = *slot;
+    AtomicStore (slot, n);      // record should be complete before it becomes visible to readers
+}
+
+// Publish new snapshot including the codec, appended to the registration order or inserted at RegistryInsertPos.
+// Called with RegistryLock held.
+static CelsResult PublishCodec (const RegCodec* codec)
 {
-    // Add new record to the list of registered codecs
-    RegCodec* codec = (RegCodec*)  ExtendArray ((void**)&RegisteredCodecs, sizeof(RegCodec), &NumRegisteredCodecs, &MaxRegisteredCodecs);
-    if (codec==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    CodecRegistry* old = Registry;
+    CodecRegistry* r = (CodecRegistry*) malloc (sizeof(CodecRegistry));
+    if (r==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    if (old)  *r = *old;
+    else      memset (r, 0, sizeof(CodecRegistry));
+    r->garbage[0] = r->garbage[1] = r->garbage[2] = NULL;
+    r->next_retired = NULL;
+    int num = r->num_codecs,  max_codecs = MaxRegisteredCodecs,  i;
+    int insert = (RegistryInsertPos >= 0  &&  RegistryInsertPos < num),  pos = insert? RegistryInsertPos : num;
 
+    // Move records into larger array when the current one is full. Insertion always moves them,
+    // since records shared with published snapshots can't be shifted
+    if (num >= max_codecs  ||  insert) {
+        if (num >= max_codecs)  max_codecs = max_codecs*2 + 32;
+        RegCodec* codecs = (RegCodec*) malloc (max_codecs*sizeof(RegCodec));
+        if (codecs==NULL)  {free(r);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+        if (pos)        memcpy (codecs, r->codecs, pos*sizeof(RegCodec));
+        if (num > pos)  memcpy (codecs+pos+1, r->codecs+pos, (num-pos)*sizeof(RegCodec));
+        r->codecs = codecs;
+    }
+
+    // Wildcard lengths are copied on every insertion, keeping the old list intact for readers
+    if (codec->wildcard) {
+        int n = r->num_wildcard_lengths;
+        for (i=0;  i<n && r->wildcard_lengths[i] < codec->len;  i++);
+        if (i==n  ||  r->wildcard_lengths[i] != codec->len) {
+            unsigned* lengths = (unsigned*) malloc ((n+1)*sizeof(unsigned));
+            if (lengths==NULL)  goto no_memory;
+            memcpy (lengths, r->wildcard_lengths, i*sizeof(unsigned));
+            lengths[i] = codec->len;
+            memcpy (lengths+i+1, r->wildcard_lengths+i, (n-i)*sizeof(unsigned));
+            r->wildcard_lengths = lengths;
+            r->num_wildcard_lengths = n+1;
+        }
+    }
+
+    // Append (or insert) the record
+    r->codecs[pos] = *codec;
+    r->num_codecs = num+1;
+
+    // Rebuild the index when it becomes too dense or when records were moved, otherwise update it in place
+    if (r->codecs != (old? old->codecs : NULL)  ||  (r->num_index_keys+1)*2 > r->index_size) {
+        int new_size = 64;
+        while (new_size < r->num_codecs*2)  new_size *= 2;
+        int* index = (int*) malloc (new_size*sizeof(int));
+        if (index==NULL)  goto no_memory;
+        for (i=0;  i<new_size;  i++)
+            index[i] = -1;
+        r->index = index;
+        r->index_size = new_size;
+        r->num_index_keys = 0;
+        // Reinsert codecs in the registration order, so every slot ends up with the last codec of its chain.
+        // The chains themselves don't change on append, so only the new record is linked; after insertion
+        // all records are relinked, being not shared with any snapshot yet
+        for (i=0;  i<num+insert;  i++)
+            IndexCodec (r, i, insert);
+    }
+    if (!insert)  IndexCodec (r, num, 1);
+
+    // Make the new snapshot current and retire the old one together with arrays it doesn't share with the new one
+    AtomicStore (&Registry, r);
+    if (old) {
+        if (old->codecs != r->codecs)                      old->garbage[0] = old->codecs;
+        if (old->index != r->index)                        old->garbage[1] = old->index;
+        if (old->wildcard_lengths != r->wildcard_lengths)  old->garbage[2] = old->wildcard_lengths;
+        old->next_retired = RetiredRegistries[RegistryEpoch&1];
+        RetiredRegistries[RegistryEpoch&1] = old;
+    }
+    MaxRegisteredCodecs = max_codecs;
+    if (insert)  RegistryInsertPos++;     // next codec of the library goes after this one
+    ReclaimRegistries();
+    return CELS_OK;
+
+no_memory:
+    if (r->wildcard_lengths != (old? old->wildcard_lengths : NULL))  free (r->wildcard_lengths);
+    if (r->codecs != (old? old->codecs : NULL))                      free (r->codecs);
+    free (r);
+    return CELS_ERROR_NOT_ENOUGH_MEMORY;
+}
+
+CelsResult CelsRegister (const char* name, void* ud, CelsFunction* CelsMain)
+{
     // Fill the record
+    RegCodec codec;
     if (*name=='\0')  name = "*";
     const char* wildcard = strchr(name,'*');  // points to a first char after fixed part of wildcard name
-    codec->name     = name;
-    codec->self     = ud;
-    codec->CelsMain = CelsMain;
-    codec->hash     = wildcard? wildcard-name : StringHash(name);   // wildcard: size of fixed part, otherwise: hash of the method name
+    codec.name     = name;
+    codec.self     = ud;
+    codec.CelsMain = CelsMain;
+    codec.wildcard = (wildcard != NULL);
+    codec.len      = wildcard? wildcard-name : strlen(name);
+    codec.hash     = StringHash (name, codec.len);
+    codec.prev     = -1;
 
     // Initialize the codec
-    CelsResult result = codec->CelsMain (codec->self, CELS_LOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+    CelsResult result = CelsMain (ud, CELS_LOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
     if (result == CELS_ERROR_NOT_IMPLEMENTED)   result = CELS_OK;
-    if (result < CELS_OK)                       --NumRegisteredCodecs;
+    if (result < CELS_OK)                       return result;
+    codec.stats = (CelsStats*) calloc (1, sizeof(CelsStats));
+    if (codec.stats == NULL) {
+        CelsMain (ud, CELS_UNLOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+        return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    // Add the record to the list of registered codecs
+    RecursiveLock (&RegistryLock);
+    CelsResult errcode = PublishCodec (&codec);
+    if (errcode >= CELS_OK  &&  RecordedNames)  RecordCodecName (name);
+    RecursiveUnlock (&RegistryLock);
+    if (errcode < CELS_OK) {
+        CelsMain (ud, CELS_UNLOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+        free (codec.stats);
+        return errcode;
+    }
+
+    // Cached methods may be parsed by codecs that the new one overrides
+    FlushMethodCache();
     return result;
 }
 
+// Table of built-in codecs declared by CELS_STATIC_CODEC(), see CELS.h
+#if defined(_WIN32)
+// The linker merges "CelsStaticCodecs$*" sections sorted by the suffix, so entries ("$m") lie between these markers
+#if defined(_MSC_VER)
+#pragma section("CelsStaticCodecs$a", read)
+#pragma section("CelsStaticCodecs$z", read)
+__declspec(allocate("CelsStaticCodecs$a")) static const CelsStaticCodec StaticCodecsBegin = {NULL,NULL,NULL,0,0};
+__declspec(allocate("CelsStaticCodecs$z")) static const CelsStaticCodec StaticCodecsEnd   = {NULL,NULL,NULL,0,0};
+#else
+__attribute__((used, section("CelsStaticCodecs$a"), aligned(sizeof(void*)))) static const CelsStaticCodec StaticCodecsBegin = {NULL,NULL,NULL,0,0};
+__attribute__((used, section("CelsStaticCodecs$z"), aligned(sizeof(void*)))) static const CelsStaticCodec StaticCodecsEnd   = {NULL,NULL,NULL,0,0};
+#endif
+static const CelsStaticCodec* StaticCodecsFirst (void)  {return &StaticCodecsBegin + 1;}
+static const CelsStaticCodec* StaticCodecsLast  (void)  {return &StaticCodecsEnd;}
+#elif defined(__APPLE__)
+extern const CelsStaticCodec StaticCodecsBegin __asm("section$start$__DATA$CelsStaticCodecs");
+extern const CelsStaticCodec StaticCodecsEnd   __asm("section$end$__DATA$CelsStaticCodecs");
+static const CelsStaticCodec* StaticCodecsFirst (void)  {return &StaticCodecsBegin;}
+static const CelsStaticCodec* StaticCodecsLast  (void)  {return &StaticCodecsEnd;}
+#else
+// Defined by the linker when the program has at least one entry
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern const CelsStaticCodec __start_CelsStaticCodecs[] __attribute__((weak));
+extern const CelsStaticCodec __stop_CelsStaticCodecs[]  __attribute__((weak));
+#ifdef __cplusplus
+}
+#endif
+static const CelsStaticCodec* StaticCodecsFirst (void)  {return __start_CelsStaticCodecs;}
+static const CelsStaticCodec* StaticCodecsLast  (void)  {return __stop_CelsStaticCodecs;}
+#endif
+
+// Index of built-in codecs, built on first use and kept until the program exit
+static CodecRegistry* volatile BuiltinRegistry = NULL;
+static CelsSpinLock BuiltinRegistryLock = 0;
+
+// Order of indexing built-in codecs: lower priority first, so the higher one is found first
+static int CompareStaticCodecs (const void* a, const void* b)
+{
+    const CelsStaticCodec *x = *(const CelsStaticCodec**)a,  *y = *(const CelsStaticCodec**)b;
+    if (x->priority != y->priority)  return x->priority < y->priority? -1 : 1;
+    return x<y? -1 : x>y? 1 : 0;
+}
+
+static CodecRegistry* BuildBuiltinRegistry (void)
+{
+    const CelsStaticCodec *first = StaticCodecsFirst(),  *last = StaticCodecsLast(),  *p;
+    int max_codecs = first<last? last-first : 0,  i;
+    CodecRegistry* r = (CodecRegistry*) calloc (1, sizeof(CodecRegistry));
+    if (r==NULL)  return NULL;
+    if (max_codecs == 0)  return r;
+
+    int index_size = 64;
+    while (index_size < max_codecs*2)  index_size *= 2;
+    const CelsStaticCodec** order = (const CelsStaticCodec**) malloc (max_codecs*sizeof(CelsStaticCodec*));
+    r->codecs           = (RegCodec*) malloc (max_codecs*sizeof(RegCodec));
+    r->wildcard_lengths = (unsigned*) malloc (max_codecs*sizeof(unsigned));
+    r->index            = (int*)      malloc (index_size*sizeof(int));
+    CelsStats* stats    = (CelsStats*)calloc (max_codecs, sizeof(CelsStats));
+    if (order==NULL || r->codecs==NULL || r->wildcard_lengths==NULL || r->index==NULL || stats==NULL) {
+        free (order);  free (r->codecs);  free (r->wildcard_lengths);  free (r->index);  free (stats);  free (r);
+        return NULL;
+    }
+    r->index_size = index_size;
+    for (i=0;  i<index_size;  i++)
+        r->index[i] = -1;
+
+    // Skip padding that the linker may insert between entries
+    int num = 0,  k;
+    for (p=first;  p<last;  p++)
+        if (p->CelsMain)  order[num++] = p;
+    qsort (order, num, sizeof(*order), CompareStaticCodecs);
+
+    for (k=0;  k<num;  k++) {
+        p = order[k];
+        RegCodec* codec = &r->codecs[r->num_codecs];
+        const char* name = (p->name==NULL || *p->name=='\0')? "*" : p->name;
+        const char* wildcard = strchr(name,'*');
+        codec->name     = name;
+        codec->self     = p->self;
+        codec->CelsMain = p->CelsMain;
+        codec->wildcard = (wildcard != NULL);
+        codec->len      = wildcard? wildcard-name : strlen(name);
+        codec->hash     = p->hash? p->hash : StringHash (name, codec->len);
+        codec->prev     = -1;
+        codec->stats    = &stats[k];
+
+        if (codec->wildcard) {
+            int n = r->num_wildcard_lengths;
+            for (i=0;  i<n && r->wildcard_lengths[i] < codec->len;  i++);
+            if (i==n  ||  r->wildcard_lengths[i] != codec->len) {
+                memmove (r->wildcard_lengths+i+1, r->wildcard_lengths+i, (n-i)*sizeof(unsigned));
+                r->wildcard_lengths[i] = codec->len;
+                r->num_wildcard_lengths = n+1;
+            }
+        }
+        IndexCodec (r, r->num_codecs++, 1);
+    }
+    free (order);
+    return r;
+}
+
+// Return index of built-in codecs (NULL if there is not enough memory to build it)
+static CodecRegistry* BuiltinCodecs (void)
+{
+    CodecRegistry* r = AtomicLoad (&BuiltinRegistry);
+    if (r)  return r;
+    SpinLock (&BuiltinRegistryLock);
+    r = BuiltinRegistry;
+    if (r==NULL) {
+        r = BuildBuiltinRegistry();
+        AtomicStore (&BuiltinRegistry, r);     // the index should be complete before it becomes visible to readers
+    }
+    SpinUnlock (&BuiltinRegistryLock);
+    return r;
+}
+
+// Append names of the snapshot codecs missing in the (outbuf,*pos) list
+static CelsResult ListRegistryCodecs (const CodecRegistry* r, char* outbuf, CelsNum outsize, CelsNum* pos, int* count)
+{
+    int i;
+    for (i=0;  r && i<r->num_codecs;  i++) {
+        const char* name = r->codecs[i].name;
+        CelsNum len = strlen(name),  k;
+        for (k=0;  k < *pos  &&  strcmp (outbuf+k, name) != 0;  k += strlen(outbuf+k)+1);
+        if (k < *pos)  continue;
+        if (*pos + len + 2 > outsize)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+        memcpy (outbuf + *pos, name, len+1);
+        *pos += len+1;
+        (*count)++;
+    }
+    return CELS_OK;
+}
+
+CelsResult CelsListCodecs (char* outbuf, CelsNum outsize)
+{
+    CelsNum pos = 0;
+    int count = 0;
+    if (outsize < 1)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+    long epoch;
+    CodecRegistry* r = EnterRegistry (&epoch);
+    CelsResult result = ListRegistryCodecs (r, outbuf,outsize, &pos, &count);
+    LeaveRegistry (epoch);
+    if (result >= CELS_OK)
+        result = ListRegistryCodecs (BuiltinCodecs(), outbuf,outsize, &pos, &count);
+    outbuf[pos] = '\0';
+    return result < CELS_OK?  result : count;
+}
+
 // Internal structure placed before parsed compression method
 typedef struct
 {
@@ -107,18 +600,193 @@ typedef struct
     void*         CodecSelf;
     CelsFunction* CelsMain;
     const char*   CodecName;
+    // Handlers of frequent services, either taken from CELS_GET_SERVICE_TABLE or equal to CelsMain
+    CelsFunction* Compress;
+    CelsFunction* Decompress;
+    CelsFunction* Get;
+    CelsFunction* Set;
+    CelsStats     Stats;        // totals of operations on this instance, returned by the "stats" named service
+    CelsStats*    CodecStats;   // totals of the codec in the registry, updated at the end of every operation
+    int           MemoryKnown;  // bit 0/1: compression/decompression memory was already added to Stats.peak_memory
 } CELS_CODEC_INSTANCE;
 
 const int CELS_HEADER = sizeof(CELS_CODEC_INSTANCE);
 
+// Guards peak_memory of registered codecs; other counters of them are updated by atomic adds from operations in all threads
+static CelsSpinLock StatsLock = 0;
+// Other counters are always collected, but CPU time costs two system calls per operation on some platforms, so it's optional
+static volatile int CpuTimeStatsEnabled = 0;
+
+void CelsEnableCpuTimeStats (int enable)
+{
+    CpuTimeStatsEnabled = enable;
+}
+
+static void AddStats (CelsStats* total, const CelsStats* op)
+{
+    total->operations  += op->operations;
+    total->errors      += op->errors;
+    total->bytes_in    += op->bytes_in;
+    total->bytes_out   += op->bytes_out;
+    total->wall_time   += op->wall_time;
+    total->cpu_time    += op->cpu_time;
+    total->callbacks   += op->callbacks;
+    if (total->peak_memory < op->peak_memory)  total->peak_memory = op->peak_memory;
+}
+
+// Add counters of the operation to the codec totals shared by all threads
+static void AddCodecStats (CelsStats* total, const CelsStats* op)
+{
+    AtomicAddNum ((CelsAtomicNum*) &total->operations, op->operations);
+    if (op->errors)     AtomicAddNum ((CelsAtomicNum*) &total->errors,     op->errors);
+    if (op->bytes_in)   AtomicAddNum ((CelsAtomicNum*) &total->bytes_in,   op->bytes_in);
+    if (op->bytes_out)  AtomicAddNum ((CelsAtomicNum*) &total->bytes_out,  op->bytes_out);
+    AtomicAddNum ((CelsAtomicNum*) &total->wall_time, op->wall_time);
+    if (op->cpu_time)   AtomicAddNum ((CelsAtomicNum*) &total->cpu_time,   op->cpu_time);
+    if (op->callbacks)  AtomicAddNum ((CelsAtomicNum*) &total->callbacks,  op->callbacks);
+    if (op->peak_memory > AtomicLoad (&total->peak_memory)) {
+        SpinLock (&StatsLock);
+        if (total->peak_memory < op->peak_memory)  AtomicStore (&total->peak_memory, op->peak_memory);
+        SpinUnlock (&StatsLock);
+    }
+}
+
+// Callback passed to the codec by CountedOperation(), counting calls and data passed through it.
+// Calls from the thread running the operation are counted in plain fields, and only calls from other threads
+// (started by the codec) need atomic counters
+typedef struct {
+    void*          ud;
+    CelsCallback*  cb;
+    CelsThreadId   thread;
+    CelsNum        callbacks,  bytes_in,  bytes_out;
+    CelsAtomicNum  shared_callbacks,  shared_bytes_in,  shared_bytes_out;
+} StatsCall;
+
+static CelsResult __cdecl StatsCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    StatsCall* call = (StatsCall*) self;
+    CelsResult result = call->cb (call->ud, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+    CelsNum in = 0,  out = 0;
+    if (result > 0) {
+        if (service==CELS_READ  ||  service==CELS_READV  ||  service==CELS_RECEIVE_FILLED_INBUF)   in  = result;
+        else if (service==CELS_WRITE  ||  service==CELS_WRITEV)                                 out = result;
+    }
+    if (service==CELS_SEND_FILLED_OUTBUF  &&  result >= CELS_OK)                                out = outsize;
+
+    if (SameThread (CurrentThread(), call->thread)) {
+        call->callbacks++;
+        call->bytes_in  += in;
+        call->bytes_out += out;
+    } else {
+        AtomicAddNum (&call->shared_callbacks, 1);
+        if (in)   AtomicAddNum (&call->shared_bytes_in,  in);
+        if (out)  AtomicAddNum (&call->shared_bytes_out, out);
+    }
+    return result;
+}
+
+// Run (de)compression service on the instance, adding its time, data and callbacks to the instance and codec stats.
+// Memory is asked from the codec only on the first operation of each direction, since it's fixed by the parsed parameters
+static CelsResult CountedOperation (CELS_CODEC_INSTANCE* instance, CelsFunction* handler, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    StatsCall call;
+    call.ud = ud;
+    call.cb = cb;
+    call.thread = CurrentThread();
+    call.callbacks = call.bytes_in = call.bytes_out = 0;
+    call.shared_callbacks = call.shared_bytes_in = call.shared_bytes_out = 0;
+    int step = (service==CELS_COMPRESS_STEP  ||  service==CELS_DECOMPRESS_STEP);
+    CelsStepBuffers* buffers = (CelsStepBuffers*) inbuf;
+    CelsNum inpos  = step && buffers? buffers->inpos  : 0;
+    CelsNum outpos = step && buffers? buffers->outpos : 0;
+    int measure_cpu = CpuTimeStatsEnabled;
+    CelsNum wall_time = NanoTime(),  cpu_time = measure_cpu? ThreadCpuTime() : 0;
+
+    CelsResult result = handler (instance+1, service,subservice, inbuf,insize, outbuf,outsize, cb? &call:ud, cb? (CelsCallback*)StatsCallback:cb);
+    if (result == CELS_ERROR_NOT_IMPLEMENTED)  return result;   // the caller will retry with another service or mode
+
+    CelsStats op;
+    op.cpu_time    = measure_cpu? ThreadCpuTime() - cpu_time : 0;
+    op.wall_time   = NanoTime() - wall_time;
+    op.operations  = 1;
+    op.errors      = (result < CELS_OK);
+    op.callbacks   = call.callbacks  + call.shared_callbacks;
+    op.bytes_in    = call.bytes_in   + call.shared_bytes_in;
+    op.bytes_out   = call.bytes_out  + call.shared_bytes_out;
+    op.peak_memory = 0;
+    if (step && buffers) {
+        op.bytes_in  += buffers->inpos  - inpos;
+        op.bytes_out += buffers->outpos - outpos;
+    } else if (result >= CELS_OK) {
+        if (inbuf)  op.bytes_in  += insize;
+        if (outbuf) op.bytes_out += result;
+    }
+    int compress = (service==CELS_COMPRESS  ||  service==CELS_COMPRESS_STEP);
+    if (!(instance->MemoryKnown & (compress? 1 : 2))) {
+        CelsResult memory = instance->Get (instance+1, compress? CELS_GET_COMPRESSION_MEMORY : CELS_GET_DECOMPRESSION_MEMORY,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+        if (memory > 0)  op.peak_memory = memory;
+        instance->MemoryKnown |= (compress? 1 : 2);
+    }
+    AddStats (&instance->Stats, &op);
+    if (instance->CodecStats)  AddCodecStats (instance->CodecStats, &op);
+    return result;
+}
+
+// Add stats of the snapshot codecs named exactly as name
+static int SumRegistryStats (const CodecRegistry* r, const char* name, CelsStats* stats)
+{
+    int i,  found = 0;
+    for (i=0;  r && i<r->num_codecs;  i++)
+        if (strcmp (r->codecs[i].name, name) == 0) {
+            const CelsStats* codec = r->codecs[i].stats;
+            CelsStats total;
+            total.operations  = AtomicLoad (&codec->operations);
+            total.errors      = AtomicLoad (&codec->errors);
+            total.bytes_in    = AtomicLoad (&codec->bytes_in);
+            total.bytes_out   = AtomicLoad (&codec->bytes_out);
+            total.wall_time   = AtomicLoad (&codec->wall_time);
+            total.cpu_time    = AtomicLoad (&codec->cpu_time);
+            total.callbacks   = AtomicLoad (&codec->callbacks);
+            total.peak_memory = AtomicLoad (&codec->peak_memory);
+            AddStats (stats, &total);
+            found = 1;
+        }
+    return found;
+}
+
+CelsResult CelsGetCodecStats (const char* name, CelsStats* stats)
+{
+    memset (stats, 0, sizeof(CelsStats));
+    long epoch;
+    CodecRegistry* r = EnterRegistry (&epoch);
+    int found = SumRegistryStats (r, name, stats);
+    LeaveRegistry (epoch);
+    found |= SumRegistryStats (BuiltinCodecs(), name, stats);
+    return found? CELS_OK : CELS_ERROR_INVALID_COMPRESSOR;
+}
+
 // Execute operation on parsed codec instance.
 // Only this function and CelsParseSplitted() deals with instance internals.
 static CelsResult CallCels (void* method, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
 {
     CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
     if (IS_CELS_INSTANCE_SERVICE(service)) {
-        // Run requested service on the instance
-        CelsNum result = instance->CelsMain (instance+1, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+        // Run requested service on the instance, going directly to the handler of the service when the codec provides one
+        CelsFunction* handler = service==CELS_COMPRESS?                     instance->Compress   :
+                                service==CELS_DECOMPRESS?                   instance->Decompress :
+                                service >= CELS_GET_EXPAND_DATA?
+                                    (IS_CELS_SET_INSTANCE_PARAM_SERVICE(service)? instance->Set : instance->Get) :
+                                                                            instance->CelsMain;
+        if (service >= CELS_COMPRESS  &&  service <= CELS_DECOMPRESS_STEP)
+            return CountedOperation (instance, handler, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+        if (service==CELS_GET_NAMED_SERVICE  &&  inbuf  &&  strcmp ((const char*)inbuf, CELS_STATS_SERVICE) == 0) {
+            // Stats are kept by the core for every codec; copy as much of the structure as the caller has space for
+            CelsNum size = outsize < (CelsNum)sizeof(CelsStats)?  outsize : sizeof(CelsStats);
+            if (outbuf==NULL  ||  size <= 0)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+            memcpy (outbuf, &instance->Stats, size);
+            return size;
+        }
+        CelsNum result = handler (instance+1, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
         if (result==CELS_ERROR_NOT_IMPLEMENTED && service==CELS_UNPARSE && instance->CodecName) {
             // Codec lacks PARSE/UNPARSE functionality
             if (strlen(instance->CodecName) >= outsize)
@@ -133,67 +801,264 @@ static CelsResult CallCels (void* method, int service, CelsNum subservice, void*
     }
 }
 
-// Parse method already splitted into separate parameters and save parsed method into (method,method_size) buffer.\
+// Parameters of the method being parsed. Codecs receive them either as views into the original string (CELS_PARSE_VIEWS)
+// or as NUL-terminated strings (CELS_PARSE); the latter are made only when the first codec requiring them is tried.
+typedef struct {
+    const CelsStrView*  views;
+    int                 num_params;
+    char const* const*  parameters;         // NULL-terminated list, or NULL until SplitParameters() is called
+    void*               allocated[2];       // heap blocks used when local arrays are too small, freed by FreeMethodParams()
+    CelsStrView         local_views[64];
+    const char*         local_parameters[64];
+    char                local_copy[CELS_MAX_METHOD_STRING_SIZE];
+} MethodParams;
+
+static void InitMethodParams (MethodParams* p)
+{
+    p->views = NULL;
+    p->num_params = 0;
+    p->parameters = NULL;
+    p->allocated[0] = p->allocated[1] = NULL;
+}
+
+static void FreeMethodParams (MethodParams* p)
+{
+    free (p->allocated[0]);
+    free (p->allocated[1]);
+}
+
+// Return array of num_params views, using the local array when possible
+static CelsStrView* AllocViews (MethodParams* p, CelsNum num_params)
+{
+    if (num_params <= 64)  return p->local_views;
+    if (num_params > INT_MAX / (CelsNum)sizeof(CelsStrView))  return NULL;
+    return (CelsStrView*) (p->allocated[0] = malloc (num_params*sizeof(CelsStrView)));
+}
+
+// Return parameters as NUL-terminated strings, copying them on the first call
+static char const* const* SplitParameters (MethodParams* p)
+{
+    if (p->parameters)  return p->parameters;
+
+    CelsNum total = 0;  int i;
+    for (i=0;  i<p->num_params;  i++)
+        total += p->views[i].len + 1;
+
+    const char** parameters = p->local_parameters;
+    char* copy = p->local_copy;
+    if (p->num_params+1 > 64  ||  total > CELS_MAX_METHOD_STRING_SIZE) {
+        char* block = (char*) malloc ((p->num_params+1)*sizeof(char*) + total);
+        if (block==NULL)  return NULL;
+        p->allocated[1] = block;
+        parameters = (const char**) block;
+        copy = block + (p->num_params+1)*sizeof(char*);
+    }
+
+    for (i=0;  i<p->num_params;  i++) {
+        parameters[i] = copy;
+        memcpy (copy, p->views[i].str, p->views[i].len);
+        copy += p->views[i].len;
+        *copy++ = '\0';
+    }
+    parameters[p->num_params] = NULL;
+    return p->parameters = parameters;
+}
+
+// Try to parse method with the given codec and save parsed method into (method,method_size) buffer.
+// Returns size of the codec-specific part of parsed method or error code.
+static CelsResult ParseWithCodec (RegCodec* codec, int exact_name_match, MethodParams* params, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
+{
+    CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
+    *(char*)instance    = 0;
+    instance->CodecMain = codec->CelsMain;
+    instance->CodecSelf = codec->self;
+    instance->CelsMain  = codec->CelsMain;
+    instance->CodecName = NULL;
+    instance->Compress  = instance->Decompress = instance->Get = instance->Set = codec->CelsMain;
+    instance->CodecStats = codec->stats;
+    memset (&instance->Stats, 0, sizeof(instance->Stats));
+    instance->MemoryKnown = 0;
+
+    CelsResult errcode_or_size = codec->CelsMain (codec->self, CELS_PARSE_VIEWS,0, (void*)params->views,params->num_params,
+                                                  instance+1, method_size-CELS_HEADER, ud,cb);
+
+    if (errcode_or_size == CELS_ERROR_NOT_IMPLEMENTED) {
+        // Codec accepts only NUL-terminated parameters
+        char const* const* parameters = SplitParameters (params);
+        if (parameters==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        errcode_or_size = codec->CelsMain (codec->self, CELS_PARSE,0, (void*)parameters,0,
+                                           instance+1, method_size-CELS_HEADER, ud,cb);
+    }
+
+    if (errcode_or_size == CELS_ERROR_NOT_IMPLEMENTED  &&  params->num_params == 1  &&  exact_name_match) {
+        // Parsing isn't implemented that means method w/o parameters
+        instance->CodecName = codec->name;   // will be used for CELS_UNPARSE if it's not supported too
+        errcode_or_size = 0;
+    }
+    return errcode_or_size;
+}
+
+// Try codecs of the snapshot matching the first parameter, starting with the last registered one.
+// Return size of the record parsed by the first succeeded codec or error code returned by the last tried one
+// (errcode_or_size if none was tried). When the search reaches a library found by CelsLoadLazy(), stop and return it in *lazy.
+static CelsResult ParseWithRegistry (const CodecRegistry* r, MethodParams* params, void* method, CelsNum method_size, void* ud, CelsCallback* cb, CelsResult errcode_or_size, LazyModule** lazy)
+{
+    const char* name = params->views[0].str;
+    size_t len = (size_t) params->views[0].len;
+    int num_wildcard_lengths = r? r->num_wildcard_lengths : 0;
+
+    // Find chains of codecs registered with exact name (heads[0]) and with wildcard names like "aes*" matching the name
+    int local_heads[64],  *heads = local_heads,  num_heads = 0,  i;
+    if (num_wildcard_lengths+1 > 64) {
+        heads = (int*) malloc ((num_wildcard_lengths+1)*sizeof(int));
+        if (heads==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    }
+    heads[num_heads++] = FindCodec (r, name, len, 0);
+    for (i=0;  i<num_wildcard_lengths && r->wildcard_lengths[i]<=len;  i++)
+        heads[num_heads++] = FindCodec (r, name, r->wildcard_lengths[i], 1);
+
+    // Try matching codecs starting with the last registered one
+    for (;;)
+    {
+        int best = -1,  best_head = 0;
+        for (i=0;  i<num_heads;  i++)
+            if (heads[i] > best)  best = heads[i],  best_head = i;
+        if (best < 0)  break;
+
+        RegCodec* codec = &r->codecs[best];
+        heads[best_head] = codec->prev;
+
+        if (codec->CelsMain == LazyModuleMain) {
+            // The library should be loaded and the search repeated, now including codecs it registered.
+            // When another thread already loaded it, its codecs are missing only from a snapshot older than the current one
+            if (LazyModuleLoaded ((LazyModule*) codec->self)  &&  AtomicLoad (&Registry) == r)  continue;
+            *lazy = (LazyModule*) codec->self;
+            break;
+        }
+
+        errcode_or_size = ParseWithCodec (codec, best_head==0, params, method,method_size, ud,cb);
+        if (errcode_or_size >= 0)  break;
+    }
+
+    if (heads != local_heads)  free(heads);
+    return errcode_or_size;
+}
+
+// Parse method already splitted into separate parameters and save parsed method into (method,method_size) buffer.
 // Only this function creates new codec instances.
-CelsResult CelsParseSplitted (char const* const* parameters, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
+static CelsResult ParseMethod (MethodParams* params, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
 {
-    const char* name = parameters[0];
-    unsigned hash = StringHash(name);
-    unsigned len = strlen(name);
     CelsResult errcode_or_size = CELS_ERROR_GENERAL;
-    RegCodec* codec;
-
-    for (codec = RegisteredCodecs+NumRegisteredCodecs;  codec-- > RegisteredCodecs; )
-    {
-        // Try only registered codecs with matching name (including wildcards like "aes*")
-        int exact_name_match  =  codec->hash==hash && !strcmp(codec->name, name);   // check for exact name match
-        if (exact_name_match ||  codec->hash<=len && !strncmp(codec->name, name, codec->hash)
-                                 &&  strlen(codec->name) < codec->hash  &&  codec->name[codec->hash]=='*')
-        {
-            CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
-            *(char*)instance    = 0;
-            instance->CodecMain = codec->CelsMain;
-            instance->CodecSelf = codec->self;
-            instance->CelsMain  = codec->CelsMain;
-            instance->CodecName = NULL;
-
-            errcode_or_size = codec->CelsMain (codec->self, CELS_PARSE,0, (void*)parameters,0,
-                                               instance+1, method_size-CELS_HEADER, ud,cb);
-
-            if (errcode_or_size == CELS_ERROR_NOT_IMPLEMENTED  &&  parameters[1] == NULL  &&  exact_name_match) {
-                // Parsing isn't implemented that means method w/o parameters
-                instance->CodecName = codec->name;   // will be used for CELS_UNPARSE if it's not supported too
-                errcode_or_size = 0;
-            }
+    if (params->num_params < 1)  return CELS_ERROR_INVALID_COMPRESSOR;
+
+    // Lock-free search in the registry snapshot, restarted after loading library on first use
+    for (;;) {
+        long epoch;
+        LazyModule* lazy = NULL;
+        CodecRegistry* r = EnterRegistry (&epoch);
+        errcode_or_size = ParseWithRegistry (r, params, method,method_size, ud,cb, errcode_or_size, &lazy);
+        LeaveRegistry (epoch);
+        if (lazy==NULL)  break;
+        LoadLazyModule (lazy);
+    }
 
-            if (errcode_or_size >= 0) {
-                // Allow instance to initialize itself
-                CelsResult result = CallCels (method, CELS_INITIALIZE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
-                if (result < CELS_OK  &&  result != CELS_ERROR_NOT_IMPLEMENTED)
-                    return result;
+    // Built-in codecs are tried after all registered ones
+    if (errcode_or_size < 0) {
+        LazyModule* lazy = NULL;
+        errcode_or_size = ParseWithRegistry (BuiltinCodecs(), params, method,method_size, ud,cb, errcode_or_size, &lazy);
+    }
 
-                // Successful parsing - errcode_or_size contains size of parsed record
-                return CELS_HEADER + errcode_or_size;
-            }
+    if (errcode_or_size >= 0) {
+        // Use direct handlers of the services implemented by the codec
+        CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
+        const CelsServiceTable* table = NULL;
+        if (instance->CelsMain (instance+1, CELS_GET_SERVICE_TABLE,0, NULL,0, &table,sizeof(table), NULL,(CelsCallback*)Cels) >= CELS_OK  &&  table) {
+            if (table->compress)    instance->Compress   = table->compress;
+            if (table->decompress)  instance->Decompress = table->decompress;
+            if (table->get)         instance->Get        = table->get;
+            if (table->set)         instance->Set        = table->set;
         }
+
+        // Allow instance to initialize itself
+        CelsResult result = CallCels (method, CELS_INITIALIZE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+        if (result < CELS_OK  &&  result != CELS_ERROR_NOT_IMPLEMENTED)
+            return result;
+
+        // Successful parsing - errcode_or_size contains size of parsed record
+        return CELS_HEADER + errcode_or_size;
     }
     return errcode_or_size;   // last error code returned by CELS_PARSE
 }
 
-// Parse method_str and save parsed method into (method,method_size) buffer
-CelsResult CelsParseStr (const char* method_str, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
+CelsResult CelsParseSplitted (char const* const* parameters, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
 {
-    // Make modifiable copy of method_str
-    char method_copy[CELS_MAX_METHOD_STRING_SIZE];  int i;
-    for (i=0;  i<CELS_MAX_METHOD_STRING_SIZE-1 && method_str[i]!=0;  i++)
-        method_copy[i] = method_str[i];
-    method_copy[i] = 0;
+    MethodParams params;
+    InitMethodParams (&params);
+    CelsNum num_params = 0,  i;
+    while (parameters[num_params])  num_params++;
+
+    CelsStrView* views = AllocViews (&params, num_params);
+    CelsResult errcode_or_size = CELS_ERROR_NOT_ENOUGH_MEMORY;
+    if (views) {
+        for (i=0;  i<num_params;  i++)
+            views[i].str = parameters[i],  views[i].len = strlen(parameters[i]);
+        params.views      = views;
+        params.num_params = (int) num_params;
+        params.parameters = parameters;
+        errcode_or_size = ParseMethod (&params, method,method_size, ud,cb);
+    }
+    FreeMethodParams (&params);
+    return errcode_or_size;
+}
+
+CelsResult CelsParseViews (const CelsStrView* parameters, CelsNum num_parameters, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
+{
+    if (num_parameters < 1  ||  num_parameters > INT_MAX)  return CELS_ERROR_INVALID_COMPRESSOR;
+    MethodParams params;
+    InitMethodParams (&params);
+    params.views      = parameters;
+    params.num_params = (int) num_parameters;
+    CelsResult errcode_or_size = ParseMethod (&params, method,method_size, ud,cb);
+    FreeMethodParams (&params);
+    return errcode_or_size;
+}
+
+// Parse method string of given length (it may be not NUL-terminated) without copying it
+CelsResult CelsParseView (const char* method_str, CelsNum len, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
+{
+    if (len < 0)  return CELS_ERROR_INVALID_COMPRESSOR;
+    MethodParams params;
+    InitMethodParams (&params);
 
     // Split method_str into parameters delimited by ':'
-    char *parameters[CELS_MAX_METHOD_PARAMETERS];
-    SplitStr (method_copy, CELS_METHOD_PARAMETERS_DELIMITER, parameters, CELS_MAX_METHOD_PARAMETERS);
+    CelsNum num_params = 1,  i;
+    for (i=0;  i<len;  i++)
+        if (method_str[i] == CELS_METHOD_PARAMETERS_DELIMITER)  num_params++;
 
-    return CelsParseSplitted ((const char**) parameters, method,method_size, ud,cb);
+    CelsStrView* views = AllocViews (&params, num_params);
+    CelsResult errcode_or_size = CELS_ERROR_NOT_ENOUGH_MEMORY;
+    if (views) {
+        const char* param = method_str;
+        int n = 0;
+        for (i=0;  i<len;  i++) {
+            if (method_str[i] == CELS_METHOD_PARAMETERS_DELIMITER) {
+                views[n].str = param,  views[n].len = method_str+i - param,  n++;
+                param = method_str+i+1;
+            }
+        }
+        views[n].str = param,  views[n].len = method_str+len - param;
+        params.views      = views;
+        params.num_params = (int) num_params;
+        errcode_or_size = ParseMethod (&params, method,method_size, ud,cb);
+    }
+    FreeMethodParams (&params);
+    return errcode_or_size;
+}
+
+// Parse method_str and save parsed method into (method,method_size) buffer
+CelsResult CelsParseStr (const char* method_str, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
+{
+    return CelsParseView (method_str, strlen(method_str), method,method_size, ud,cb);
 }
 
 
@@ -210,7 +1075,7 @@ static RegModule* RegisteredModules = NULL;
 static int NumRegisteredModules = 0;
 static int MaxRegisteredModules = 0;
 
-CelsResult CelsRegisterModule (void* dll, const char* method_name, CelsFunction* CelsMain)
+static CelsResult RegisterModule (void* dll, const char* method_name, CelsFunction* CelsMain)
 {
     RegModule* module = (RegModule*)  ExtendArray ((void**)&RegisteredModules, sizeof(RegModule), &NumRegisteredModules, &MaxRegisteredModules);
     if (module==NULL) {
@@ -240,67 +1105,383 @@ failed:
     return result;
 }
 
+CelsResult CelsRegisterModule (void* dll, const char* method_name, CelsFunction* CelsMain)
+{
+    RecursiveLock (&RegistryLock);
+    CelsResult result = RegisterModule (dll, method_name, CelsMain);
+    RecursiveUnlock (&RegistryLock);
+    return result;
+}
+
 #ifdef _WIN32
-#include <windows.h>
-#include <string.h>
+typedef wchar_t CelsPathChar;
+#else
+typedef char    CelsPathChar;
+#endif
 
-// Converts UTF-16 string to UTF-8
-static char *UTF16toUTF8 (const wchar_t *utf16, char *_utf8)
-{
-  char *utf8 = _utf8;
-  do {
-    unsigned c = utf16[0];
-    if (0xd800<=c && c<=0xdbff && 0xdc00<=utf16[1] && utf16[1]<=0xdfff)
-      c = (c - 0xd800)*0x400 + (unsigned)(*++utf16 - 0xdc00) + 0x10000;
+// Load the library and find CelsMain() in it. Implemented separately for each platform.
+static void OpenModule (const CelsPathChar* path, void** dll, CelsFunction** CelsMain);
 
-    // Now c represents full 32-bit Unicode char
-         if (c<=0x7F)   *utf8++ = c;
-    else if (c<=0x07FF) *utf8++ = 0xC0|(c>> 6)&0x1F,  *utf8++ = 0x80|(c>> 0)&0x3F;
-    else if (c<=0xFFFF) *utf8++ = 0xE0|(c>>12)&0x0F,  *utf8++ = 0x80|(c>> 6)&0x3F,  *utf8++ = 0x80|(c>> 0)&0x3F;
-    else                *utf8++ = 0xF0|(c>>18)&0x0F,  *utf8++ = 0x80|(c>>12)&0x3F,  *utf8++ = 0x80|(c>> 6)&0x3F,  *utf8++ = 0x80|(c>> 0)&0x3F;
+// Find CELS-enabled libraries and either load them immediately or register them as lazy modules
+static CelsResult LoadModules (int lazy);
 
-  } while (*utf16++);
-  return _utf8;
+// Library found by CelsLoadLazy(), represented in the registry by stub codecs named after the library
+// (or after codecs it registered last time, according to the manifest).
+// Once parsing reaches the stub, the library is loaded and its codecs are inserted right after its stubs, i.e. at the place
+// in the registration order where CelsLoad() would register them.
+struct LazyModule {
+    CelsPathChar*   path;           // full filename of the library
+    char*           method_name;    // method name derived from the filename
+    char*           names;          // names of stub codecs, each one terminated by '\t'
+    volatile int    loaded;         // library was loaded (or failed to load), set after its codecs are published
+    LazyModule*     next;           // list of all lazy modules
+};
+static LazyModule* LazyModules = NULL;
+
+static CelsResult __cdecl LazyModuleMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    return service==CELS_PARSE? CELS_ERROR_INVALID_COMPRESSOR : CELS_ERROR_NOT_IMPLEMENTED;
 }
 
-// Add CELS-enabled compressors from DLLs matching the wildcard
-static void RegisterCelsDlls (const wchar_t *dll_wildcard, wchar_t *path, wchar_t *basename)
+// Remember the library and register stub codecs for it: one per each name in the '\t'-terminated list, or just method_name
+static CelsResult AddLazyModule (const CelsPathChar* path, size_t pathlen, const char* method_name, const char* names)
 {
-    // Replace basename part with "celsXX-*.dll"
-    wcscpy (basename, dll_wildcard);
+    size_t names_size = names? strlen(names) : strlen(method_name)+1;
+    LazyModule* lazy = (LazyModule*) malloc (sizeof(LazyModule) + (pathlen+1)*sizeof(CelsPathChar) + strlen(method_name)+1 + names_size+1);
+    if (lazy==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    lazy->path        = (CelsPathChar*) (lazy+1);
+    lazy->method_name = (char*) (lazy->path + pathlen+1);
+    lazy->names       = lazy->method_name + strlen(method_name)+1;
+    lazy->loaded      = 0;
+    memcpy (lazy->path, path, pathlen*sizeof(CelsPathChar));
+    lazy->path[pathlen] = 0;
+    strcpy (lazy->method_name, method_name);
+    if (names)  strcpy (lazy->names, names);
+    else        sprintf (lazy->names, "%s\t", method_name);
 
-    // Find all celsXX-*.dll from program's directory
-    WIN32_FIND_DATAW FindData;
-    HANDLE ff = FindFirstFileW(path, &FindData);
+    RecursiveLock (&RegistryLock);
+    lazy->next = LazyModules;
+    LazyModules = lazy;
+    RecursiveUnlock (&RegistryLock);
+
+    // Split the names list in place and register each name
+    CelsResult result = CELS_OK;
+    char* name = lazy->names;
+    char* end;
+    while ((end = strchr(name,'\t')) != NULL) {
+        *end = '\0';
+        CelsResult errcode = CelsRegister (name, lazy, LazyModuleMain);
+        if (errcode < CELS_OK)  result = errcode;
+        name = end+1;
+    }
+    return result;
+}
+
+static int LazyModuleLoaded (LazyModule* lazy)
+{
+    return AtomicLoad (&lazy->loaded);
+}
+
+// Load the library if no other thread did it yet, so codecs registered after CelsLoadLazy() still override the library ones
+static void LoadLazyModule (LazyModule* lazy)
+{
+    RecursiveLock (&RegistryLock);
+    if (!AtomicLoad (&lazy->loaded)) {
+        void* dll;  CelsFunction* CelsMain;
+        const CodecRegistry* r = Registry;
+        int i;
+        for (i = r? r->num_codecs-1 : -1;  i >= 0;  i--)
+            if (r->codecs[i].CelsMain==LazyModuleMain  &&  r->codecs[i].self==lazy)  break;
+        OpenModule (lazy->path, &dll, &CelsMain);
+        RegistryInsertPos = (i >= 0)? i+1 : -1;
+        if (CelsMain)  RegisterModule (dll, lazy->method_name, CelsMain);
+        else if (dll)  DllUnload (dll);
+        RegistryInsertPos = -1;
+        AtomicStore (&lazy->loaded, 1);
+    }
+    RecursiveUnlock (&RegistryLock);
+}
+
+
+// Module manifest ************************************************************************************************************
+// CelsLoadLazy() keeps the list of codec names registered by each library in the manifest file next to the program,
+// so libraries registering codecs via CELS_LOAD_MODULE can be represented by lazy stubs too.
+// File format: header line followed by lines "size<TAB>mtime<TAB>library path<TAB>name1<TAB>name2<TAB>..."
+// A library that is missing in the manifest or changed its size/mtime is loaded immediately and its entry is rewritten.
+
+static const char CelsManifestHeader[] = "CELS module manifest v1\n";
+
+// Get size and modification time of the file. Implemented separately for each platform.
+static int GetFileIdentity (const CelsPathChar* path, CelsNum* size, CelsNum* mtime);
+// Open file for reading or writing, atomically replace one file with another, and delete a file
+static FILE* OpenFile (const CelsPathChar* path, int write);
+static int ReplaceFile (const CelsPathChar* from, const CelsPathChar* to);
+static void RemoveFile (const CelsPathChar* path);
+
+typedef struct {
+    char*       path;           // library filename in UTF-8
+    CelsNum     size;           // identity of the library file at the time names were recorded
+    CelsNum     mtime;
+    char*       names;          // codec names registered by the library, each one terminated by '\t'
+    int         used;           // library still exists and the entry is up-to-date
+    int         owned;          // path/names were allocated separately, rather than point into the manifest data
+} ManifestEntry;
+
+typedef struct {
+    ManifestEntry*  entries;
+    int             num;
+    int             max;
+    char*           data;       // contents of the manifest file
+    int             changed;    // entries were added
+} Manifest;
+
+static void RecordCodecName (const char* name)
+{
+    size_t len = strlen(name);
+    char* names = (char*) realloc (RecordedNames, RecordedNamesSize + len + 2);
+    if (names==NULL)  return;
+    RecordedNames = names;
+    sprintf (RecordedNames + RecordedNamesSize, "%s\t", name);
+    RecordedNamesSize += len+1;
+}
+
+static void ReadManifest (const CelsPathChar* filename, Manifest* m)
+{
+    FILE* f = OpenFile (filename, 0);
+    if (f==NULL)  return;
+    fseek (f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek (f, 0, SEEK_SET);
+    m->data = (char*) malloc (size+1);
+    if (m->data==NULL  ||  size <= 0  ||  fread (m->data, 1, size, f) != (size_t)size)  {fclose(f);  return;}
+    fclose(f);
+    m->data[size] = '\0';
+    if (strncmp (m->data, CelsManifestHeader, strlen(CelsManifestHeader)) != 0)  return;
+
+    char* line = m->data + strlen(CelsManifestHeader);
+    while (*line) {
+        char* eol = strchr (line, '\n');
+        if (eol==NULL)  break;
+        *eol = '\0';
+        char *path = strchr(line,'\t'),  *mtime = path? strchr(path+1,'\t') : NULL;
+        if (mtime) {
+            ManifestEntry* e = (ManifestEntry*) ExtendArray ((void**)&m->entries, sizeof(ManifestEntry), &m->num, &m->max);
+            if (e==NULL)  break;
+            *path++ = '\0';
+            *mtime++ = '\0';
+            e->size  = strtoll (line, NULL, 10);
+            e->mtime = strtoll (path, NULL, 10);
+            e->path  = mtime;
+            e->names = strchr (mtime, '\t');
+            if (e->names)  *e->names++ = '\0';
+            else           e->names = eol;   // empty list
+            e->used  = 0;
+            e->owned = 0;
+        }
+        line = eol+1;
+    }
+}
+
+// Write used entries to the manifest if anything changed. Errors are ignored since the manifest is only a cache.
+static void WriteManifest (const CelsPathChar* filename, const CelsPathChar* tempname, Manifest* m)
+{
+    int i,  changed = m->changed;
+    for (i=0;  i < m->num;  i++)
+        if (!m->entries[i].used)  changed = 1;
+    if (!changed)  return;
+
+    FILE* f = OpenFile (tempname, 1);
+    if (f==NULL)  return;
+    int ok = fputs (CelsManifestHeader, f) >= 0;
+    for (i=0;  i < m->num;  i++) {
+        ManifestEntry* e = &m->entries[i];
+        if (e->used)
+            ok = ok  &&  fprintf (f, "%lld\t%lld\t%s\t%s\n", e->size, e->mtime, e->path, e->names) >= 0;
+    }
+    ok = (fclose(f) == 0)  &&  ok;
+    if (!ok  ||  !ReplaceFile (tempname, filename))  RemoveFile (tempname);
+}
+
+static void FreeManifest (Manifest* m)
+{
+    int i;
+    for (i=0;  i < m->num;  i++) {
+        if (m->entries[i].owned) {
+            free (m->entries[i].path);
+            free (m->entries[i].names);
+        }
+    }
+    free (m->entries);
+    free (m->data);
+}
+
+// Number of the up-to-date manifest entry of the library, marking it as used, or -1 when the library should be loaded
+// to find out its codecs
+static int UseManifestEntry (Manifest* m, const char* path_utf8, int identified, CelsNum size, CelsNum mtime)
+{
+    int i;
+    for (i=0;  i < m->num;  i++) {
+        ManifestEntry* e = &m->entries[i];
+        if (strcmp (e->path, path_utf8) == 0  &&  !e->used) {
+            if (identified  &&  e->size==size  &&  e->mtime==mtime) {
+                e->used = 1;
+                return i;
+            }
+            break;   // stale entry will be dropped on write
+        }
+    }
+    return -1;
+}
+
+// Register the library opened by OpenModule(), recording names of the registered codecs in the new manifest entry
+static void AddLoadedLibrary (Manifest* m, void* dll, CelsFunction* CelsMain, const char* path_utf8, const char* method_name, int identified, CelsNum size, CelsNum mtime)
+{
+    RecursiveLock (&RegistryLock);
+    RecordedNames = (char*) malloc (1);
+    RecordedNamesSize = 0;
+    if (RecordedNames)  RecordedNames[0] = '\0';
+    if (CelsMain)       RegisterModule (dll, method_name, CelsMain);
+    else if (dll)       DllUnload (dll);
+    char* names = RecordedNames;
+    RecordedNames = NULL;
+    RecursiveUnlock (&RegistryLock);
+
+    // Add new entry to the manifest
+    char* path_copy = (char*) malloc (strlen(path_utf8)+1);
+    ManifestEntry* e = (identified && names && path_copy)? (ManifestEntry*) ExtendArray ((void**)&m->entries, sizeof(ManifestEntry), &m->num, &m->max) : NULL;
+    if (e==NULL)  {free(names);  free(path_copy);  return;}
+    e->path    = strcpy (path_copy, path_utf8);
+    e->size    = size;
+    e->mtime   = mtime;
+    e->names   = names;
+    e->used    = 1;
+    e->owned   = 1;
+    m->changed = 1;
+}
+
+CelsResult CelsLoad()
+{
+    return LoadModules (0);
+}
+
+CelsResult CelsLoadLazy()
+{
+    return LoadModules (1);
+}
+
+#ifdef _WIN32
+#include <windows.h>
+#include <string.h>
+
+// Converts UTF-16 string to UTF-8
+static char *UTF16toUTF8 (const wchar_t *utf16, char *_utf8)
+{
+  char *utf8 = _utf8;
+  do {
+    unsigned c = utf16[0];
+    if (0xd800<=c && c<=0xdbff && 0xdc00<=utf16[1] && utf16[1]<=0xdfff)
+      c = (c - 0xd800)*0x400 + (unsigned)(*++utf16 - 0xdc00) + 0x10000;
+
+    // Now c represents full 32-bit Unicode char
+         if (c<=0x7F)   *utf8++ = c;
+    else if (c<=0x07FF) *utf8++ = 0xC0|(c>> 6)&0x1F,  *utf8++ = 0x80|(c>> 0)&0x3F;
+    else if (c<=0xFFFF) *utf8++ = 0xE0|(c>>12)&0x0F,  *utf8++ = 0x80|(c>> 6)&0x3F,  *utf8++ = 0x80|(c>> 0)&0x3F;
+    else                *utf8++ = 0xF0|(c>>18)&0x0F,  *utf8++ = 0x80|(c>>12)&0x3F,  *utf8++ = 0x80|(c>> 6)&0x3F,  *utf8++ = 0x80|(c>> 0)&0x3F;
+
+  } while (*utf16++);
+  return _utf8;
+}
+
+static void OpenModule (const CelsPathChar* path, void** dll, CelsFunction** CelsMain)
+{
+    HMODULE module = LoadLibraryW(path);
+    *dll = module;
+    *CelsMain = module? (CelsFunction*) GetProcAddress (module, "CelsMain") : NULL;
+}
+
+static int GetFileIdentity (const CelsPathChar* path, CelsNum* size, CelsNum* mtime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesExW (path, GetFileExInfoStandard, &attr))  return 0;
+    *size  = ((CelsNum)attr.nFileSizeHigh << 32) + attr.nFileSizeLow;
+    *mtime = ((CelsNum)attr.ftLastWriteTime.dwHighDateTime << 32) + attr.ftLastWriteTime.dwLowDateTime;
+    return 1;
+}
+
+static FILE* OpenFile (const CelsPathChar* path, int write)
+{
+    return _wfopen (path, write? L"wb" : L"rb");
+}
+
+static int ReplaceFile (const CelsPathChar* from, const CelsPathChar* to)
+{
+    return MoveFileExW (from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+static void RemoveFile (const CelsPathChar* path)
+{
+    _wremove (path);
+}
+
+// Register library found by CelsLoadLazy(): by lazy stubs when the manifest has up-to-date entry for it,
+// otherwise by loading it right now and recording names of the registered codecs in the manifest
+static void AddLazyLibrary (Manifest* m, const CelsPathChar* path, size_t pathlen, const char* path_utf8, const char* method_name)
+{
+    CelsNum size = 0, mtime = 0;
+    int identified = GetFileIdentity (path, &size, &mtime);
+    int entry = UseManifestEntry (m, path_utf8, identified, size, mtime);
+    if (entry >= 0)  {AddLazyModule (path, pathlen, method_name, m->entries[entry].names);  return;}
+
+    void* dll;  CelsFunction* CelsMain;
+    OpenModule (path, &dll, &CelsMain);
+    AddLoadedLibrary (m, dll, CelsMain, path_utf8, method_name, identified, size, mtime);
+}
+
+// Add CELS-enabled compressors from DLLs matching the wildcard (as lazy modules when manifest is provided)
+static void RegisterCelsDlls (const wchar_t *dll_wildcard, wchar_t *path, wchar_t *basename, Manifest *manifest)
+{
+    // Replace basename part with "celsXX-*.dll"
+    wcscpy (basename, dll_wildcard);
+
+    // Find all celsXX-*.dll from program's directory
+    WIN32_FIND_DATAW FindData;
+    HANDLE ff = FindFirstFileW(path, &FindData);
     BOOL found;
     for (found = (ff!=INVALID_HANDLE_VALUE);  found;  found = FindNextFileW(ff, &FindData))
     {
         // Put full DLL filename into `path`
         wcscpy (basename, FindData.cFileName);
 
-        // If DLL contains CelsMain() - register included codecs
-        HMODULE dll = LoadLibraryW(path);
-        CelsFunction *CelsMain = (CelsFunction*) GetProcAddress (dll, "CelsMain");
-        if (CelsMain)
-        {
-            // Register new CELS method in the global list of compression methods
-            char method_buf[MAX_PATH], *method_name;
-            UTF16toUTF8 (basename, method_buf);
+        // Register new CELS method in the global list of compression methods
+        char method_buf[MAX_PATH], *method_name;
+        UTF16toUTF8 (basename, method_buf);
 
-            // "cels-TeSt.dll" will be registered as "test" compression method
-            method_name = strchr(method_buf,'-')+1;   // skip "cels-" prefix
-            strrchr(method_name,'.')[0] = '\0';       // remove ".dll" suffix
-            strlwr(method_name);
+        // "cels-TeSt.dll" will be registered as "test" compression method
+        method_name = strchr(method_buf,'-')+1;   // skip "cels-" prefix
+        strrchr(method_name,'.')[0] = '\0';       // remove ".dll" suffix
+        strlwr(method_name);
 
-            // Register included codecs
-            CelsRegisterModule (dll, method_name, CelsMain);
+        if (manifest) {
+            // DLL will be loaded on the first use of the method
+            char path_utf8[MAX_PATH*4];
+            UTF16toUTF8 (path, path_utf8);
+            AddLazyLibrary (manifest, path, wcslen(path), path_utf8, method_name);
+            continue;
         }
+
+        // If DLL contains CelsMain() - register included codecs
+        void* dll;  CelsFunction *CelsMain;
+        OpenModule (path, &dll, &CelsMain);
+        if (CelsMain)
+            CelsRegisterModule (dll, method_name, CelsMain);
+        else if (dll)
+            DllUnload (dll);
     }
     FindClose(ff);
 }
 
 // Add CELS-enabled compressors from celsXX-*.dll (also from clsXX-*.dll in order to allow distribution of CLS+CELS-enabled DLLs)
-CelsResult CelsLoad()
+static CelsResult LoadModules (int lazy)
 {
     // Get program's executable/unarc.dll filename (or, more exactly, filename of module containing the CelsLoad function)
     MEMORY_BASIC_INFORMATION mbi;
@@ -309,41 +1490,283 @@ CelsResult CelsLoad()
     wchar_t path[MAX_PATH];
     GetModuleFileNameW ((HMODULE) mbi.AllocationBase, path, MAX_PATH);
 
-    // Replace basename part with "celsXX-*.dll"
+    // Lazy loading relies on the manifest placed next to the program
     wchar_t *basename = wcsrchr (path, L'\\') + 1;
-    RegisterCelsDlls (L"cls-*.dll",        path, basename);
-    RegisterCelsDlls (L"cels-*.dll",       path, basename);
+    wchar_t manifest_name[MAX_PATH], manifest_tempname[MAX_PATH];
+    Manifest manifest = {NULL,0,0, NULL,0};
+    if (lazy) {
+        wcscpy (basename, L"cels.manifest");
+        wcscpy (manifest_name, path);
+        // Temporary file is unique per process, so programs started simultaneously don't write into the same file
+        _snwprintf (basename, MAX_PATH - (basename-path), L"cels.manifest.%lu.tmp", (unsigned long) GetCurrentProcessId());
+        path[MAX_PATH-1] = L'\0';
+        wcscpy (manifest_tempname, path);
+        ReadManifest (manifest_name, &manifest);
+    }
+
+    // Replace basename part with "celsXX-*.dll"
+    Manifest *m = lazy? &manifest : NULL;
+    RegisterCelsDlls (L"cls-*.dll",        path, basename, m);
+    RegisterCelsDlls (L"cels-*.dll",       path, basename, m);
     if (sizeof(void*) == 8) {
-        RegisterCelsDlls (L"cls64-*.dll",  path, basename);
-        RegisterCelsDlls (L"cels64-*.dll", path, basename);
+        RegisterCelsDlls (L"cls64-*.dll",  path, basename, m);
+        RegisterCelsDlls (L"cels64-*.dll", path, basename, m);
     } else {
-        RegisterCelsDlls (L"cls32-*.dll",  path, basename);
-        RegisterCelsDlls (L"cels32-*.dll", path, basename);
+        RegisterCelsDlls (L"cls32-*.dll",  path, basename, m);
+        RegisterCelsDlls (L"cels32-*.dll", path, basename, m);
     }
 
+    if (lazy) {
+        WriteManifest (manifest_name, manifest_tempname, &manifest);
+        FreeManifest (&manifest);
+    }
     return CELS_OK;
 }
 
 #else
 
-CelsResult CelsLoad()
+#include <dlfcn.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Shared library found by CelsLoad()
+typedef struct {
+    char*           path;           // full filename
+    char*           method_name;    // "cels-TeSt.so" will be registered as "test" compression method
+    void*           dll;            // handle returned by dlopen()
+    CelsFunction*   CelsMain;       // CelsMain() function loaded from the library
+    int             open;           // the library should be opened: by CelsLoad(), or by CelsLoadLazy() without manifest entry
+    int             entry;          // up-to-date manifest entry of the library, or -1
+    int             identified;     // size and mtime of the file are known
+    CelsNum         size, mtime;
+} CelsModuleFile;
+
+typedef struct {
+    CelsModuleFile* files;
+    int             num;
+    int             max;
+    CelsAtomic      next;           // next file to be opened by OpenModulesThread()
+} CelsModuleFiles;
+
+// Add shared libraries matching the wildcard in the directory to the list
+static void FindCelsModules (const char* dir, const char* wildcard, CelsModuleFiles* list)
+{
+    DIR* d = opendir(dir);
+    if (d==NULL)  return;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (fnmatch (wildcard, entry->d_name, 0) != 0)  continue;
+        CelsModuleFile* file = (CelsModuleFile*) ExtendArray ((void**)&list->files, sizeof(CelsModuleFile), &list->num, &list->max);
+        if (file==NULL)  break;
+        file->path        = (char*) malloc (strlen(dir) + strlen(entry->d_name) + 2);
+        file->method_name = (char*) malloc (strlen(entry->d_name) + 1);
+        file->dll         = NULL;
+        file->CelsMain    = NULL;
+        file->open        = 0;
+        file->entry       = -1;
+        if (file->path==NULL || file->method_name==NULL) {
+            free(file->path);  free(file->method_name);
+            list->num--;
+            break;
+        }
+        sprintf (file->path, "%s/%s", dir, entry->d_name);
+
+        // Strip "celsXX-" prefix and ".so" suffix from the filename, and lowercase the rest
+        char* p = file->method_name;
+        strcpy (p, strchr(entry->d_name,'-') + 1);
+        strrchr(p,'.')[0] = '\0';
+        for (;  *p;  p++)
+            *p = tolower((unsigned char)*p);
+    }
+    closedir(d);
+}
+
+// Search all directories for CELS-enabled modules (also clsXX-*.so in order to allow distribution of CLS+CELS-enabled modules)
+static void FindCelsModulesInDir (const char* dir, CelsModuleFiles* list)
+{
+    FindCelsModules (dir, "cls-*.so",  list);
+    FindCelsModules (dir, "cels-*.so", list);
+    if (sizeof(void*) == 8) {
+        FindCelsModules (dir, "cls64-*.so",  list);
+        FindCelsModules (dir, "cels64-*.so", list);
+    } else {
+        FindCelsModules (dir, "cls32-*.so",  list);
+        FindCelsModules (dir, "cels32-*.so", list);
+    }
+}
+
+// Worker opening modules marked in the shared list until it's exhausted
+static CELS_THREAD_FUNCTION (OpenModulesThread)
+{
+    CelsModuleFiles* list = (CelsModuleFiles*) arg;
+    long i;
+    while ((i = AtomicAdd (&list->next, 1) - 1) < list->num)
+    {
+        CelsModuleFile* file = &list->files[i];
+        if (file->open)  OpenModule (file->path, &file->dll, &file->CelsMain);
+    }
+    return 0;
+}
+
+static void OpenModule (const CelsPathChar* path, void** dll, CelsFunction** CelsMain)
+{
+    *dll = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+    *CelsMain = *dll? (CelsFunction*) dlsym (*dll, "CelsMain") : NULL;
+}
+
+static int GetFileIdentity (const CelsPathChar* path, CelsNum* size, CelsNum* mtime)
+{
+    struct stat st;
+    if (stat (path, &st) != 0)  return 0;
+    *size  = st.st_size;
+    *mtime = (CelsNum)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return 1;
+}
+
+static FILE* OpenFile (const CelsPathChar* path, int write)
+{
+    return fopen (path, write? "wb" : "rb");
+}
+
+static int ReplaceFile (const CelsPathChar* from, const CelsPathChar* to)
+{
+    return rename (from, to) == 0;
+}
+
+static void RemoveFile (const CelsPathChar* path)
+{
+    remove (path);
+}
+
+// Add CELS-enabled compressors from celsXX-*.so placed next to the program and in directories listed in CELS_PATH
+static CelsResult LoadModules (int lazy)
 {
-    return CELS_ERROR_NOT_IMPLEMENTED;   // Non-Windows platforms aren't yet supported
+    CelsModuleFiles list = {NULL, 0, 0, 0};
+
+    // Get filename of the program/shared library containing the CelsLoad function
+    char path[PATH_MAX+1] = "";
+    Dl_info info;
+    if (dladdr ((void*)CelsLoad, &info)  &&  info.dli_fname  &&  info.dli_fname[0]=='/'  &&  strlen(info.dli_fname) <= PATH_MAX) {
+        strcpy (path, info.dli_fname);
+    } else {
+        ssize_t len = readlink ("/proc/self/exe", path, PATH_MAX);
+        path[len>0? len:0] = '\0';
+    }
+    // Lazy loading relies on the manifest placed next to the program
+    char manifest_name[PATH_MAX+64] = "",  manifest_tempname[PATH_MAX+64] = "";
+    Manifest manifest = {NULL,0,0, NULL,0};
+    char* basename = strrchr (path, '/');
+    if (basename) {
+        *basename = '\0';
+        if (lazy) {
+            sprintf (manifest_name,     "%s/cels.manifest",     path);
+            sprintf (manifest_tempname, "%s/cels.manifest.%ld.tmp", path, (long) getpid());   // unique per process
+            ReadManifest (manifest_name, &manifest);
+        }
+        FindCelsModulesInDir (*path? path : "/", &list);
+    }
+
+    // CELS_PATH contains extra directories delimited by ':'
+    const char* cels_path = getenv ("CELS_PATH");
+    while (cels_path && *cels_path) {
+        size_t len = strcspn (cels_path, ":");
+        if (len > 0  &&  len <= PATH_MAX) {
+            memcpy (path, cels_path, len);
+            path[len] = '\0';
+            FindCelsModulesInDir (path, &list);
+        }
+        cels_path += len + (cels_path[len]==':');
+    }
+
+    // Lazy loading opens only libraries missing in the manifest or changed since it was written
+    int num_open = 0,  i;
+    for (i=0;  i < list.num;  i++) {
+        CelsModuleFile* file = &list.files[i];
+        if (lazy && *manifest_name) {
+            file->identified = GetFileIdentity (file->path, &file->size, &file->mtime);
+            file->entry = UseManifestEntry (&manifest, file->path, file->identified, file->size, file->mtime);
+        }
+        file->open = !lazy  ||  (*manifest_name  &&  file->entry < 0);
+        num_open += file->open;
+    }
+
+    // dlopen() the modules in parallel, since loading of each one may involve disk access and relocation
+    int num_threads = num_open < CELS_LOAD_THREADS? num_open : CELS_LOAD_THREADS;
+    CelsThread threads[CELS_LOAD_THREADS];
+    for (i=0;  i < num_threads-1;  i++)
+        if (!StartThread (&threads[i], OpenModulesThread, &list))  break;
+    num_threads = i;
+    if (num_open)  OpenModulesThread (&list);
+    for (i=0;  i < num_threads;  i++)
+        JoinThread (threads[i]);
+
+    // Register modules in the deterministic order, so the same codec always wins name conflicts
+    for (i=0;  i < list.num;  i++)
+    {
+        CelsModuleFile* file = &list.files[i];
+        if (lazy && *manifest_name && file->entry >= 0)
+            AddLazyModule (file->path, strlen(file->path), file->method_name, manifest.entries[file->entry].names);
+        else if (lazy && *manifest_name)
+            AddLoadedLibrary (&manifest, file->dll, file->CelsMain, file->path, file->method_name, file->identified, file->size, file->mtime);
+        else if (lazy)
+            AddLazyModule (file->path, strlen(file->path), file->method_name, NULL);
+        else if (file->CelsMain)
+            CelsRegisterModule (file->dll, file->method_name, file->CelsMain);
+        else if (file->dll)
+            DllUnload (file->dll);
+        free (file->path);
+        free (file->method_name);
+    }
+    free (list.files);
+
+    if (*manifest_name)
+        WriteManifest (manifest_name, manifest_tempname, &manifest);
+    FreeManifest (&manifest);
+    return CELS_OK;
 }
 
 #endif  // _WIN32
 
 void CelsUnload()
 {
-    // Unload codecs
-    while (NumRegisteredCodecs > 0) {
-        RegCodec *codec  =  & RegisteredCodecs[--NumRegisteredCodecs];
-        codec->CelsMain (codec->self, CELS_UNLOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+    RecursiveLock (&RegistryLock);
+
+    // Free cached and pooled methods while their codecs are still loaded
+    FlushMethodCache();
+    FlushInstancePools();
+
+    // Unload codecs. The caller guarantees that no other thread is using the registry at this moment.
+    CodecRegistry* r = Registry;
+    Registry = NULL;
+    if (r) {
+        int n = r->num_codecs;
+        while (n > 0) {
+            RegCodec *codec  =  & r->codecs[--n];
+            codec->CelsMain (codec->self, CELS_UNLOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+            free (codec->stats);
+        }
+        free (r->codecs);
+        free (r->index);
+        free (r->wildcard_lengths);
+        free (r);
     }
-    free(RegisteredCodecs);
-    RegisteredCodecs = NULL;
     MaxRegisteredCodecs = 0;
 
+    // Free replaced snapshots
+    int i;
+    for (i=0;  i<2;  i++) {
+        while (RetiredRegistries[i]) {
+            CodecRegistry* retired = RetiredRegistries[i];
+            RetiredRegistries[i] = retired->next_retired;
+            FreeRetiredRegistry (retired);
+        }
+    }
+
     // Unload modules
     while (NumRegisteredModules > 0) {
         RegModule* module = & RegisteredModules[--NumRegisteredModules];
@@ -354,6 +1777,153 @@ void CelsUnload()
     free(RegisteredModules);
     RegisteredModules = NULL;
     MaxRegisteredModules = 0;
+
+    // Forget libraries that were found by CelsLoadLazy()
+    while (LazyModules) {
+        LazyModule* lazy = LazyModules;
+        LazyModules = lazy->next;
+        free (lazy);
+    }
+
+    RecursiveUnlock (&RegistryLock);
+}
+
+
+// ****************************************************************************************************************************
+// Parsed method cache ********************************************************************************************************
+// ****************************************************************************************************************************
+
+// Cels() called with method string for a read-only service (CELS_GET_* except CELS_GET_NAMED_SERVICE, CELS_UNPARSE) takes the parsed method from this cache
+// instead of running CELS_PARSE/CELS_INITIALIZE/CELS_FREE on every call. Entries are keyed by the method string as passed
+// to Cels() and evicted in LRU order. An entry is taken out of use by other threads while a service is executed on it.
+typedef struct
+{
+    char*       key;                    // method string
+    unsigned    hash;                   // hash of the method string
+    int         in_use;                 // service is being executed on this entry right now
+    unsigned    generation;             // MethodCacheGeneration at the time the method was parsed
+    CelsNum     last_used;              // MethodCacheTick at the last access, used for LRU eviction
+    char        method[CELS_MAX_PARSED_METHOD_SIZE];
+} CachedMethod;
+
+static CachedMethod* MethodCache[CELS_METHOD_CACHE_SIZE];
+static CelsSpinLock MethodCacheLock = 0;
+static unsigned MethodCacheGeneration = 0;      // incremented on every flush, so entries parsed before the flush are dropped on release
+static CelsNum  MethodCacheTick = 0;
+static CelsNum  MethodCacheHits = 0;
+static CelsNum  MethodCacheMisses = 0;
+
+// Named services may perform arbitrary actions (and "stats" should describe a fresh instance), so they aren't cached
+static int IsCacheableService (int service)
+{
+    if (service == CELS_GET_NAMED_SERVICE)  return 0;
+    return service==CELS_UNPARSE  ||  (service&0xFF000000)==0x01000000  ||  (service&0xFF000000)==0x02000000;
+}
+
+static void FreeCachedMethod (CachedMethod* entry)
+{
+    CallCels (entry->method, CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+    free (entry->key);
+    free (entry);
+}
+
+// Free all cached methods that aren't in use right now (remaining ones will be freed on release)
+static void FlushMethodCache (void)
+{
+    CachedMethod* flushed[CELS_METHOD_CACHE_SIZE];  int i, n = 0;
+    SpinLock (&MethodCacheLock);
+    MethodCacheGeneration++;
+    for (i=0;  i<CELS_METHOD_CACHE_SIZE;  i++) {
+        if (MethodCache[i]  &&  !MethodCache[i]->in_use)
+            flushed[n++] = MethodCache[i];
+        MethodCache[i] = NULL;
+    }
+    SpinUnlock (&MethodCacheLock);
+
+    // CELS_FREE may call Cels() back, so it's performed outside of the lock
+    for (i=0;  i<n;  i++)
+        FreeCachedMethod (flushed[i]);
+}
+
+// Return parsed method for the method string, either from the cache or freshly parsed
+static CachedMethod* AcquireCachedMethod (const char* method_str, void* ud, CelsCallback* cb, CelsResult* errcode)
+{
+    unsigned hash = StringHash (method_str, strlen(method_str));  int i;
+    SpinLock (&MethodCacheLock);
+    for (i=0;  i<CELS_METHOD_CACHE_SIZE;  i++) {
+        CachedMethod* entry = MethodCache[i];
+        if (entry  &&  !entry->in_use  &&  entry->hash==hash  &&  !strcmp(entry->key, method_str)) {
+            entry->in_use = 1;
+            entry->last_used = ++MethodCacheTick;
+            MethodCacheHits++;
+            SpinUnlock (&MethodCacheLock);
+            return entry;
+        }
+    }
+    MethodCacheMisses++;
+    unsigned generation = MethodCacheGeneration;
+    SpinUnlock (&MethodCacheLock);
+
+    // Cache miss: parse the method into new entry that will be added to the cache on release
+    CachedMethod* entry = (CachedMethod*) malloc (sizeof(CachedMethod));
+    char* key = (char*) malloc (strlen(method_str)+1);
+    if (entry==NULL || key==NULL) {
+        free(entry);  free(key);
+        *errcode = CELS_ERROR_NOT_ENOUGH_MEMORY;
+        return NULL;
+    }
+    *errcode = CelsParseStr (method_str, entry->method,sizeof(entry->method), ud,cb);
+    if (*errcode < CELS_OK) {
+        free(entry);  free(key);
+        return NULL;
+    }
+    entry->key        = strcpy (key, method_str);
+    entry->hash       = hash;
+    entry->in_use     = 1;
+    entry->generation = generation;
+    entry->last_used  = 0;
+    return entry;
+}
+
+// Return the method to the cache, evicting the least recently used entry when the cache is full.
+// New entry is dropped if another thread has already cached the same method string meanwhile
+static void ReleaseCachedMethod (CachedMethod* entry)
+{
+    CachedMethod* evicted = NULL;  int i, place = -1, duplicate = 0;
+    SpinLock (&MethodCacheLock);
+    for (i=0;  i<CELS_METHOD_CACHE_SIZE;  i++) {
+        CachedMethod* other = MethodCache[i];
+        if (other == entry)  {entry->in_use = 0;  SpinUnlock (&MethodCacheLock);  return;}
+        if (other  &&  other->hash==entry->hash  &&  !strcmp(other->key, entry->key))  duplicate = 1;
+    }
+    if (entry->generation == MethodCacheGeneration  &&  !duplicate) {
+        // New entry: put it into free slot or in place of LRU entry
+        for (i=0;  i<CELS_METHOD_CACHE_SIZE;  i++) {
+            CachedMethod* other = MethodCache[i];
+            if (other == NULL)  {place = i;  break;}
+            if (!other->in_use  &&  (place < 0  ||  other->last_used < MethodCache[place]->last_used))
+                place = i;
+        }
+    }
+    if (place >= 0) {
+        evicted = MethodCache[place];
+        MethodCache[place] = entry;
+        entry->in_use = 0;
+        entry->last_used = ++MethodCacheTick;
+    } else {
+        evicted = entry;   // cache was flushed while the method was in use, the method string is already cached, or all entries are in use
+    }
+    SpinUnlock (&MethodCacheLock);
+    if (evicted)  FreeCachedMethod (evicted);
+}
+
+// Return number of Cels() calls served from the parsed method cache and number of calls that had to parse the method string
+void CelsMethodCacheStats (CelsNum* hits, CelsNum* misses)
+{
+    SpinLock (&MethodCacheLock);
+    if (hits)    *hits   = MethodCacheHits;
+    if (misses)  *misses = MethodCacheMisses;
+    SpinUnlock (&MethodCacheLock);
 }
 
 
@@ -371,7 +1941,7 @@ CelsResult Cels (const void* method_str, int service, CelsNum subservice, void*
         return CelsRegister ((const char*)inbuf, ud,(CelsFunction*)cb);  // Register codec with name:=inbuf, CelsMain:=cb(ud...)
     }
     else if (service==CELS_LOAD) {
-        return CelsLoad();
+        return subservice==CELS_LOAD_LAZY? CelsLoadLazy() : CelsLoad();
     }
     else if (service==CELS_UNLOAD) {
         CelsUnload();
@@ -382,6 +1952,20 @@ CelsResult Cels (const void* method_str, int service, CelsNum subservice, void*
     CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method_str;
     if (*(char*)instance == 0)   return CallCels (instance, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
 
+    // Chains are parsed into CelsChain, and (de)compressed by all their methods
+    if (IsChainString ((const char*) method_str))
+        return ChainStringService ((const char*) method_str, service, insize, inbuf, outbuf, ud,cb);
+
+    // Read-only services reuse parsed method from the cache
+    if (IsCacheableService(service)) {
+        CelsResult result;
+        CachedMethod* entry = AcquireCachedMethod ((const char*) method_str, ud,cb, &result);
+        if (entry==NULL)  return result;
+        result = CallCels (entry->method, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+        ReleaseCachedMethod (entry);
+        return result;
+    }
+
     // And finally, parse method string, execute the service on the parsed method and unparse it back if necessary
     char method[CELS_MAX_PARSED_METHOD_SIZE];
     CelsResult errcode_or_size = CelsParseStr ((const char*) method_str,
@@ -460,33 +2044,128 @@ typedef struct
     size_t   writeLeft;         // remaining bytes in the outbuf
     void    *userdata;          // data passed to the original callback
     CelsCallback* callback;     // original callback to serve all other requests
+    char    *lentOutbuf;        // rest of outbuf lent by CELS_RECEIVE_EMPTY_OUTBUF and not sent back yet, or NULL
+    CelsSpinLock  outLock;      // guards output position and lentOutbuf against writes and buffer services called in parallel
 } CelsMemBuf;
 
-// Callback emulating CELS_READ/CELS_WRITE for in-memory (de)compression operations
+// Copy up to size bytes from src into the CELS_READV buffers, returning amount of data copied
+static size_t ScatterMem (const char* src, size_t size, const CelsIoVec* iov, CelsNum count)
+{
+    size_t copied = 0;
+    CelsNum i;
+    for (i=0;  i<count  &&  copied<size;  i++) {
+        size_t len = size-copied < iov[i].size ? size-copied : iov[i].size;
+        memcpy (iov[i].buf, src+copied, len);
+        copied += len;
+    }
+    return copied;
+}
+
+// Copy all CELS_WRITEV buffers into dst if they fit into size bytes, returning amount of data copied or error code
+static CelsResult GatherMem (char* dst, size_t size, const CelsIoVec* iov, CelsNum count)
+{
+    size_t total = 0;
+    CelsNum i;
+    for (i=0;  i<count;  i++)
+        total += iov[i].size;
+    if (total > size)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+    for (i=0, total=0;  i<count;  i++) {
+        memcpy (dst+total, iov[i].buf, iov[i].size);
+        total += iov[i].size;
+    }
+    return total;
+}
+
+// Callback emulating CELS_READ/CELS_WRITE of the main stream for in-memory (de)compression operations.
+// CELS_RECEIVE_EMPTY_OUTBUF lends the rest of outbuf itself, so the codec writes directly to its final place.
+// The rest of inbuf is lent only to codecs requesting it with CELS_INBUF_READ_ONLY, since inbuf belongs to the caller.
+// Only one output buffer may be lent at a time, and it should be sent back before the next CELS_WRITE or CELS_SEND_FILLED_OUTBUF.
 static CelsResult __cdecl CelsReadWriteMem (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
 {
     CelsMemBuf *membuf = (CelsMemBuf*)self;
-    if (service==CELS_READ  &&  membuf->readPtr)
+    if ((service==CELS_READ || service==CELS_READV)  &&  subservice==0  &&  membuf->readPtr)
     {
-        // Copy data from readPtr to inbuf and advance the read pointer
+        // Copy data from readPtr to inbuf (or inbuf vector) and advance the read pointer
         size_t read_bytes = membuf->readLeft<insize ? membuf->readLeft : insize;
-        memcpy (inbuf, membuf->readPtr, read_bytes);
+        if (service==CELS_READ)
+            memcpy (inbuf, membuf->readPtr, read_bytes);
+        else
+            read_bytes = ScatterMem (membuf->readPtr, membuf->readLeft, (const CelsIoVec*)inbuf, insize);
         membuf->readPtr  += read_bytes;
         membuf->readLeft -= read_bytes;
         return read_bytes;
     }
-    else if (service==CELS_WRITE  &&  membuf->writePtr)
+    else if ((service==CELS_WRITE || service==CELS_WRITEV)  &&  subservice==0  &&  membuf->writePtr)
     {
-        // Copy data from outbuf to writePtr and advance the write pointer
-        if (outsize > membuf->writeLeft)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
-        memcpy (membuf->writePtr, outbuf, outsize);
-        membuf->writePtr  += outsize;
-        membuf->writeLeft -= outsize;
+        // Copy data from outbuf (or outbuf vector) to writePtr and advance the write pointer.
+        // The output position is shared with buffer services, so it's guarded by the same lock
+        SpinLock (&membuf->outLock);
+        if (membuf->lentOutbuf)
+            outsize = CELS_ERROR_GENERAL;      // the data would be overwritten by the lent buffer
+        else if (service==CELS_WRITEV)
+            outsize = GatherMem (membuf->writePtr, membuf->writeLeft, (const CelsIoVec*)outbuf, outsize);
+        else if ((size_t)outsize > membuf->writeLeft)
+            outsize = CELS_ERROR_OUTBLOCK_TOO_SMALL;
+        else
+            memcpy (membuf->writePtr, outbuf, outsize);
+        if (outsize >= 0) {
+            membuf->writePtr  += outsize;
+            membuf->writeLeft -= outsize;
+        }
+        SpinUnlock (&membuf->outLock);
         return outsize;
     }
+    else if (service==CELS_RECEIVE_FILLED_INBUF  &&  subservice==0  &&  membuf->readPtr)
+    {
+        // Lend all remaining input to the codec that won't modify it; other codecs fall back to CELS_READ,
+        // f.e. directly into the lent output buffer
+        if (!(insize & CELS_INBUF_READ_ONLY))  return CELS_ERROR_NOT_IMPLEMENTED;
+        size_t lent = membuf->readLeft;
+        *(void**)inbuf = membuf->readPtr;
+        membuf->readPtr  += lent;
+        membuf->readLeft  = 0;
+        return lent;
+    }
+    else if (service==CELS_SEND_EMPTY_INBUF  &&  subservice==0  &&  membuf->readPtr)
+    {
+        // Lent input stays with the caller
+        return CELS_OK;
+    }
+    else if (service==CELS_RECEIVE_EMPTY_OUTBUF  &&  subservice==0  &&  membuf->writePtr)
+    {
+        // Lend all remaining output space, so the codec writes directly to its final place
+        CelsResult result;
+        SpinLock (&membuf->outLock);
+        if (membuf->lentOutbuf)          result = CELS_ERROR_NOT_IMPLEMENTED;    // the whole rest of outbuf is already lent
+        else if (membuf->writeLeft==0)   result = CELS_ERROR_OUTBLOCK_TOO_SMALL;
+        else  {*(void**)outbuf = membuf->lentOutbuf = membuf->writePtr;  result = membuf->writeLeft;}
+        SpinUnlock (&membuf->outLock);
+        return result;
+    }
+    else if (service==CELS_SEND_FILLED_OUTBUF  &&  subservice==0  &&  membuf->writePtr)
+    {
+        // Data in the lent buffer are already in place; any other buffer is copied, unless it would overwrite the lent one
+        CelsResult result = CELS_OK;
+        SpinLock (&membuf->outLock);
+        if ((char*)outbuf == membuf->lentOutbuf) {
+            membuf->lentOutbuf = NULL;
+        } else if (membuf->lentOutbuf) {
+            SpinUnlock (&membuf->outLock);
+            return CELS_ERROR_GENERAL;
+        }
+        if ((size_t)outsize > membuf->writeLeft) {
+            result = CELS_ERROR_OUTBLOCK_TOO_SMALL;
+        } else {
+            if ((char*)outbuf != membuf->writePtr)  memmove (membuf->writePtr, outbuf, outsize);
+            membuf->writePtr  += outsize;
+            membuf->writeLeft -= outsize;
+        }
+        SpinUnlock (&membuf->outLock);
+        return result;
+    }
     else
     {
-        // All unhandled requests are passed to the original callback
+        // All unhandled requests (including other streams) are passed to the original callback
         return (membuf->callback? membuf->callback (membuf->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
                                 : CELS_ERROR_NOT_IMPLEMENTED);
     }
@@ -500,7 +2179,7 @@ CelsResult CelsCompressMem (const void* method, void* inbuf, CelsNum insize, voi
     if (result != CELS_ERROR_NOT_IMPLEMENTED) {
         return result;
     } else {
-        CelsMemBuf membuf = {(char*)inbuf,(size_t)insize, (char*)outbuf,(size_t)outsize, ud,cb};
+        CelsMemBuf membuf = {(char*)inbuf,(size_t)insize, (char*)outbuf,(size_t)outsize, ud,cb, NULL,0};
         result = CelsCompress (method, &membuf, CelsReadWriteMem);
         // Return error code or number of bytes written to the buffer
         return result<CELS_OK ? result : outsize-membuf.writeLeft;
@@ -515,9 +2194,2203 @@ CelsResult CelsDecompressMem (const void* method, void* inbuf, CelsNum insize, v
     if (result != CELS_ERROR_NOT_IMPLEMENTED) {
         return result;
     } else {
-        CelsMemBuf membuf = {(char*)inbuf,(size_t)insize, (char*)outbuf,(size_t)outsize, ud,cb};
+        CelsMemBuf membuf = {(char*)inbuf,(size_t)insize, (char*)outbuf,(size_t)outsize, ud,cb, NULL,0};
         result = CelsDecompress (method, &membuf, CelsReadWriteMem);
         // Return error code or number of bytes written to the buffer
         return result<CELS_OK ? result : outsize-membuf.writeLeft;
     }
 }
+
+// Output buffer of CelsCompressMemAlloc()/CelsDecompressMemAlloc(), growing geometrically as data arrive
+typedef struct
+{
+    char    *buf;               // malloc'ed buffer
+    CelsNum  size;              // bytes written
+    CelsNum  capacity;          // bytes allocated
+    void    *userdata;          // data passed to the original callback
+    CelsCallback* callback;     // original callback to serve all other requests
+} CelsGrowableBuf;
+
+// Make room for at least needed bytes (and allocate the buffer on the first call), returning 0 when out of memory
+static int GrowBuf (CelsGrowableBuf* g, CelsNum needed)
+{
+    if (needed <= g->capacity  &&  g->buf)  return 1;
+    CelsNum capacity = g->capacity < 65536? 65536 : g->capacity;
+    while (capacity < needed)  capacity = capacity < LLONG_MAX/2? capacity*2 : needed;
+    if ((CelsNum)(size_t)capacity != capacity)  return 0;
+    char* buf = (char*) realloc (g->buf, capacity);
+    if (buf==NULL)  return 0;
+    g->buf = buf;
+    g->capacity = capacity;
+    return 1;
+}
+
+// Allocate exactly size bytes (but at least one) for output of the known size, returning 0 when out of memory
+static int AllocBufExact (CelsGrowableBuf* g, CelsNum size)
+{
+    if (size < 1)  size = 1;
+    if ((CelsNum)(size_t)size != size)  return 0;
+    g->buf = (char*) malloc (size);
+    if (g->buf==NULL)  return 0;
+    g->capacity = size;
+    return 1;
+}
+
+// Callback appending CELS_WRITE data of the main stream to the growable buffer
+static CelsResult __cdecl CelsWriteGrowable (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsGrowableBuf *g = (CelsGrowableBuf*)self;
+    if ((service==CELS_WRITE || service==CELS_WRITEV)  &&  subservice==0)
+    {
+        CelsNum total = outsize,  i;
+        if (service==CELS_WRITEV)
+            for (i=0, total=0;  i<outsize;  i++)
+                total += ((const CelsIoVec*)outbuf)[i].size;
+        if (!GrowBuf (g, g->size+total))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        if (service==CELS_WRITEV)
+            GatherMem (g->buf+g->size, g->capacity-g->size, (const CelsIoVec*)outbuf, outsize);
+        else
+            memcpy (g->buf+g->size, outbuf, outsize);
+        g->size += total;
+        return total;
+    }
+    else
+    {
+        return (g->callback? g->callback (g->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
+                           : CELS_ERROR_NOT_IMPLEMENTED);
+    }
+}
+
+// (De)compress (inbuf,insize) into the buffer allocated by the function itself.
+// The output goes to the final buffer when its size is known in advance (compression with CELS_GET_MAX_COMPRESSED_SIZE),
+// otherwise it's written through the callback into the buffer growing as necessary, so the operation runs only once.
+// Only codecs supporting neither known bound nor callbacks are rerun with doubled buffer until the output fits.
+static CelsResult MemAlloc (int service, const void* method, void* inbuf, CelsNum insize, void** outbuf, void* ud, CelsCallback* cb)
+{
+    CelsGrowableBuf g = {NULL,0,0, ud,cb};
+    int compress = (service==CELS_COMPRESS);
+    CelsResult result = CELS_ERROR_NOT_IMPLEMENTED;
+    *outbuf = NULL;
+
+    // Codecs that can inflate data unboundedly return the bound too large to allocate
+    CelsResult bound = compress? CelsGetMaxCompressedSize (method, insize) : CELS_ERROR_NOT_IMPLEMENTED;
+    if (bound >= 0  &&  !AllocBufExact (&g, bound))  bound = CELS_ERROR_NOT_IMPLEMENTED;
+    if (!GrowBuf (&g, compress? insize : insize*2))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    if (bound >= 0) {
+        result = CelsCompressMem (method, inbuf,insize, g.buf,g.capacity, ud,cb);
+        if (result == CELS_ERROR_OUTBLOCK_TOO_SMALL)  result = CELS_ERROR_NOT_IMPLEMENTED;   // the bound was wrong
+    }
+
+    if (result == CELS_ERROR_NOT_IMPLEMENTED) {
+        g.size = 0;
+        result = compress? CelsCompressMem   (method, inbuf,insize, NULL,0, &g,CelsWriteGrowable)
+                         : CelsDecompressMem (method, inbuf,insize, NULL,0, &g,CelsWriteGrowable);
+        if (result >= CELS_OK)  result = g.size;
+    }
+
+    while (result == CELS_ERROR_NOT_IMPLEMENTED  ||  result == CELS_ERROR_OUTBLOCK_TOO_SMALL) {
+        // The codec works only with memory buffers
+        if (result == CELS_ERROR_OUTBLOCK_TOO_SMALL  &&  !GrowBuf (&g, g.capacity*2))  {result = CELS_ERROR_NOT_ENOUGH_MEMORY;  break;}
+        result = compress? CelsCompressMem   (method, inbuf,insize, g.buf,g.capacity, ud,cb)
+                         : CelsDecompressMem (method, inbuf,insize, g.buf,g.capacity, ud,cb);
+        if (result == CELS_ERROR_NOT_IMPLEMENTED)  break;
+    }
+
+    if (result < CELS_OK)  {free (g.buf);  return result;}
+    // Return unused memory, keeping at least one byte so the caller always gets a pointer to free
+    char* buf = (char*) realloc (g.buf, result>0? result : 1);
+    *outbuf = buf? buf : g.buf;
+    return result;
+}
+
+CelsResult CelsCompressMemAlloc (const void* method, void* inbuf, CelsNum insize, void** outbuf, void* ud, CelsCallback* cb)
+{
+    return MemAlloc (CELS_COMPRESS, method, inbuf,insize, outbuf, ud,cb);
+}
+
+CelsResult CelsDecompressMemAlloc (const void* method, void* inbuf, CelsNum insize, void** outbuf, void* ud, CelsCallback* cb)
+{
+    return MemAlloc (CELS_DECOMPRESS, method, inbuf,insize, outbuf, ud,cb);
+}
+
+// Callback serving CELS_READ/CELS_WRITE of every stream from/to its own memory buffer, for codecs and chains with multiple streams
+CelsResult __cdecl CelsMemStreamsCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsMemStreams *streams = (CelsMemStreams*)self;
+    CelsStreamBuffer *stream = NULL;
+    int reading = (service==CELS_READ  || service==CELS_READV);
+    int writing = (service==CELS_WRITE || service==CELS_WRITEV);
+    if (reading  &&  subservice>=0  &&  subservice<streams->num_inputs)    stream = &streams->inputs[subservice];
+    if (writing  &&  subservice>=0  &&  subservice<streams->num_outputs)   stream = &streams->outputs[subservice];
+
+    if (stream  &&  stream->buf  &&  reading)
+    {
+        CelsNum read_bytes = stream->size - stream->pos;
+        if (service==CELS_READV)
+            read_bytes = ScatterMem ((char*)stream->buf + stream->pos, read_bytes, (const CelsIoVec*)inbuf, insize);
+        else {
+            if (read_bytes > insize)  read_bytes = insize;
+            memcpy (inbuf, (char*)stream->buf + stream->pos, read_bytes);
+        }
+        stream->pos += read_bytes;
+        return read_bytes;
+    }
+    else if (stream  &&  stream->buf)
+    {
+        if (service==CELS_WRITEV)
+            outsize = GatherMem ((char*)stream->buf + stream->pos, stream->size - stream->pos, (const CelsIoVec*)outbuf, outsize);
+        else if (outsize > stream->size - stream->pos)
+            return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+        else
+            memcpy ((char*)stream->buf + stream->pos, outbuf, outsize);
+        if (outsize < 0)  return outsize;
+        stream->pos += outsize;
+        return outsize;
+    }
+    else
+    {
+        return (streams->callback? streams->callback (streams->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
+                                 : CELS_ERROR_NOT_IMPLEMENTED);
+    }
+}
+
+
+// ****************************************************************************************************************************
+// Compression chains like "rep:c512+tor:d1m:h2m" or "bcj2(storing,lzma:1m,lzma:1m)+lzma:64m" parsed into single object      *
+// ****************************************************************************************************************************
+
+// Node of the chain being parsed. Its method is parsed in place into its own block, which becomes part of the chain,
+// since initialized instances may keep pointers into themselves and can't be moved
+typedef struct {
+    int     input_node, input_stream;
+    char*   method;                 // malloc'ed block of CELS_MAX_PARSED_METHOD_SIZE bytes
+} ChainParserNode;
+
+typedef struct {
+    const char*       ptr;                  // current position in the chain string
+    const char*       end;
+    ChainParserNode*  nodes;    int num_nodes,    max_nodes;
+    CelsChainStream*  outputs;  int num_outputs,  max_outputs;
+    void*             ud;
+    CelsCallback*     cb;
+} ChainParser;
+
+static size_t AlignChainData (size_t size)  {return (size+15) & ~(size_t)15;}
+
+static int IsChainDelimiter (char c)  {return c=='+' || c=='(' || c==')' || c==',';}
+
+// Skip the method starting at ptr. Wrapper methods like "mt:8[rep+lzma]" hold the wrapped method (or chain) in brackets,
+// so delimiters inside brackets belong to the method
+static const char* SkipChainMethod (const char* ptr, const char* end)
+{
+    int brackets = 0;
+    for (;  ptr < end;  ptr++) {
+        if      (*ptr=='[')                              brackets++;
+        else if (*ptr==']')                              {if (brackets > 0)  brackets--;}
+        else if (brackets==0 && IsChainDelimiter(*ptr))  break;
+    }
+    return ptr;
+}
+
+// Number of comma-separated items in the parenthesized list starting at ptr
+static int CountChainItems (const char* ptr, const char* end)
+{
+    int items = 1,  level = 0;
+    for (ptr = SkipChainMethod (ptr+1, end);  ptr < end;  ptr = SkipChainMethod (ptr+1, end)) {
+        if      (*ptr=='(')                level++;
+        else if (*ptr==')')                {if (level-- == 0)  break;}
+        else if (*ptr==',' && level==0)    items++;
+    }
+    return items;
+}
+
+static CelsResult AddChainOutput (ChainParser* cp, int node, int stream)
+{
+    CelsChainStream* output = (CelsChainStream*) ExtendArray ((void**)&cp->outputs, sizeof(CelsChainStream), &cp->num_outputs, &cp->max_outputs);
+    if (output==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    output->node   = node;
+    output->stream = stream;
+    return CELS_OK;
+}
+
+// Parse chain (up to the first unmatched ')' or ',') processing given output stream of the node and add its outputs to the list
+static CelsResult ParseChainPart (ChainParser* cp, int node, int stream, int depth)
+{
+    CelsResult errcode;
+    if (depth > 100)  return CELS_ERROR_INVALID_COMPRESSOR;
+
+    for (;;)
+    {
+        const char* method_str = cp->ptr;
+        cp->ptr = SkipChainMethod (cp->ptr, cp->end);
+        CelsNum len = cp->ptr - method_str;
+        int has_suboutputs = (cp->ptr < cp->end  &&  *cp->ptr=='(');
+        if (len == 0)  return CELS_ERROR_INVALID_COMPRESSOR;
+
+        if (len==7 && !memcmp(method_str,"storing",7)) {
+            // Data pass through unchanged
+            if (has_suboutputs)  return CELS_ERROR_INVALID_COMPRESSOR;
+        } else {
+            // Parse the method into its final place and save it together with its input
+            ChainParserNode* new_node = (ChainParserNode*) ExtendArray ((void**)&cp->nodes, sizeof(ChainParserNode), &cp->num_nodes, &cp->max_nodes);
+            if (new_node==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+            char* method = (char*) malloc (CELS_MAX_PARSED_METHOD_SIZE);
+            CelsResult size = method? CelsParseView (method_str, len, method,CELS_MAX_PARSED_METHOD_SIZE, cp->ud,cp->cb) : CELS_ERROR_NOT_ENOUGH_MEMORY;
+            if (size < CELS_OK)  {free (method);  cp->num_nodes--;  return size;}
+            new_node->input_node   = node;
+            new_node->input_stream = stream;
+            new_node->method       = method;
+            node = cp->num_nodes-1;
+            stream = 0;
+
+            // Chains processing outputs of the method, listed in parentheses: either all outputs, or all but the main one
+            // that is processed by the methods following '+'. Remaining outputs leave the chain as is
+            CelsResult num_outputs = CelsGetNumOutputStreams (method);
+            if (num_outputs == CELS_ERROR_NOT_IMPLEMENTED)  num_outputs = 1;
+            if (num_outputs < CELS_OK)  return num_outputs;
+            int i = 1;
+            if (has_suboutputs) {
+                if (CountChainItems (cp->ptr, cp->end) == num_outputs)
+                    i = 0,  stream = -1;
+                do {
+                    cp->ptr++;   // skip '(' or ','
+                    if (i >= num_outputs)  return CELS_ERROR_INVALID_COMPRESSOR;
+                    errcode = ParseChainPart (cp, node, i++, depth+1);
+                    if (errcode < CELS_OK)  return errcode;
+                } while (cp->ptr < cp->end  &&  *cp->ptr==',');
+                if (cp->ptr >= cp->end  ||  *cp->ptr!=')')  return CELS_ERROR_INVALID_COMPRESSOR;
+                cp->ptr++;
+            }
+            for (;  i < num_outputs;  i++)
+                if ((errcode = AddChainOutput (cp, node, i)) < CELS_OK)  return errcode;
+        }
+
+        // The main output is processed by the next method in the chain or leaves the chain
+        int has_next = (cp->ptr < cp->end  &&  *cp->ptr=='+');
+        if (stream < 0)  return has_next? CELS_ERROR_INVALID_COMPRESSOR : CELS_OK;   // the main output is already processed
+        if (has_next)  {cp->ptr++;  continue;}
+        return AddChainOutput (cp, node, stream);
+    }
+}
+
+// Parse compression chain into newly allocated *chain, which should be freed by CelsFreeChain()
+CelsResult CelsParseChain (const char* chain_str, CelsChain** chain, void* ud, CelsCallback* cb)
+{
+    ChainParser* cp = (ChainParser*) malloc (sizeof(ChainParser));
+    if (cp==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    memset (cp, 0, sizeof(ChainParser));
+    cp->ptr = chain_str;
+    cp->end = chain_str + strlen(chain_str);
+    cp->ud  = ud;
+    cp->cb  = cb;
+
+    CelsResult errcode = ParseChainPart (cp, -1, 0, 0);
+    if (errcode >= CELS_OK  &&  cp->ptr != cp->end)  errcode = CELS_ERROR_INVALID_COMPRESSOR;
+
+    // Pack the chain into single memory block: header, nodes and outputs; parsed methods stay in their own blocks
+    CelsChain* result = NULL;
+    int i;
+    if (errcode >= CELS_OK) {
+        size_t nodes_offset   = AlignChainData (sizeof(CelsChain));
+        size_t outputs_offset = AlignChainData (nodes_offset   + cp->num_nodes*sizeof(CelsChainNode));
+        char* block = (char*) malloc (outputs_offset + cp->num_outputs*sizeof(CelsChainStream));
+        if (block) {
+            result = (CelsChain*) block;
+            result->num_nodes   = cp->num_nodes;
+            result->nodes       = (CelsChainNode*) (block + nodes_offset);
+            result->num_outputs = cp->num_outputs;
+            result->outputs     = (CelsChainStream*) (block + outputs_offset);
+            memcpy (result->outputs, cp->outputs, cp->num_outputs*sizeof(CelsChainStream));
+            for (i=0;  i<cp->num_nodes;  i++) {
+                result->nodes[i].method       = cp->nodes[i].method;
+                result->nodes[i].input_node   = cp->nodes[i].input_node;
+                result->nodes[i].input_stream = cp->nodes[i].input_stream;
+            }
+        } else {
+            errcode = CELS_ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+    if (errcode < CELS_OK) {
+        for (i=cp->num_nodes-1;  i>=0;  i--)
+            CelsFree (cp->nodes[i].method),  free (cp->nodes[i].method);
+    }
+
+    free (cp->nodes);
+    free (cp->outputs);
+    free (cp);
+    *chain = result;
+    return errcode < CELS_OK? errcode : CELS_OK;
+}
+
+void CelsFreeChain (CelsChain* chain)
+{
+    if (chain==NULL)  return;
+    int i;
+    for (i=chain->num_nodes-1;  i>=0;  i--)
+        CelsFree (chain->nodes[i].method),  free (chain->nodes[i].method);
+    free (chain);
+}
+
+// Upper limits of sizes of every chain output for given input size
+static CelsResult ChainOutputSizes (const CelsChain* chain, CelsNum insize, CelsNum* output_sizes)
+{
+    CelsNum* sizes = (CelsNum*) malloc ((chain->num_nodes+1) * sizeof(CelsNum));
+    if (sizes==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    CelsResult result = CELS_OK;
+    int i;
+
+    // Every output of the node is limited by the limit computed by the node for its input
+    for (i=0;  i<chain->num_nodes  &&  result >= 0;  i++) {
+        const CelsChainNode* node = &chain->nodes[i];
+        CelsNum input = node->input_node < 0?  insize : sizes[node->input_node];
+        sizes[i] = CelsGetMaxCompressedSize (node->method, input);
+        if (sizes[i] < 0)  result = sizes[i];
+    }
+    for (i=0;  i<chain->num_outputs  &&  result >= 0;  i++)
+        output_sizes[i] = chain->outputs[i].node < 0?  insize : sizes[chain->outputs[i].node];
+
+    free (sizes);
+    return result;
+}
+
+// Upper limit of the total size of chain outputs for given input size; unbounded outputs make it LLONG_MAX
+static CelsResult ChainMaxCompressedSize (const CelsChain* chain, CelsNum insize)
+{
+    CelsNum* sizes = (CelsNum*) malloc ((chain->num_outputs+1) * sizeof(CelsNum));
+    if (sizes==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    CelsResult result = ChainOutputSizes (chain, insize, sizes);
+    int i;
+    for (i=0;  i<chain->num_outputs  &&  result >= 0;  i++)
+        result = sizes[i] > LLONG_MAX-result?  LLONG_MAX : result+sizes[i];
+    free (sizes);
+    return result;
+}
+
+// Allocate buffers for all outputs of the chain compressing insize bytes, each one sized by the limit of its size
+CelsResult CelsAllocChainOutputs (const CelsChain* chain, CelsNum insize, CelsStreamBuffer* outputs)
+{
+    CelsNum* sizes = (CelsNum*) malloc ((chain->num_outputs+1) * sizeof(CelsNum));
+    if (sizes==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    CelsResult result = ChainOutputSizes (chain, insize, sizes);
+    int i;
+    for (i=0;  i<chain->num_outputs  &&  result >= 0;  i++) {
+        outputs[i].size = sizes[i];
+        outputs[i].pos  = 0;
+        outputs[i].buf  = (CelsNum)(size_t)sizes[i] == sizes[i]?  malloc (sizes[i]? (size_t)sizes[i] : 1) : NULL;
+        if (outputs[i].buf == NULL)  result = CELS_ERROR_NOT_ENOUGH_MEMORY;
+    }
+    if (result < CELS_OK) {
+        while (--i >= 0)
+            free (outputs[i].buf),  outputs[i].buf = NULL;
+    }
+    free (sizes);
+    return result;
+}
+
+// Value of CELS_GET_* parameter for the whole chain: memory and CPU load are summed over all methods
+// since they work simultaneously, while dictionary, block and minimal input sizes are maximum over all methods
+CelsResult CelsChainGet (const CelsChain* chain, int service, CelsNum insize)
+{
+    int sum;
+    if (service == CELS_GET_NUM_INPUT_STREAMS)            return 1;
+    else if (service == CELS_GET_NUM_OUTPUT_STREAMS)      return chain->num_outputs;
+    else if (service == CELS_GET_MAX_COMPRESSED_SIZE)     return ChainMaxCompressedSize (chain, insize);
+    else if (service == CELS_GET_COMPRESSION_MEMORY          ||  service == CELS_GET_DECOMPRESSION_MEMORY  ||
+             service == CELS_GET_MINIMUM_COMPRESSION_MEMORY  ||  service == CELS_GET_MINIMUM_DECOMPRESSION_MEMORY  ||
+             service == CELS_GET_COMPRESSION_CPU_LOAD        ||  service == CELS_GET_DECOMPRESSION_CPU_LOAD)
+        sum = 1;
+    else if (service == CELS_GET_DICTIONARY_SIZE  ||  service == CELS_GET_BLOCKSIZE  ||
+             service == CELS_GET_MINIMAL_INPUT_SIZE  ||  service == CELS_GET_EXPAND_DATA)
+        sum = 0;
+    else
+        return CELS_ERROR_NOT_IMPLEMENTED;
+
+    // Methods that don't implement the service are skipped
+    CelsResult total = 0;
+    int i;
+    for (i=0;  i<chain->num_nodes;  i++) {
+        CelsResult value = Cels (chain->nodes[i].method, service,0, 0,insize, 0,0, 0,0);
+        if (value == CELS_ERROR_NOT_IMPLEMENTED)  continue;
+        if (value < CELS_OK)                      return value;
+        if (sum)                 total += value;
+        else if (value > total)  total = value;
+    }
+    return total;
+}
+
+
+// ****************************************************************************************************************************
+// Execution of compression chain: every method runs in its own thread, connected to the next one by bounded in-memory queue  *
+// ****************************************************************************************************************************
+
+// Bounded byte queue between two stages of the chain
+typedef struct {
+    CelsMutex   mutex;
+    CelsCond    changed;
+    char*       buf;
+    size_t      size, start, used;      // ring buffer: used bytes starting at start
+    int         eof;                    // writer finished
+    int         closed;                 // reader finished, so further writes fail
+} ChainPipe;
+
+typedef struct ChainRun ChainRun;
+
+// Where the stream of the stage goes to (or comes from)
+typedef struct {
+    ChainPipe*  pipe;                   // queue connecting the stage with another one, or NULL for the application
+    int         app_stream;             // stream number of the application callback when pipe==NULL, -1 if the stream isn't used
+} ChainRoute;
+
+typedef struct {
+    ChainRun*   run;
+    void*       method;
+    ChainRoute  main;                   // input of the method for compression, its output for decompression
+    ChainRoute* streams;                // outputs of the method for compression, its inputs for decompression
+    int         num_streams;
+    int         app_input, app_output;  // all inputs/outputs of the stage belong to the application
+    CelsThread  thread;
+} ChainStage;
+
+struct ChainRun {
+    int           service;              // CELS_COMPRESS or CELS_DECOMPRESS
+    void*         ud;
+    CelsCallback* cb;
+    CelsMutex     cb_mutex;             // serializes calls to the application callback and guards errcode
+    CelsResult    errcode;              // the first error occurred
+    ChainPipe*    pipes;
+    int           num_pipes;
+};
+
+static CelsResult PipeWrite (ChainPipe* pipe, const char* data, CelsNum size)
+{
+    CelsNum written = 0;
+    MutexLock (&pipe->mutex);
+    while (written < size) {
+        while (pipe->used == pipe->size  &&  !pipe->closed)
+            CondWait (&pipe->changed, &pipe->mutex);
+        if (pipe->closed)  break;
+        size_t pos = (pipe->start + pipe->used) % pipe->size;
+        size_t len = pipe->size - pipe->used;
+        if (len > pipe->size - pos)       len = pipe->size - pos;
+        if ((CelsNum)len > size-written)  len = (size_t)(size-written);
+        memcpy (pipe->buf+pos, data+written, len);
+        pipe->used += len;
+        written += len;
+        CondBroadcast (&pipe->changed);
+    }
+    MutexUnlock (&pipe->mutex);
+    return written==size? size : CELS_ERROR_NO_MORE_DATA_REQUIRED;   // reader doesn't need more data
+}
+
+static CelsResult PipeRead (ChainPipe* pipe, char* data, CelsNum size)
+{
+    CelsNum read = 0;
+    MutexLock (&pipe->mutex);
+    while (pipe->used == 0  &&  !pipe->eof  &&  !pipe->closed)
+        CondWait (&pipe->changed, &pipe->mutex);
+    while (read < size  &&  pipe->used > 0) {
+        size_t len = pipe->size - pipe->start;
+        if (len > pipe->used)              len = pipe->used;
+        if ((CelsNum)len > size-read)      len = (size_t)(size-read);
+        memcpy (data+read, pipe->buf+pipe->start, len);
+        pipe->start = (pipe->start + len) % pipe->size;
+        pipe->used -= len;
+        read += len;
+    }
+    CondBroadcast (&pipe->changed);
+    int aborted = pipe->closed;
+    MutexUnlock (&pipe->mutex);
+    return read==0 && aborted? CELS_ERROR_OPERATION_TERMINATED : read;
+}
+
+// Mark the pipe finished by the writer (eof) and/or the reader (closed), waking up the other side
+static void ClosePipe (ChainPipe* pipe, int eof, int closed)
+{
+    MutexLock (&pipe->mutex);
+    if (eof)     pipe->eof = 1;
+    if (closed)  pipe->closed = 1;
+    CondBroadcast (&pipe->changed);
+    MutexUnlock (&pipe->mutex);
+}
+
+static CelsResult CallApplication (ChainRun* run, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize)
+{
+    if (run->cb == NULL)  return CELS_ERROR_NOT_IMPLEMENTED;
+    MutexLock (&run->cb_mutex);
+    CelsResult result = run->cb (run->ud, service,subservice, inbuf,insize, outbuf,outsize, NULL,NULL);
+    MutexUnlock (&run->cb_mutex);
+    return result;
+}
+
+// Callback of the stage: reads and writes every stream of the method from/to its queue or the application callback.
+// Only stages that read from and write to the application report chain progress
+static CelsResult __cdecl ChainStageCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    ChainStage* stage = (ChainStage*) self;
+    ChainRun* run = stage->run;
+    if (service == CELS_READ  ||  service == CELS_WRITE  ||  service == CELS_READV  ||  service == CELS_WRITEV) {
+        // The main stream is read by compression and written by decompression, other streams go the opposite way
+        int reading = (service == CELS_READ  ||  service == CELS_READV);
+        ChainRoute* route = NULL;
+        if (reading == (run->service == CELS_COMPRESS))
+            route = subservice == 0?  &stage->main : NULL;
+        else if (subservice >= 0  &&  subservice < stage->num_streams)
+            route = &stage->streams[subservice];
+        if (route == NULL  ||  (route->pipe == NULL  &&  route->app_stream < 0))
+            return CELS_ERROR_INTERNAL;     // the method uses more streams than it declared
+
+        // Vectored operations on queues are performed by CelsReadV()/CelsWriteV() buffer by buffer
+        if (route->pipe)
+            return service == CELS_READ?   PipeRead  (route->pipe, (char*)inbuf, insize)
+                 : service == CELS_WRITE?  PipeWrite (route->pipe, (const char*)outbuf, outsize)
+                 :                         CELS_ERROR_NOT_IMPLEMENTED;
+        return CallApplication (run, service,route->app_stream, inbuf,insize, outbuf,outsize);
+    }
+    else if (service == CELS_PROGRESS) {
+        if (!stage->app_input)   insize = 0;
+        if (!stage->app_output)  outsize = 0;
+        return insize || outsize?  CallApplication (run, service,subservice, inbuf,insize, outbuf,outsize) : CELS_OK;
+    }
+    else if (service == CELS_QUASI_WRITE)
+        return stage->app_output? CallApplication (run, service,subservice, inbuf,insize, outbuf,outsize) : CELS_OK;
+    else if (service >= CELS_RECEIVE_FILLED_INBUF  &&  service <= CELS_SEND_FILLED_OUTBUF)
+        return CELS_ERROR_NOT_IMPLEMENTED;     // buffers of the application can't be shared by inner stages
+    else
+        return CallApplication (run, service,subservice, inbuf,insize, outbuf,outsize);
+}
+
+// Run the stage, then let neighbours know that it's finished. Errors abort the whole chain.
+static void RunChainStage (ChainStage* stage)
+{
+    ChainRun* run = stage->run;
+    int compress = (run->service == CELS_COMPRESS),  i;
+    CelsResult result = Cels (stage->method, run->service,0, NULL,0, NULL,0, stage,(CelsCallback*)ChainStageCallback);
+    if (stage->main.pipe)  ClosePipe (stage->main.pipe, !compress, compress);
+    for (i=0;  i<stage->num_streams;  i++)
+        if (stage->streams[i].pipe)  ClosePipe (stage->streams[i].pipe, compress, !compress);
+
+    if (result < CELS_OK  &&  result != CELS_ERROR_NO_MORE_DATA_REQUIRED) {
+        MutexLock (&run->cb_mutex);
+        int first_error = (run->errcode == CELS_OK);
+        if (first_error)  run->errcode = result;
+        MutexUnlock (&run->cb_mutex);
+        if (first_error) {
+            for (i=0;  i<run->num_pipes;  i++)
+                ClosePipe (&run->pipes[i], 1, 1);
+        }
+    }
+}
+
+static CELS_THREAD_FUNCTION (ChainStageThread)
+{
+    RunChainStage ((ChainStage*) arg);
+    return 0;
+}
+
+// Copy data from the application input to its output
+static CelsResult ChainCopy (void* ud, CelsCallback* cb)
+{
+    char buf[4096];
+    for (;;) {
+        CelsResult len = CelsRead (cb,ud, buf,sizeof(buf));
+        if (len <= 0)  return len;
+        CelsResult result = CelsWrite (cb,ud, buf,len);
+        if (result != len)  return result<CELS_OK? result : CELS_ERROR_WRITE;
+    }
+}
+
+static CelsResult ExecuteChain (const CelsChain* chain, int service, void* ud, CelsCallback* cb)
+{
+    int n = chain->num_nodes,  compress = (service == CELS_COMPRESS),  i;
+    if (n <= 0)  return ChainCopy (ud,cb);
+
+    // Single method whose outputs leave the chain in their natural order talks to the application directly
+    for (i=0;  n==1 && i<chain->num_outputs;  i++)
+        if (chain->outputs[i].stream != i)  break;
+    if (n == 1  &&  i == chain->num_outputs)
+        return Cels (chain->nodes[0].method, service,0, NULL,0, NULL,0, ud,cb);
+
+    // Number of streams of every method is defined by the streams used by the chain
+    ChainRun run;
+    run.service   = service;
+    run.ud        = ud;
+    run.cb        = cb;
+    run.errcode   = CELS_OK;
+    run.num_pipes = 0;
+    ChainStage* stages = (ChainStage*) calloc (n, sizeof(ChainStage));
+    if (stages==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    for (i=0;  i<n;  i++) {
+        const CelsChainNode* node = &chain->nodes[i];
+        if (node->input_node >= 0  &&  stages[node->input_node].num_streams <= node->input_stream)
+            stages[node->input_node].num_streams = node->input_stream+1;
+        if (node->input_node >= 0)  run.num_pipes++;
+    }
+    for (i=0;  i<chain->num_outputs;  i++) {
+        const CelsChainStream* output = &chain->outputs[i];
+        if (output->node < 0)  {free (stages);  return CELS_ERROR_NOT_IMPLEMENTED;}    // the chain input is also passed through
+        if (stages[output->node].num_streams <= output->stream)
+            stages[output->node].num_streams = output->stream+1;
+    }
+    int num_routes = 0;
+    for (i=0;  i<n;  i++)
+        num_routes += stages[i].num_streams;
+
+    // Every stream connecting two methods gets its own queue, sharing CELS_CHAIN_BUFFER_SIZE bytes
+    ChainRoute* routes = (ChainRoute*) malloc ((num_routes+1) * sizeof(ChainRoute));
+    run.pipes = (ChainPipe*) calloc (run.num_pipes+1, sizeof(ChainPipe));
+    size_t pipe_size = CELS_CHAIN_BUFFER_SIZE / (run.num_pipes? run.num_pipes : 1);
+    for (i=0;  routes && run.pipes && i<run.num_pipes;  i++)
+        if ((run.pipes[i].buf = (char*) malloc (pipe_size)) == NULL)  break;
+    if (routes==NULL || run.pipes==NULL || i<run.num_pipes) {
+        for (i=0;  run.pipes && i<run.num_pipes;  i++)
+            free (run.pipes[i].buf);
+        free (run.pipes);
+        free (routes);
+        free (stages);
+        return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    }
+    MutexInit (&run.cb_mutex);
+    for (i=0;  i<run.num_pipes;  i++) {
+        run.pipes[i].size = pipe_size;
+        MutexInit (&run.pipes[i].mutex);
+        CondInit (&run.pipes[i].changed);
+    }
+
+    // Connect the stages: the chain input is the stream 0 of the application, and the chain output i is its stream i
+    for (i=0;  i<num_routes;  i++)
+        routes[i].pipe = NULL,  routes[i].app_stream = -1;
+    ChainRoute* next_routes = routes;
+    for (i=0;  i<n;  i++) {
+        stages[i].run     = &run;
+        stages[i].method  = chain->nodes[i].method;
+        stages[i].streams = next_routes;
+        next_routes += stages[i].num_streams;
+    }
+    int pipe = 0;
+    for (i=0;  i<n;  i++) {
+        const CelsChainNode* node = &chain->nodes[i];
+        stages[i].main.pipe = NULL;
+        stages[i].main.app_stream = 0;
+        if (node->input_node >= 0) {
+            stages[i].main.pipe = &run.pipes[pipe];
+            stages[node->input_node].streams[node->input_stream].pipe = &run.pipes[pipe];
+            pipe++;
+        }
+    }
+    for (i=0;  i<chain->num_outputs;  i++)
+        stages[chain->outputs[i].node].streams[chain->outputs[i].stream].app_stream = i;
+    for (i=0;  i<n;  i++) {
+        int all_streams = 1,  k;
+        for (k=0;  k<stages[i].num_streams;  k++)
+            if (stages[i].streams[k].pipe)  all_streams = 0;
+        stages[i].app_input  = compress? stages[i].main.pipe==NULL : all_streams;
+        stages[i].app_output = compress? all_streams : stages[i].main.pipe==NULL;
+    }
+
+    // The last stage runs in the current thread
+    int started;
+    for (started=0;  started<n-1;  started++)
+        if (!StartThread (&stages[started].thread, ChainStageThread, &stages[started]))  break;
+    if (started == n-1) {
+        RunChainStage (&stages[n-1]);
+    } else {
+        run.errcode = CELS_ERROR_GENERAL;
+        for (i=0;  i<run.num_pipes;  i++)
+            ClosePipe (&run.pipes[i], 1, 1);
+    }
+    for (i=0;  i<started;  i++)
+        JoinThread (stages[i].thread);
+
+    for (i=0;  i<run.num_pipes;  i++) {
+        CondDestroy (&run.pipes[i].changed);
+        MutexDestroy (&run.pipes[i].mutex);
+        free (run.pipes[i].buf);
+    }
+    MutexDestroy (&run.cb_mutex);
+    free (run.pipes);
+    free (routes);
+    free (stages);
+    return run.errcode;
+}
+
+// Compress data from CELS_READ to CELS_WRITE of the callback with the whole chain, running its methods in parallel
+CelsResult CelsCompressChain (const CelsChain* chain, void* ud, CelsCallback* cb)
+{
+    return ExecuteChain (chain, CELS_COMPRESS, ud,cb);
+}
+
+CelsResult CelsDecompressChain (const CelsChain* chain, void* ud, CelsCallback* cb)
+{
+    return ExecuteChain (chain, CELS_DECOMPRESS, ud,cb);
+}
+
+// Method string consisting of several methods
+static int IsChainString (const char* str)
+{
+    const char* end = str + strlen(str);
+    return SkipChainMethod (str, end) != end;
+}
+
+// Cels() on chain string: CELS_COMPRESS/CELS_DECOMPRESS via callbacks run the whole chain, and CELS_GET_* services
+// return values of CelsChainGet(). Buffers are left to the callbacks of CelsCompressMem()/CelsDecompressMem()
+static CelsResult ChainStringService (const char* chain_str, int service, CelsNum insize, void* inbuf, void* outbuf, void* ud, CelsCallback* cb)
+{
+    int operation = (service == CELS_COMPRESS  ||  service == CELS_DECOMPRESS);
+    if (operation  &&  (inbuf || outbuf))  return CELS_ERROR_NOT_IMPLEMENTED;
+    if (!operation  &&  (service&0xFF000000) != 0x01000000  &&  (service&0xFF000000) != 0x02000000)
+        return CELS_ERROR_NOT_IMPLEMENTED;
+
+    CelsChain* chain;
+    CelsResult result = CelsParseChain (chain_str, &chain, ud,cb);
+    if (result < CELS_OK)  return result;
+    result = operation?  ExecuteChain (chain, service, ud,cb) : CelsChainGet (chain, service, insize);
+    CelsFreeChain (chain);
+    return result;
+}
+
+
+// ****************************************************************************************************************************
+// Pool of large aligned buffers serving CELS_RECEIVE_FILLED_INBUF/CELS_SEND_EMPTY_INBUF/CELS_RECEIVE_EMPTY_OUTBUF/           *
+// CELS_SEND_FILLED_OUTBUF services on top of CELS_READ/CELS_WRITE of the application callback                                *
+// ****************************************************************************************************************************
+
+struct CelsBufferPool
+{
+    char*           block;          // memory allocated for buffers
+    char*           buffers;        // the first buffer, aligned to CELS_BUFFER_POOL_ALIGNMENT
+    CelsNum         buffer_size;
+    int             num_buffers;
+    char*           in_use;         // flags of buffers lent to the codec
+    CelsMutex       lock;           // guards in_use, since codec may call buffer services in parallel
+    CelsMutex       io_lock;        // serializes calls to the application callback
+    void*           userdata;       // data passed to the application callback
+    CelsCallback*   callback;       // application callback performing actual reading/writing
+};
+
+CelsResult CelsCreateBufferPool (CelsBufferPool** pool, int num_buffers, CelsNum buffer_size, void* ud, CelsCallback* cb)
+{
+    *pool = NULL;
+    if (num_buffers <= 0  ||  buffer_size <= 0)  return CELS_ERROR_GENERAL;
+    buffer_size = (buffer_size + CELS_BUFFER_POOL_ALIGNMENT-1) & ~(CelsNum)(CELS_BUFFER_POOL_ALIGNMENT-1);
+    if ((CelsNum)(size_t)buffer_size != buffer_size  ||  (size_t)-1 / (size_t)buffer_size < (size_t)num_buffers+1)
+        return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    CelsBufferPool* p = (CelsBufferPool*) malloc (sizeof(CelsBufferPool));
+    if (p==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    p->block  = (char*) malloc ((size_t)buffer_size*num_buffers + CELS_BUFFER_POOL_ALIGNMENT);
+    p->in_use = (char*) calloc (num_buffers, 1);
+    if (p->block==NULL || p->in_use==NULL)  {free(p->block);  free(p->in_use);  free(p);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+    p->buffers     = p->block + (CELS_BUFFER_POOL_ALIGNMENT - (size_t)p->block % CELS_BUFFER_POOL_ALIGNMENT) % CELS_BUFFER_POOL_ALIGNMENT;
+    p->buffer_size = buffer_size;
+    p->num_buffers = num_buffers;
+    p->userdata    = ud;
+    p->callback    = cb;
+    MutexInit (&p->lock);
+    MutexInit (&p->io_lock);
+    *pool = p;
+    return CELS_OK;
+}
+
+void CelsDeleteBufferPool (CelsBufferPool* pool)
+{
+    if (pool==NULL)  return;
+    MutexDestroy (&pool->lock);
+    MutexDestroy (&pool->io_lock);
+    free (pool->block);
+    free (pool->in_use);
+    free (pool);
+}
+
+// Lend a free buffer, returning its number or -1 if all buffers are lent
+static int AcquirePoolBuffer (CelsBufferPool* pool)
+{
+    int i;
+    MutexLock (&pool->lock);
+    for (i=0;  i<pool->num_buffers;  i++)
+        if (!pool->in_use[i])  {pool->in_use[i] = 1;  break;}
+    MutexUnlock (&pool->lock);
+    return i<pool->num_buffers? i : -1;
+}
+
+static void ReleasePoolBuffer (CelsBufferPool* pool, int i)
+{
+    MutexLock (&pool->lock);
+    pool->in_use[i] = 0;
+    MutexUnlock (&pool->lock);
+}
+
+// Number of the lent buffer containing (ptr,size) area, or -1
+static int FindPoolBuffer (CelsBufferPool* pool, void* ptr, CelsNum size)
+{
+    char* p = (char*) ptr;
+    if (p < pool->buffers  ||  p >= pool->buffers + pool->buffer_size*pool->num_buffers)  return -1;
+    int i = (int) ((p - pool->buffers) / pool->buffer_size);
+    MutexLock (&pool->lock);
+    int lent = pool->in_use[i];
+    MutexUnlock (&pool->lock);
+    if (!lent  ||  size < 0  ||  size > pool->buffers + pool->buffer_size*(i+1) - p)  return -1;
+    return i;
+}
+
+static CelsResult CallPoolApplication (CelsBufferPool* pool, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    if (pool->callback == NULL)  return CELS_ERROR_NOT_IMPLEMENTED;
+    MutexLock (&pool->io_lock);
+    CelsResult result = pool->callback (pool->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+    MutexUnlock (&pool->io_lock);
+    return result;
+}
+
+// Callback serving buffer services with pool buffers. Its userdata should be the pool.
+// Services may be called in parallel, but the codec can't hold more than num_buffers buffers at once.
+// A buffer received with CELS_RECEIVE_FILLED_INBUF may be sent back with CELS_SEND_FILLED_OUTBUF after in-place processing.
+// All other services, including CELS_READ/CELS_WRITE, are passed to the application callback.
+CelsResult __cdecl CelsBufferPoolCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsBufferPool* pool = (CelsBufferPool*) self;
+    int i;
+    if (service == CELS_RECEIVE_FILLED_INBUF)
+    {
+        // Fill the buffer completely, unless input ends earlier
+        if ((i = AcquirePoolBuffer(pool)) < 0)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        char* buf = pool->buffers + pool->buffer_size*i;
+        CelsNum size = 0;
+        while (size < pool->buffer_size) {
+            CelsResult len = CallPoolApplication (pool, CELS_READ,0, buf+size,pool->buffer_size-size, NULL,0, ud,cb);
+            if (len < 0)  {ReleasePoolBuffer (pool, i);  return len;}
+            if (len == 0)  break;
+            size += len;
+        }
+        if (size == 0)  {ReleasePoolBuffer (pool, i);  return 0;}     // EOF
+        *(void**)inbuf = buf;
+        return size;
+    }
+    else if (service == CELS_RECEIVE_EMPTY_OUTBUF)
+    {
+        if ((i = AcquirePoolBuffer(pool)) < 0)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        *(void**)outbuf = pool->buffers + pool->buffer_size*i;
+        return pool->buffer_size;
+    }
+    else if (service == CELS_SEND_EMPTY_INBUF)
+    {
+        if ((i = FindPoolBuffer (pool, inbuf, 0)) < 0)  return CELS_ERROR_GENERAL;
+        ReleasePoolBuffer (pool, i);
+        return CELS_OK;
+    }
+    else if (service == CELS_SEND_FILLED_OUTBUF)
+    {
+        if ((i = FindPoolBuffer (pool, outbuf, outsize)) < 0)  return CELS_ERROR_GENERAL;
+        CelsResult result = outsize==0? 0 : CallPoolApplication (pool, CELS_WRITE,0, NULL,0, outbuf,outsize, ud,cb);
+        ReleasePoolBuffer (pool, i);
+        if (result < CELS_OK)  return result;
+        return result==outsize? CELS_OK : CELS_ERROR_WRITE;
+    }
+    else
+    {
+        return CallPoolApplication (pool, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+    }
+}
+
+
+// ****************************************************************************************************************************
+// Scheduler running (de)compression of independent blocks in parallel, as far as memory and CPU cores allow                 *
+// ****************************************************************************************************************************
+
+typedef struct BlockRun BlockRun;
+
+// Job being executed in its own thread
+typedef struct {
+    BlockRun*      run;
+    CelsBlockJob*  job;
+    CelsNum        memory, load;
+    int            running;         // the job isn't finished yet
+    int            started;         // the thread was started and isn't joined yet
+    CelsThread     thread;
+    char           method[CELS_MAX_METHOD_STRING_SIZE];    // method string reduced for the block
+} BlockSlot;
+
+struct BlockRun {
+    int            service;         // CELS_COMPRESS or CELS_DECOMPRESS
+    void*          ud;
+    CelsCallback*  cb;
+    CelsMutex      mutex;           // guards the fields below and BlockSlot::running
+    CelsCond       finished;        // signalled on every finished job
+    CelsNum        memory_used, load_used;
+    int            running;
+    CelsResult     errcode;         // the first error occurred
+};
+
+// Apply CelsLimit*() to the method string in buf, leaving it intact when the method doesn't have such parameter
+static CelsResult LimitBlockMethod (CelsResult (*limit) (void*, CelsNum, char*), char* buf, CelsNum value)
+{
+    char limited[CELS_MAX_METHOD_STRING_SIZE];
+    CelsResult result = limit (buf, value, limited);
+    if (result == CELS_ERROR_NOT_IMPLEMENTED)  return CELS_OK;
+    if (result >= CELS_OK)  strcpy (buf, limited);
+    return result;
+}
+
+// Value of CELS_GET_* parameter, or default value when it isn't implemented
+static CelsResult GetBlockMethodParam (const char* method, int service, CelsNum default_value)
+{
+    CelsResult result = Cels (method, service,0, 0,0, 0,0, 0,0);
+    return result == CELS_ERROR_NOT_IMPLEMENTED?  default_value : result;
+}
+
+// Find method string for the job and resources it requires. For compression with limit!=0, the method is reduced first to the
+// block size (that shouldn't make compression worse) and then to the memory budget; decompression memory can't be reduced at all
+static CelsResult PrepareBlockJob (int service, int limit, const CelsBlockJob* job, CelsNum memory, char* method, CelsNum* job_memory, CelsNum* job_load)
+{
+    CelsResult result = CELS_OK;
+    if (strlen (job->method) >= CELS_MAX_METHOD_STRING_SIZE)  return CELS_ERROR_INVALID_COMPRESSOR;
+    strcpy (method, job->method);
+    if (service == CELS_COMPRESS  &&  limit) {
+        result = LimitBlockMethod (CelsLimitMinimalInputSize, method, job->insize);
+        if (result >= CELS_OK)  result = LimitBlockMethod (CelsLimitCompressionMem, method, memory);
+    }
+    if (result < CELS_OK)  return result;
+
+    int compress = (service == CELS_COMPRESS);
+    *job_memory = GetBlockMethodParam (method, compress? CELS_GET_COMPRESSION_MEMORY   : CELS_GET_DECOMPRESSION_MEMORY,   0);
+    *job_load   = GetBlockMethodParam (method, compress? CELS_GET_COMPRESSION_CPU_LOAD : CELS_GET_DECOMPRESSION_CPU_LOAD, 100);
+    if (*job_memory < CELS_OK)  return *job_memory;
+    if (*job_load   < CELS_OK)  return *job_load;
+    if (*job_load  == 0)        *job_load = 1;
+    return CELS_OK;
+}
+
+static void RunBlockJob (BlockSlot* slot)
+{
+    BlockRun* run = slot->run;
+    CelsBlockJob* job = slot->job;
+    CelsResult result = run->service == CELS_COMPRESS
+                          ? CelsCompressMem   (slot->method, job->inbuf,job->insize, job->outbuf,job->outsize, run->ud,run->cb)
+                          : CelsDecompressMem (slot->method, job->inbuf,job->insize, job->outbuf,job->outsize, run->ud,run->cb);
+    MutexLock (&run->mutex);
+    job->result = result;
+    if (result < CELS_OK  &&  run->errcode == CELS_OK)  run->errcode = result;
+    run->memory_used -= slot->memory;
+    run->load_used   -= slot->load;
+    run->running--;
+    slot->running = 0;
+    CondBroadcast (&run->finished);
+    MutexUnlock (&run->mutex);
+}
+
+static CELS_THREAD_FUNCTION (BlockJobThread)
+{
+    RunBlockJob ((BlockSlot*) arg);
+    return 0;
+}
+
+// Start jobs in their order, each one as soon as it fits into the memory and CPU budget left by running jobs.
+// limit=0 keeps compression methods as given, for callers that don't store the reduced ones
+static CelsResult ScheduleBlocks (int service, int limit, CelsBlockJob* jobs, int num_jobs, CelsNum memory, int cores, void* ud, CelsCallback* cb)
+{
+    BlockRun run;
+    run.service     = service;
+    run.ud          = ud;
+    run.cb          = cb;
+    run.memory_used = 0;
+    run.load_used   = 0;
+    run.running     = 0;
+    run.errcode     = CELS_OK;
+    MutexInit (&run.mutex);
+    CondInit (&run.finished);
+    CelsNum max_load = (CelsNum)(cores > 0? cores : NumberOfCores()) * 100;
+
+    BlockSlot** slots = NULL;
+    int num_slots = 0,  max_slots = 0,  i,  k;
+    char method[CELS_MAX_METHOD_STRING_SIZE];
+    for (i=0;  i<num_jobs;  i++)
+    {
+        CelsNum job_memory = 0,  job_load = 0;
+        CelsResult result = PrepareBlockJob (service, limit, &jobs[i], memory, method, &job_memory, &job_load);
+        jobs[i].result = result;
+        if (service == CELS_COMPRESS)
+            strcpy (jobs[i].used_method, result >= CELS_OK? method : "");
+
+        // Wait until the job fits, but never wait for an empty system: the job that can't fit at all runs alone
+        MutexLock (&run.mutex);
+        if (result < CELS_OK  &&  run.errcode == CELS_OK)  run.errcode = result;
+        while (run.errcode == CELS_OK  &&  run.running > 0  &&
+               (run.memory_used + job_memory > memory  ||  run.load_used + job_load > max_load))
+            CondWait (&run.finished, &run.mutex);
+        for (k=0;  k<num_slots  &&  slots[k]->running;  k++);
+        CelsResult errcode = run.errcode;
+        if (errcode == CELS_OK) {
+            run.memory_used += job_memory;
+            run.load_used   += job_load;
+            run.running++;
+            if (k < num_slots)  slots[k]->running = 1;
+        }
+        MutexUnlock (&run.mutex);
+
+        // Reuse a finished slot or add new one
+        BlockSlot* slot = NULL;
+        if (errcode == CELS_OK  &&  k < num_slots) {
+            slot = slots[k];
+            if (slot->started)  JoinThread (slot->thread);
+        } else if (errcode == CELS_OK) {
+            BlockSlot** ptr = (BlockSlot**) ExtendArray ((void**)&slots, sizeof(BlockSlot*), &num_slots, &max_slots);
+            slot = ptr? (BlockSlot*) malloc (sizeof(BlockSlot)) : NULL;
+            if (ptr  &&  slot==NULL)  num_slots--;
+            else if (ptr)             *ptr = slot;
+        }
+        if (slot == NULL) {
+            if (result >= CELS_OK)
+                jobs[i].result = errcode == CELS_OK?  CELS_ERROR_NOT_ENOUGH_MEMORY : CELS_ERROR_OPERATION_TERMINATED;
+            if (errcode == CELS_OK) {
+                // No memory for the slot: release resources reserved for the job
+                MutexLock (&run.mutex);
+                run.memory_used -= job_memory;
+                run.load_used   -= job_load;
+                run.running--;
+                if (run.errcode == CELS_OK)  run.errcode = CELS_ERROR_NOT_ENOUGH_MEMORY;
+                MutexUnlock (&run.mutex);
+            }
+            break;
+        }
+        slot->run     = &run;
+        slot->job     = &jobs[i];
+        slot->memory  = job_memory;
+        slot->load    = job_load;
+        slot->running = 1;
+        strcpy (slot->method, method);
+
+        // The last job is executed in the current thread that would only wait otherwise, as well as any job when no more threads can be started
+        slot->started = i+1 < num_jobs  &&  StartThread (&slot->thread, BlockJobThread, slot);
+        if (!slot->started)  RunBlockJob (slot);
+    }
+
+    // Jobs after the error aren't started
+    for (i++;  i<num_jobs;  i++)
+        jobs[i].result = CELS_ERROR_OPERATION_TERMINATED;
+    for (k=0;  k<num_slots;  k++) {
+        if (slots[k]->started)  JoinThread (slots[k]->thread);
+        free (slots[k]);
+    }
+    free (slots);
+    CondDestroy (&run.finished);
+    MutexDestroy (&run.mutex);
+    return run.errcode;
+}
+
+CelsResult CelsCompressBlocks (CelsBlockJob* jobs, int num_jobs, CelsNum memory, int cores, void* ud, CelsCallback* cb)
+{
+    return ScheduleBlocks (CELS_COMPRESS, 1, jobs, num_jobs, memory, cores, ud,cb);
+}
+
+CelsResult CelsDecompressBlocks (CelsBlockJob* jobs, int num_jobs, CelsNum memory, int cores, void* ud, CelsCallback* cb)
+{
+    return ScheduleBlocks (CELS_DECOMPRESS, 1, jobs, num_jobs, memory, cores, ud,cb);
+}
+
+
+// ****************************************************************************************************************************
+// Parsed methods kept by every thread between operations, so codecs supporting caching don't reallocate their memory         *
+// ****************************************************************************************************************************
+
+// Header of the acquired method, followed by the parsed method itself (CELS_MAX_PARSED_METHOD_SIZE bytes) and the method string
+typedef struct PooledMethod {
+    struct PooledMethod*  next;         // next (less recently released) method in the pool
+    const char*           method_str;   // the method string it was parsed from
+    unsigned              hash;         // hash of the method string
+    CelsNum               memory;       // memory kept by the method while it's in the pool
+} PooledMethod;
+
+static const size_t POOLED_METHOD_HEADER = (sizeof(PooledMethod) + 15) & ~(size_t)15;
+
+// Pool of the thread, starting with the most recently released method.
+// All pools are linked into a list, so CelsUnload() can free methods kept by other threads while their codecs are still loaded
+typedef struct InstancePool {
+    PooledMethod*  first;
+    CelsNum        memory;              // memory kept by all methods in the pool
+    CelsNum        limit;               // max. memory kept by the pool
+    CelsSpinLock   lock;                // guards the methods against FlushInstancePools() called by another thread
+    struct InstancePool  *prev, *next;  // neighbours in the list of all pools
+} InstancePool;
+
+static CelsThreadLocal  InstancePoolKey;
+static volatile int     InstancePoolKeyState = 0;    // 0: not created yet, 1: created, -1: thread-local values aren't available
+static CelsSpinLock     InstancePoolKeyLock = 0;
+static InstancePool*    InstancePools = NULL;        // list of pools of all threads, guarded by InstancePoolsLock
+static CelsSpinLock     InstancePoolsLock = 0;
+
+static void FreePooledMethod (PooledMethod* entry)
+{
+    CelsFree ((char*)entry + POOLED_METHOD_HEADER);
+    free (entry);
+}
+
+static void FreePooledMethodList (PooledMethod* entry)
+{
+    while (entry) {
+        PooledMethod* next = entry->next;
+        FreePooledMethod (entry);
+        entry = next;
+    }
+}
+
+// Detach all methods from the pool, so they can be freed outside of the pool lock
+static PooledMethod* DetachPooledMethods (InstancePool* pool)
+{
+    SpinLock (&pool->lock);
+    PooledMethod* first = pool->first;
+    pool->first  = NULL;
+    pool->memory = 0;
+    SpinUnlock (&pool->lock);
+    return first;
+}
+
+// Reduce memory kept by the pool down to the limit
+static void FlushInstancePool (InstancePool* pool, CelsNum limit)
+{
+    PooledMethod* released = NULL;
+    SpinLock (&pool->lock);
+    while (pool->first  &&  pool->memory > limit) {
+        // Release the least recently used method
+        PooledMethod** last = &pool->first;
+        while ((*last)->next)  last = &(*last)->next;
+        pool->memory -= (*last)->memory;
+        (*last)->next = released;
+        released = *last;
+        *last = NULL;
+    }
+    SpinUnlock (&pool->lock);
+    FreePooledMethodList (released);
+}
+
+// Free methods kept by pools of all threads
+static void FlushInstancePools (void)
+{
+    PooledMethod* released = NULL;
+    SpinLock (&InstancePoolsLock);
+    InstancePool* pool;
+    for (pool = InstancePools;  pool;  pool = pool->next) {
+        PooledMethod *first = DetachPooledMethods (pool),  *last = first;
+        if (first == NULL)  continue;
+        while (last->next)  last = last->next;
+        last->next = released;
+        released = first;
+    }
+    SpinUnlock (&InstancePoolsLock);
+    FreePooledMethodList (released);
+}
+
+static CELS_THREAD_LOCAL_DESTRUCTOR (FreeInstancePool)
+{
+    InstancePool* pool = (InstancePool*) value;
+    if (pool == NULL)  return;
+    SpinLock (&InstancePoolsLock);
+    if (pool->prev)  pool->prev->next = pool->next;  else InstancePools = pool->next;
+    if (pool->next)  pool->next->prev = pool->prev;
+    SpinUnlock (&InstancePoolsLock);
+    FreePooledMethodList (DetachPooledMethods (pool));
+    free (pool);
+}
+
+// Pool of the current thread, created on the first use if create!=0
+static InstancePool* ThreadInstancePool (int create)
+{
+    if (InstancePoolKeyState == 0) {
+        SpinLock (&InstancePoolKeyLock);
+        if (InstancePoolKeyState == 0) {
+            int created = ThreadLocalCreate (&InstancePoolKey, FreeInstancePool);
+            MemoryFence();
+            InstancePoolKeyState = created? 1 : -1;
+        }
+        SpinUnlock (&InstancePoolKeyLock);
+    }
+    MemoryFence();
+    if (InstancePoolKeyState < 0)  return NULL;
+
+    InstancePool* pool = (InstancePool*) ThreadLocalGet (InstancePoolKey);
+    if (pool == NULL  &&  create) {
+        pool = (InstancePool*) calloc (1, sizeof(InstancePool));
+        if (pool == NULL)  return NULL;
+        pool->limit = CELS_INSTANCE_POOL_MEMORY;
+        SpinLock (&InstancePoolsLock);
+        pool->next = InstancePools;
+        if (InstancePools)  InstancePools->prev = pool;
+        InstancePools = pool;
+        SpinUnlock (&InstancePoolsLock);
+        ThreadLocalSet (InstancePoolKey, pool);
+    }
+    return pool;
+}
+
+// Take parsed method from the pool of the current thread or parse it anew
+void* CelsAcquireMethod (const char* method_str, CelsResult* errcode, void* ud, CelsCallback* cb)
+{
+    size_t len = strlen (method_str);
+    unsigned hash = StringHash (method_str, len);
+    InstancePool* pool = ThreadInstancePool (0);
+    if (pool) {
+        PooledMethod** ptr;
+        SpinLock (&pool->lock);
+        for (ptr = &pool->first;  *ptr;  ptr = &(*ptr)->next) {
+            PooledMethod* entry = *ptr;
+            if (entry->hash == hash  &&  strcmp (entry->method_str, method_str) == 0) {
+                *ptr = entry->next;
+                pool->memory -= entry->memory;
+                SpinUnlock (&pool->lock);
+                *errcode = CELS_OK;
+                return (char*)entry + POOLED_METHOD_HEADER;
+            }
+        }
+        SpinUnlock (&pool->lock);
+    }
+
+    // Instance is parsed and initialized in place, since it may keep pointers into itself; its size isn't known beforehand
+    PooledMethod* entry = (PooledMethod*) malloc (POOLED_METHOD_HEADER + CELS_MAX_PARSED_METHOD_SIZE + len+1);
+    if (entry == NULL)  {*errcode = CELS_ERROR_NOT_ENOUGH_MEMORY;  return NULL;}
+    CelsResult size = CelsParseStr (method_str, (char*)entry + POOLED_METHOD_HEADER, CELS_MAX_PARSED_METHOD_SIZE, ud,cb);
+    if (size < CELS_OK)  {free (entry);  *errcode = size;  return NULL;}
+    memcpy ((char*)entry + POOLED_METHOD_HEADER + CELS_MAX_PARSED_METHOD_SIZE, method_str, len+1);
+    entry->next       = NULL;
+    entry->method_str = (char*)entry + POOLED_METHOD_HEADER + CELS_MAX_PARSED_METHOD_SIZE;
+    entry->hash       = hash;
+    entry->memory     = 0;
+    *errcode = CELS_OK;
+    return (char*)entry + POOLED_METHOD_HEADER;
+}
+
+// Put the method into the pool of the current thread if its codec supports caching, or free it
+void CelsReleaseMethod (void* method)
+{
+    if (method == NULL)  return;
+    PooledMethod* entry = (PooledMethod*) ((char*)method - POOLED_METHOD_HEADER);
+    InstancePool* pool = CelsGetCaching (method) == 1?  ThreadInstancePool (1) : NULL;
+    if (pool == NULL)  {FreePooledMethod (entry);  return;}
+
+    // The method may be used for both compression and decompression, so it may keep the larger of their memories
+    CelsResult cmem = CelsGetCompressionMem (method),  dmem = CelsGetDecompressionMem (method);
+    entry->memory = cmem > dmem? cmem : dmem;
+    if (entry->memory < 0)  entry->memory = 0;
+    if (entry->memory > pool->limit)  {FreePooledMethod (entry);  return;}
+    FlushInstancePool (pool, pool->limit - entry->memory);
+    SpinLock (&pool->lock);
+    entry->next = pool->first;
+    pool->first = entry;
+    pool->memory += entry->memory;
+    SpinUnlock (&pool->lock);
+}
+
+void CelsSetInstancePoolMemory (CelsNum limit)
+{
+    InstancePool* pool = ThreadInstancePool (1);
+    if (pool == NULL)  return;
+    pool->limit = limit;
+    FlushInstancePool (pool, limit);
+}
+
+void CelsFlushInstancePool (void)
+{
+    InstancePool* pool = ThreadInstancePool (0);
+    if (pool)  FreePooledMethodList (DetachPooledMethods (pool));
+}
+
+
+// ****************************************************************************************************************************
+// Resumable (de)compression: codecs implementing CELS_*_STEP services are called directly, and blocking codecs run on fibers  *
+// ****************************************************************************************************************************
+
+// Fiber running function(arg) on its own stack: FiberSwitchTo() runs it until it calls FiberYield() or finishes
+#ifdef _WIN32
+typedef struct {
+    LPVOID  fiber, host;
+    void  (*function) (void*);
+    void*   arg;
+} CelsFiber;
+
+static VOID CALLBACK FiberStart (LPVOID param)
+{
+    CelsFiber* f = (CelsFiber*) param;
+    f->function (f->arg);
+    for (;;)  SwitchToFiber (f->host);      // fiber function shouldn't return
+}
+
+static int FiberCreate (CelsFiber* f, size_t stack_size, void (*function) (void*), void* arg)
+{
+    f->function = function;
+    f->arg      = arg;
+    f->fiber    = CreateFiberEx (0, stack_size, 0, FiberStart, f);
+    return f->fiber != NULL;
+}
+
+static void FiberSwitchTo (CelsFiber* f)
+{
+    int converted = !IsThreadAFiber();
+    if (converted  &&  !ConvertThreadToFiber (NULL))  return;
+    f->host = GetCurrentFiber();
+    SwitchToFiber (f->fiber);
+    if (converted)  ConvertFiberToThread();
+}
+
+static void FiberYield  (CelsFiber* f)  {SwitchToFiber (f->host);}
+static void FiberDelete (CelsFiber* f)  {DeleteFiber (f->fiber);}
+#else
+#include <ucontext.h>
+typedef struct {
+    ucontext_t  context, host;
+    char*       stack;
+    void      (*function) (void*);
+    void*       arg;
+} CelsFiber;
+
+// makecontext() passes only int arguments, so the pointer is split into two halves
+static void FiberStart (unsigned lo, unsigned hi)
+{
+    CelsFiber* f = (CelsFiber*) (((unsigned long long)hi << 32) | lo);
+    f->function (f->arg);
+    for (;;)  swapcontext (&f->context, &f->host);
+}
+
+static int FiberCreate (CelsFiber* f, size_t stack_size, void (*function) (void*), void* arg)
+{
+    f->function = function;
+    f->arg      = arg;
+    f->stack    = (char*) malloc (stack_size);
+    if (f->stack == NULL  ||  getcontext (&f->context) != 0)  {free (f->stack);  return 0;}
+    f->context.uc_stack.ss_sp   = f->stack;
+    f->context.uc_stack.ss_size = stack_size;
+    f->context.uc_link          = NULL;
+    unsigned long long ptr = (unsigned long long) (size_t) f;
+    makecontext (&f->context, (void (*)(void)) FiberStart, 2, (unsigned)ptr, (unsigned)(ptr >> 32));
+    return 1;
+}
+
+static void FiberSwitchTo (CelsFiber* f)  {swapcontext (&f->host, &f->context);}
+static void FiberYield    (CelsFiber* f)  {swapcontext (&f->context, &f->host);}
+static void FiberDelete   (CelsFiber* f)  {free (f->stack);}
+#endif
+
+struct CelsStream {
+    void*            method;        // acquired by CelsAcquireMethod()
+    int              service;       // CELS_COMPRESS or CELS_DECOMPRESS
+    void*            ud;
+    CelsCallback*    cb;
+    int              native;        // 1: codec implements CELS_*_STEP, 0: it runs on the fiber, -1: not known yet
+    int              mode;          // CELS_STEP_* mode of the current call
+    CelsStepBuffers  step;          // buffers of the current call, and the state of the native codec
+    int              finished;      // the stream is finished with the result below
+    CelsResult       result;
+    CelsFiber        fiber;         // blocking codec
+    int              started;       // the fiber was created
+    int              aborted;       // the fiber should return as soon as possible
+};
+
+// Callback of blocking codec: copy data between the codec and buffers of the current call, switching to the caller
+// when input is exhausted or output space is filled
+static CelsResult __cdecl StreamFiberCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsStream* s = (CelsStream*) self;
+    CelsStepBuffers* b = &s->step;
+    if ((service == CELS_READ  ||  service == CELS_WRITE)  &&  subservice == 0) {
+        int reading = (service == CELS_READ);
+        char* buf = (char*) (reading? inbuf : outbuf);
+        CelsNum size = reading? insize : outsize,  done = 0;
+        while (done < size) {
+            if (s->aborted)  return CELS_ERROR_OPERATION_TERMINATED;
+            CelsNum len = reading? b->insize - b->inpos : b->outsize - b->outpos;
+            if (len > size-done)  len = size-done;
+            if (len > 0  &&  reading)  memcpy (buf+done, (const char*)b->inbuf + b->inpos, len),  b->inpos += len;
+            if (len > 0  &&  !reading) memcpy ((char*)b->outbuf + b->outpos, buf+done, len),  b->outpos += len;
+            done += len;
+            if (len > 0)  continue;
+            if (reading  &&  s->mode == CELS_STEP_FINISH)  break;     // end of input
+            FiberYield (&s->fiber);
+        }
+        return done;
+    }
+    else if (service == CELS_READ  ||  service == CELS_WRITE  ||
+             (service >= CELS_RECEIVE_FILLED_INBUF  &&  service <= CELS_WRITEV))
+        return CELS_ERROR_NOT_IMPLEMENTED;     // other streams, buffers of the application and vectored I/O aren't supported
+    else
+        return s->cb? s->cb (s->ud, service,subservice, inbuf,insize, outbuf,outsize, ud,cb) : CELS_ERROR_NOT_IMPLEMENTED;
+}
+
+static void StreamFiberMain (void* arg)
+{
+    CelsStream* s = (CelsStream*) arg;
+    CelsResult result = Cels (s->method, s->service,0, NULL,0, NULL,0, s,(CelsCallback*)StreamFiberCallback);
+    s->result   = result < CELS_OK? result : CELS_OK;
+    s->finished = 1;
+}
+
+CelsResult CelsCreateStream (CelsStream** stream, const char* method, int service, void* ud, CelsCallback* cb)
+{
+    *stream = NULL;
+    if (service != CELS_COMPRESS  &&  service != CELS_DECOMPRESS)  return CELS_ERROR_NOT_IMPLEMENTED;
+    CelsStream* s = (CelsStream*) calloc (1, sizeof(CelsStream));
+    if (s == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    CelsResult errcode;
+    s->method = CelsAcquireMethod (method, &errcode, ud,cb);
+    if (s->method == NULL)  {free (s);  return errcode;}
+    s->service = service;
+    s->ud      = ud;
+    s->cb      = cb;
+    s->native  = -1;
+    *stream = s;
+    return CELS_OK;
+}
+
+CelsResult CelsStreamProcess (CelsStream* s, const void* inbuf, CelsNum insize, CelsNum* inused, void* outbuf, CelsNum outsize, CelsNum* outused, int mode)
+{
+    s->step.inbuf   = inbuf;
+    s->step.insize  = insize;
+    s->step.inpos   = 0;
+    s->step.outbuf  = outbuf;
+    s->step.outsize = outsize;
+    s->step.outpos  = 0;
+    s->mode         = mode;
+    *inused = *outused = 0;
+    if (s->finished)  return s->result;
+
+    // Try resumable service first; blocking codec will not consume anything before returning CELS_ERROR_NOT_IMPLEMENTED
+    if (s->native != 0) {
+        int service = s->service==CELS_COMPRESS? CELS_COMPRESS_STEP : CELS_DECOMPRESS_STEP;
+        CelsResult result = Cels (s->method, service,mode, &s->step,0, NULL,0, s->ud,s->cb);
+        if (s->native < 0  &&  result == CELS_ERROR_NOT_IMPLEMENTED) {
+            s->native = 0;
+        } else {
+            s->native = 1;
+            if (result <= 0)  s->finished = 1,  s->result = result;
+            *inused  = s->step.inpos;
+            *outused = s->step.outpos;
+            return result;
+        }
+    }
+
+    if (!s->started) {
+        if (!FiberCreate (&s->fiber, CELS_STREAM_STACK_SIZE, StreamFiberMain, s))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        s->started = 1;
+    }
+    FiberSwitchTo (&s->fiber);
+    *inused  = s->step.inpos;
+    *outused = s->step.outpos;
+    return s->finished? s->result : 1;
+}
+
+void CelsDeleteStream (CelsStream* s)
+{
+    if (s == NULL)  return;
+    if (s->native > 0  &&  !s->finished) {
+        int service = s->service==CELS_COMPRESS? CELS_COMPRESS_STEP : CELS_DECOMPRESS_STEP;
+        Cels (s->method, service,CELS_STEP_ABORT, &s->step,0, NULL,0, s->ud,s->cb);
+    }
+    if (s->started) {
+        // Blocked codec gets errors from all reads and writes, so it should return soon
+        s->aborted = 1;
+        s->step.insize = s->step.inpos = s->step.outsize = s->step.outpos = 0;
+        while (!s->finished)
+            FiberSwitchTo (&s->fiber);
+        FiberDelete (&s->fiber);
+    }
+    CelsReleaseMethod (s->method);
+    free (s);
+}
+
+
+// ****************************************************************************************************************************
+// "mt" codec: "mt:threads:bBLOCKSIZE[method]" splits data into independent blocks (de)compressed by method in parallel       *
+// ****************************************************************************************************************************
+
+// Compressed stream is a sequence of frames {original size, compressed size, compressed data} finished by a frame of zero sizes,
+// and followed by the index: sizes of every block, then the number of blocks (all numbers are 8-byte little-endian).
+// Blocks are cut at the same positions with any number of threads, so it doesn't affect compressed data.
+typedef struct {
+    int      threads;        // 0: all cores
+    CelsNum  block_size;
+    char     method[1];      // NUL-terminated method compressing every block; parsed record is extended to hold it
+} MtMethod;
+
+static void PutMtNumber (unsigned char* buf, CelsNum value)
+{
+    int i;
+    for (i=0;  i<8;  i++)
+        buf[i] = (unsigned char) ((unsigned long long)value >> (i*8));
+}
+
+static CelsNum GetMtNumber (const unsigned char* buf)
+{
+    unsigned long long value = 0;
+    int i;
+    for (i=7;  i>=0;  i--)
+        value = (value<<8) + buf[i];
+    return value > (unsigned long long)LLONG_MAX?  -1 : (CelsNum)value;
+}
+
+// Read up to size bytes, stopping only at the end of input
+static CelsResult ReadMtData (void* ud, CelsCallback* cb, void* buf, CelsNum size)
+{
+    CelsNum done = 0;
+    while (done < size) {
+        CelsResult len = CelsRead (cb,ud, (char*)buf+done, size-done);
+        if (len < CELS_OK)  return len;
+        if (len == 0)       break;
+        done += len;
+    }
+    return done;
+}
+
+static CelsResult WriteMtData (void* ud, CelsCallback* cb, void* buf, CelsNum size)
+{
+    CelsResult result = CelsWrite (cb,ud, buf,size);
+    return result == size?  CELS_OK : result < CELS_OK?  result : CELS_ERROR_WRITE;
+}
+
+// Parse size like "16m" or "4096" into *value
+static int ParseMtSize (const char* str, CelsNum len, CelsNum* value)
+{
+    CelsNum n = 0,  i,  shift = 0;
+    if (len > 0) {
+        char c = str[len-1];
+        shift = (c=='k'||c=='K')? 10 : (c=='m'||c=='M')? 20 : (c=='g'||c=='G')? 30 : 0;
+        if (shift)  len--;
+    }
+    if (len == 0)  return 0;
+    for (i=0;  i<len;  i++) {
+        if (str[i] < '0'  ||  str[i] > '9'  ||  n > (LLONG_MAX>>shift)/10 - 1)  return 0;
+        n = n*10 + (str[i]-'0');
+    }
+    *value = n << shift;
+    return 1;
+}
+
+// Join parameters of wrapper codec "wrapper:params[method]" back into the method string str, and split it into
+// the parameters of the wrapper and the method (or chain) it wraps, which should be the rest of the string
+static CelsResult SplitWrappedMethod (const CelsStrView* params, CelsNum num_params, char* str, char** method)
+{
+    CelsNum len = 0,  i;
+    for (i=0;  i<num_params;  i++) {
+        if (len + params[i].len + 1 >= CELS_MAX_METHOD_STRING_SIZE)  return CELS_ERROR_INVALID_COMPRESSOR;
+        if (i > 0)  str[len++] = CELS_METHOD_PARAMETERS_DELIMITER;
+        memcpy (str+len, params[i].str, params[i].len);
+        len += params[i].len;
+    }
+    str[len] = '\0';
+    *method = strchr (str, '[');
+    if (*method == NULL  ||  str[len-1] != ']'  ||  *method+1 == str+len-1)  return CELS_ERROR_INVALID_COMPRESSOR;
+
+    // The bracket opened first should be closed last
+    int brackets = 0;
+    char* p;
+    for (p = *method;  p < str+len-1;  p++) {
+        if (*p == '[')  brackets++;
+        if (*p == ']'  &&  --brackets == 0)  return CELS_ERROR_INVALID_COMPRESSOR;
+    }
+    str[len-1] = '\0';
+    *(*method)++ = '\0';
+    return CELS_OK;
+}
+
+// Parameters up to the '[' belong to "mt", and the bracketed rest is the method it wraps
+static CelsResult ParseMt (const CelsStrView* params, CelsNum num_params, MtMethod* m, CelsNum size)
+{
+    char str[CELS_MAX_METHOD_STRING_SIZE],  *method;
+    CelsResult errcode = SplitWrappedMethod (params, num_params, str, &method);
+    if (errcode < CELS_OK)  return errcode;
+
+    CelsResult record_size = offsetof(MtMethod,method) + strlen(method) + 1;
+    if (record_size > size)  return CELS_ERROR_INVALID_COMPRESSOR;
+    m->threads    = 0;
+    m->block_size = CELS_MT_BLOCK_SIZE;
+    strcpy (m->method, method);
+
+    // Skip the "mt" name and parse threads number and "b" block size
+    char* param = strchr (str, CELS_METHOD_PARAMETERS_DELIMITER);
+    while (param) {
+        char* end = strchr (++param, CELS_METHOD_PARAMETERS_DELIMITER);
+        CelsNum plen = end? end-param : (CelsNum)strlen(param),  value;
+        if (*param == 'b'  &&  ParseMtSize (param+1, plen-1, &value)  &&  value > 0)
+            m->block_size = value;
+        else if (plen > 0  &&  plen <= 4  &&  strspn (param, "0123456789") == (size_t)plen)
+            m->threads = atoi (param);
+        else
+            return CELS_ERROR_INVALID_COMPRESSOR;
+        param = end;
+    }
+    return record_size;
+}
+
+// Append block size to str as "b16m" or "b1000"
+static void FormatMtSize (char* str, CelsNum size)
+{
+    const char* suffix = "";
+    if      (size % (1<<30) == 0)  size >>= 30,  suffix = "g";
+    else if (size % (1<<20) == 0)  size >>= 20,  suffix = "m";
+    else if (size % (1<<10) == 0)  size >>= 10,  suffix = "k";
+    sprintf (str+strlen(str), "b%lld%s", (long long)size, suffix);
+}
+
+static CelsResult UnparseMt (const MtMethod* m, int mode, char* outbuf, CelsNum outsize)
+{
+    char str[CELS_MAX_METHOD_STRING_SIZE] = "mt:";
+    if (m->threads  &&  mode != CELS_UNPARSE_PURE)
+        sprintf (str+strlen(str), "%d:", m->threads);
+    FormatMtSize (str, m->block_size);
+    strcat (str, "[");
+    size_t len = strlen(str);
+    CelsResult result = Cels (m->method, CELS_UNPARSE,mode, 0,0, str+len, CELS_MAX_METHOD_STRING_SIZE-len-1, 0,0);
+    if (result == CELS_ERROR_NOT_IMPLEMENTED  &&  IsChainString (m->method)  &&  strlen (m->method) < CELS_MAX_METHOD_STRING_SIZE-len-1)
+        strcpy (str+len, m->method), result = CELS_OK;     // chains are kept as written
+    if (result < CELS_OK)  return result;
+    strcat (str, "]");
+    if ((CelsNum)strlen(str) >= outsize)  return CELS_ERROR_GENERAL;
+    strcpy (outbuf, str);
+    return CELS_OK;
+}
+
+// Upper limit of compressed size of a block of the wrapped method; it may not tell it, assuming moderate expansion then
+static CelsResult MtBlockBound (const MtMethod* m, CelsNum size)
+{
+    CelsResult bound = CelsGetMaxCompressedSize (m->method, size);
+    if (bound == CELS_ERROR_NOT_IMPLEMENTED)
+        bound = size > LLONG_MAX/2?  LLONG_MAX : size + size/2 + 4096;
+    return bound;
+}
+
+// Every thread runs the wrapped method and holds input buffers of two groups (the next one is read while the current one
+// is processed) and one output buffer. Buffers grow with the data up to the block size, so it's the peak for long streams
+static CelsResult MtMemory (const MtMethod* m, int service)
+{
+    int threads = m->threads? m->threads : NumberOfCores();
+    CelsResult bound = MtBlockBound (m, m->block_size);
+    CelsResult memory = GetBlockMethodParam (m->method, service, 0);
+    if (bound  < CELS_OK)  return bound;
+    if (memory < CELS_OK)  return memory;
+    CelsNum input  = service==CELS_GET_COMPRESSION_MEMORY?  m->block_size : bound;
+    CelsNum output = service==CELS_GET_COMPRESSION_MEMORY?  bound : m->block_size;
+    if (input > LLONG_MAX/4  ||  output > LLONG_MAX/4  ||  memory > LLONG_MAX/threads - 2*input - output)  return LLONG_MAX;
+    return (memory + 2*input + output) * threads;
+}
+
+// Callback of the blocks (de)compressed in parallel: the application callback may be not thread-safe, so calls are serialized
+typedef struct {
+    void*          ud;
+    CelsCallback*  cb;
+    CelsMutex      mutex;
+} MtCallback;
+
+static CelsResult __cdecl MtBlockCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    MtCallback* app = (MtCallback*) self;
+    MutexLock (&app->mutex);
+    CelsResult result = app->cb (app->ud, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+    MutexUnlock (&app->mutex);
+    return result;
+}
+
+typedef struct MtRun MtRun;
+
+// Group of blocks (de)compressed simultaneously, in a background thread while the next group is read
+typedef struct {
+    MtRun*         run;
+    CelsBlockJob*  jobs;
+    CelsNum*       allocated;   // allocated size of inbuf of every job
+    int            n;           // number of blocks in the group
+    CelsResult     result;
+    int            started;     // the thread was started and isn't joined yet
+    CelsThread     thread;
+} MtGroup;
+
+struct MtRun {
+    const MtMethod* m;
+    int            service;     // CELS_COMPRESS or CELS_DECOMPRESS
+    int            threads;
+    CelsNum        bound;       // compressed size limit of the full block
+    MtGroup        groups[2];
+    void**         outbufs;     // output buffers shared by both groups, since the group is written before the next one starts
+    CelsNum*       outsizes;
+    CelsNum*       index;       // original and compressed size of every block
+    int            num_blocks,  max_blocks;
+    MtCallback     app;
+};
+
+static CelsResult StartMtRun (MtRun* run, const MtMethod* m, int service, void* ud, CelsCallback* cb)
+{
+    run->app.ud     = ud;
+    run->app.cb     = cb;
+    MutexInit (&run->app.mutex);
+    run->m          = m;
+    run->service    = service;
+    run->threads    = m->threads? m->threads : NumberOfCores();
+    run->bound      = MtBlockBound (m, m->block_size);
+    run->outbufs    = (void**)   calloc (run->threads, sizeof(void*));
+    run->outsizes   = (CelsNum*) calloc (run->threads, sizeof(CelsNum));
+    run->index      = NULL;
+    run->num_blocks = run->max_blocks = 0;
+    int ok = run->outbufs && run->outsizes,  i,  k;
+    for (k=0;  k<2;  k++) {
+        MtGroup* g = &run->groups[k];
+        g->run       = run;
+        g->jobs      = (CelsBlockJob*) calloc (run->threads, sizeof(CelsBlockJob));
+        g->allocated = (CelsNum*)      calloc (run->threads, sizeof(CelsNum));
+        g->n         = 0;
+        g->result    = CELS_OK;
+        g->started   = 0;
+        ok = ok && g->jobs && g->allocated;
+        for (i=0;  i<run->threads  &&  g->jobs;  i++)
+            g->jobs[i].method = m->method;
+    }
+    if (run->bound < CELS_OK)  return run->bound;
+    return ok?  CELS_OK : CELS_ERROR_NOT_ENOUGH_MEMORY;
+}
+
+static void FinishMtRun (MtRun* run)
+{
+    int i,  k;
+    for (k=0;  k<2;  k++) {
+        for (i=0;  i<run->threads  &&  run->groups[k].jobs;  i++)
+            free (run->groups[k].jobs[i].inbuf);
+        free (run->groups[k].jobs);
+        free (run->groups[k].allocated);
+    }
+    for (i=0;  i<run->threads  &&  run->outbufs;  i++)
+        free (run->outbufs[i]);
+    free (run->outbufs);
+    free (run->outsizes);
+    free (run->index);
+    MutexDestroy (&run->app.mutex);
+}
+
+// Grow the buffer *buf of *allocated bytes to hold size bytes, keeping its contents
+static int GrowMtBuffer (void** buf, CelsNum* allocated, CelsNum size)
+{
+    if (size <= *allocated)  return 1;
+    if ((CelsNum)(size_t)size != size)  return 0;
+    void* p = realloc (*buf, (size_t)size);
+    if (p == NULL)  return 0;
+    *buf = p,  *allocated = size;
+    return 1;
+}
+
+static CelsResult AddMtBlock (MtRun* run, CelsNum original, CelsNum compressed)
+{
+    // Index holds pairs of sizes
+    CelsNum* entry = (CelsNum*) ExtendArray ((void**)&run->index, sizeof(CelsNum)*2, &run->num_blocks, &run->max_blocks);
+    if (entry == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    entry[0] = original,  entry[1] = compressed;
+    return CELS_OK;
+}
+
+// Read the group of full blocks, the last one may be shorter. Input buffers start at 64 KB and double while the block
+// goes on, so short streams don't allocate whole blocks. Reads are serialized with callbacks of the group being compressed
+static CelsResult ReadMtGroup (MtRun* run, MtGroup* g, int* eof)
+{
+    CelsNum block_size = run->m->block_size;
+    for (g->n = 0;  g->n < run->threads  &&  !*eof;  g->n++) {
+        CelsBlockJob* job = &g->jobs[g->n];
+        CelsNum* allocated = &g->allocated[g->n],  len = 0;
+        while (len < block_size) {
+            if (len == *allocated) {
+                CelsNum size = len==0?  64<<10 : len < block_size/2?  len*2 : block_size;
+                if (!GrowMtBuffer (&job->inbuf, allocated, size < block_size? size : block_size))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+            }
+            CelsNum want = *allocated - len;
+            CelsResult result = ReadMtData (&run->app, MtBlockCallback, (char*)job->inbuf + len, want);
+            if (result < CELS_OK)  return result;
+            len += result;
+            if (result < want)  {*eof = 1;  break;}   // ReadMtData() stops short only at the end of input
+        }
+        if (len == 0)  break;
+        job->insize = len;
+    }
+    return CELS_OK;
+}
+
+// Read frames of the group of blocks into buffers of exactly their compressed size
+static CelsResult ReadMtFrames (MtRun* run, MtGroup* g, int* finished)
+{
+    unsigned char header[16];
+    for (g->n = 0;  g->n < run->threads;  g->n++) {
+        CelsBlockJob* job = &g->jobs[g->n];
+        CelsResult result = ReadMtData (&run->app, MtBlockCallback, header,16);
+        if (result < CELS_OK)  return result;
+        if (result < 16)       return CELS_ERROR_BAD_COMPRESSED_DATA;
+        CelsNum original = GetMtNumber (header),  compressed = GetMtNumber (header+8);
+        if (original == 0  &&  compressed == 0)  {*finished = 1;  break;}
+        if (original <= 0  ||  original > run->m->block_size  ||  compressed < 0  ||  compressed > run->bound)
+            return CELS_ERROR_BAD_COMPRESSED_DATA;
+        if (!GrowMtBuffer (&job->inbuf, &g->allocated[g->n], compressed))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        result = ReadMtData (&run->app, MtBlockCallback, job->inbuf, compressed);
+        if (result < CELS_OK)     return result;
+        if (result < compressed)  return CELS_ERROR_BAD_COMPRESSED_DATA;
+        result = AddMtBlock (run, original, compressed);
+        if (result < CELS_OK)     return result;
+        job->insize  = compressed;
+        job->outsize = original;
+    }
+    return CELS_OK;
+}
+
+// Give every job of the group an output buffer: the bound of its compressed size, or the original size for decompression
+static CelsResult PrepareMtOutput (MtRun* run, MtGroup* g)
+{
+    int i;
+    for (i=0;  i<g->n;  i++) {
+        CelsBlockJob* job = &g->jobs[i];
+        if (run->service == CELS_COMPRESS)
+            job->outsize = job->insize == run->m->block_size?  run->bound : MtBlockBound (run->m, job->insize);
+        if (job->outsize < CELS_OK)  return job->outsize;
+        if (!GrowMtBuffer (&run->outbufs[i], &run->outsizes[i], job->outsize))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        job->outbuf = run->outbufs[i];
+    }
+    return CELS_OK;
+}
+
+// Blocks are (de)compressed by the method as given, since decompression can't know how CelsCompressBlocks() would reduce it
+static void RunMtGroup (MtGroup* g)
+{
+    MtRun* run = g->run;
+    g->result = ScheduleBlocks (run->service, 0, g->jobs, g->n, LLONG_MAX, run->threads, &run->app, MtBlockCallback);
+}
+
+static CELS_THREAD_FUNCTION (MtGroupThread)
+{
+    RunMtGroup ((MtGroup*) arg);
+    return 0;
+}
+
+// Process the group in background when more input follows; the last group, or any one when no thread can be started, is processed now
+static void StartMtGroup (MtGroup* g, int background)
+{
+    g->started = background  &&  StartThread (&g->thread, MtGroupThread, g);
+    if (!g->started)  RunMtGroup (g);
+}
+
+static CelsResult FinishMtGroup (MtGroup* g)
+{
+    if (g->started)  JoinThread (g->thread),  g->started = 0;
+    return g->result;
+}
+
+static CelsResult MtCompress (const MtMethod* m, void* ud, CelsCallback* cb)
+{
+    MtRun run;
+    CelsResult result = StartMtRun (&run, m, CELS_COMPRESS, ud,cb);
+    int eof = 0,  cur = 0,  i;
+    unsigned char header[16];
+    if (result == CELS_OK)  result = ReadMtGroup (&run, &run.groups[0], &eof);
+    while (result == CELS_OK  &&  run.groups[cur].n > 0)
+    {
+        // Compress the group while the next one is read
+        MtGroup* g = &run.groups[cur];
+        result = PrepareMtOutput (&run, g);
+        if (result < CELS_OK)  break;
+        StartMtGroup (g, !eof);
+        run.groups[1-cur].n = 0;
+        CelsResult read = eof?  CELS_OK : ReadMtGroup (&run, &run.groups[1-cur], &eof);
+        result = FinishMtGroup (g);
+        if (result >= CELS_OK)  result = read;
+        for (i=0;  i<g->n  &&  result >= CELS_OK;  i++) {
+            CelsBlockJob* job = &g->jobs[i];
+            PutMtNumber (header,   job->insize);
+            PutMtNumber (header+8, job->result);
+            result = WriteMtData (ud,cb, header,16);
+            if (result == CELS_OK)  result = WriteMtData (ud,cb, job->outbuf, job->result);
+            if (result == CELS_OK)  result = AddMtBlock (&run, job->insize, job->result);
+        }
+        if (result > CELS_OK)  result = CELS_OK;
+        cur = 1-cur;
+    }
+
+    // End of blocks, and the index
+    if (result == CELS_OK) {
+        memset (header, 0, 16);
+        result = WriteMtData (ud,cb, header,16);
+    }
+    for (i=0;  i<run.num_blocks  &&  result == CELS_OK;  i++) {
+        PutMtNumber (header,   run.index[i*2]);
+        PutMtNumber (header+8, run.index[i*2+1]);
+        result = WriteMtData (ud,cb, header,16);
+    }
+    if (result == CELS_OK) {
+        PutMtNumber (header, run.num_blocks);
+        result = WriteMtData (ud,cb, header,8);
+    }
+    FinishMtRun (&run);
+    return result;
+}
+
+static CelsResult MtDecompress (const MtMethod* m, void* ud, CelsCallback* cb)
+{
+    MtRun run;
+    CelsResult result = StartMtRun (&run, m, CELS_DECOMPRESS, ud,cb);
+    int finished = 0,  cur = 0,  i;
+    unsigned char header[16];
+    if (result == CELS_OK)  result = ReadMtFrames (&run, &run.groups[0], &finished);
+    while (result == CELS_OK  &&  run.groups[cur].n > 0)
+    {
+        // Decompress the group while frames of the next one are read
+        MtGroup* g = &run.groups[cur];
+        result = PrepareMtOutput (&run, g);
+        if (result < CELS_OK)  break;
+        StartMtGroup (g, !finished);
+        run.groups[1-cur].n = 0;
+        CelsResult read = finished?  CELS_OK : ReadMtFrames (&run, &run.groups[1-cur], &finished);
+        result = FinishMtGroup (g);
+        if (result >= CELS_OK)  result = read;
+        for (i=0;  i<g->n  &&  result >= CELS_OK;  i++) {
+            CelsBlockJob* job = &g->jobs[i];
+            result = job->result != job->outsize?  CELS_ERROR_BAD_COMPRESSED_DATA : WriteMtData (ud,cb, job->outbuf, job->outsize);
+        }
+        if (result > CELS_OK)  result = CELS_OK;
+        cur = 1-cur;
+    }
+
+    // The index should match the frames
+    for (i=0;  i<run.num_blocks  &&  result == CELS_OK;  i++) {
+        result = ReadMtData (ud,cb, header,16);
+        if (result == 16)
+            result = GetMtNumber(header) == run.index[i*2]  &&  GetMtNumber(header+8) == run.index[i*2+1]?  CELS_OK : CELS_ERROR_BAD_COMPRESSED_DATA;
+        else if (result >= CELS_OK)
+            result = CELS_ERROR_BAD_COMPRESSED_DATA;
+    }
+    if (result == CELS_OK) {
+        result = ReadMtData (ud,cb, header,8);
+        if (result >= CELS_OK)
+            result = result == 8  &&  GetMtNumber(header) == run.num_blocks?  CELS_OK : CELS_ERROR_BAD_COMPRESSED_DATA;
+    }
+    FinishMtRun (&run);
+    return result;
+}
+
+static CelsResult __cdecl MtMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    const MtMethod* m = (const MtMethod*) self;
+    switch (service)
+    {
+    case CELS_PARSE_VIEWS:
+        return ParseMt ((const CelsStrView*)inbuf, insize, (MtMethod*)outbuf, outsize);
+
+    case CELS_UNPARSE:
+        return UnparseMt (m, (int)subservice, (char*)outbuf, outsize);
+
+    case CELS_COMPRESS:
+    case CELS_DECOMPRESS:
+        // Buffers are served by CelsReadWriteMem() via the callbacks
+        if (inbuf || outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;
+        if (cb == NULL)       return CELS_ERROR_GENERAL;
+        return service==CELS_COMPRESS?  MtCompress (m, ud,cb) : MtDecompress (m, ud,cb);
+
+    case CELS_GET_COMPRESSION_MEMORY:
+    case CELS_GET_DECOMPRESSION_MEMORY:
+        return MtMemory (m, service);
+
+    case CELS_GET_COMPRESSION_CPU_LOAD:
+    case CELS_GET_DECOMPRESSION_CPU_LOAD:
+    {
+        CelsResult load = GetBlockMethodParam (m->method, service, 100);
+        return load < CELS_OK?  load : load * (m->threads? m->threads : NumberOfCores());
+    }
+
+    case CELS_GET_MAX_COMPRESSED_SIZE:
+    {
+        // Every block adds 32 bytes of frame and index entry, the stream adds 24 bytes more
+        CelsResult bound = MtBlockBound (m, m->block_size);
+        CelsNum blocks = insize / m->block_size + 1;
+        if (bound < CELS_OK)  return bound;
+        if (bound > LLONG_MAX/blocks - 32)  return LLONG_MAX;
+        return blocks * (bound+32) + 24;
+    }
+
+    case CELS_GET_BLOCKSIZE:
+        return m->block_size;
+
+    case CELS_GET_NUM_INPUT_STREAMS:
+    case CELS_GET_NUM_OUTPUT_STREAMS:
+        return 1;
+
+    case CELS_GET_DICTIONARY_SIZE:
+    case CELS_GET_EXPAND_DATA:
+        return Cels (m->method, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+
+    default:
+        return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+CELS_STATIC_CODEC (mt, "mt", NULL, MtMain);
+CELS_STATIC_CODEC (mt_wrapper, "mt[*", NULL, MtMain);   // "mt[method]" without parameters
+
+
+#ifdef CELS_TRACE
+// ****************************************************************************************************************************
+// "trace[method]" codec: forwards every service to the method, timing (de)compression and every callback it makes,         *
+// and prints latency histograms to stderr when the method is freed. Compiled only with CELS_TRACE defined                   *
+// ****************************************************************************************************************************
+
+// Log-linear histogram like HdrHistogram: 16 buckets for every power of 2, so every value is recorded with 6% precision
+#define TRACE_SUB_BUCKETS  16
+#define TRACE_BUCKETS      (64*TRACE_SUB_BUCKETS)
+
+typedef struct {
+    CelsNum  count, bytes;
+    CelsNum  total, max;            // nanoseconds
+    CelsNum  buckets[TRACE_BUCKETS];
+} TraceHistogram;
+
+// Histograms of operations CELS_COMPRESS..CELS_DECOMPRESS_STEP, of callback services CELS_READ..CELS_WRITEV, and of other callbacks
+#define TRACE_OPERATIONS   4
+#define TRACE_CALLBACKS    (CELS_WRITEV - CELS_READ + 1)
+#define TRACE_SERVICES     (TRACE_OPERATIONS + TRACE_CALLBACKS + 1)
+
+static const char* TraceServiceNames[TRACE_SERVICES] = {
+    "COMPRESS", "DECOMPRESS", "COMPRESS_STEP", "DECOMPRESS_STEP",
+    "READ", "WRITE", "QUASI_WRITE", "PROGRESS", "RECEIVE_FILLED_INBUF", "SEND_EMPTY_INBUF",
+    "RECEIVE_EMPTY_OUTBUF", "SEND_FILLED_OUTBUF", "READV", "WRITEV", "other callbacks"};
+
+typedef struct {
+    CelsSpinLock    lock;           // codecs may call back from several threads
+    TraceHistogram  services[TRACE_SERVICES];
+} TraceStats;
+
+// Parsed record: statistics followed by the wrapped method
+typedef struct {
+    TraceStats*  stats;
+} TraceMethod;
+
+static void* TracedMethod (const TraceMethod* m)  {return (char*)m + AlignChainData (sizeof(TraceMethod));}
+
+static int TraceBucket (CelsNum value)
+{
+    if (value < TRACE_SUB_BUCKETS)  return (int) value;
+    int exponent = 0;
+    while ((value >> exponent) >= 2*TRACE_SUB_BUCKETS)  exponent++;
+    return (exponent+1)*TRACE_SUB_BUCKETS + (int)((value >> exponent) - TRACE_SUB_BUCKETS);
+}
+
+static CelsNum TraceBucketValue (int bucket)
+{
+    if (bucket < 2*TRACE_SUB_BUCKETS)  return bucket;
+    return (CelsNum)(TRACE_SUB_BUCKETS + bucket%TRACE_SUB_BUCKETS) << (bucket/TRACE_SUB_BUCKETS - 1);
+}
+
+static void TraceRecord (TraceStats* stats, int index, CelsNum time, CelsNum bytes)
+{
+    if (time < 0)  time = 0;
+    SpinLock (&stats->lock);
+    TraceHistogram* h = &stats->services[index];
+    h->count++;
+    h->bytes += bytes;
+    h->total += time;
+    if (time > h->max)  h->max = time;
+    h->buckets[TraceBucket(time)]++;
+    SpinUnlock (&stats->lock);
+}
+
+// Lower bound of the bucket holding the value of the given percentile
+static double TracePercentile (const TraceHistogram* h, double percentile)
+{
+    CelsNum threshold = (CelsNum) (h->count * percentile / 100),  seen = 0;
+    int i;
+    for (i=0;  i<TRACE_BUCKETS;  i++) {
+        seen += h->buckets[i];
+        if (seen > threshold)  return TraceBucketValue(i) / 1e3;
+    }
+    return h->max / 1e3;
+}
+
+static void PrintTrace (const TraceMethod* m)
+{
+    char name[CELS_MAX_METHOD_STRING_SIZE];
+    if (CallCels (TracedMethod(m), CELS_UNPARSE,CELS_UNPARSE_DISPLAY, NULL,0, name,sizeof(name), NULL,NULL) < CELS_OK)
+        strcpy (name, "?");
+    int i,  printed = 0;
+    for (i=0;  i<TRACE_SERVICES;  i++) {
+        const TraceHistogram* h = &m->stats->services[i];
+        if (h->count == 0)  continue;
+        if (!printed++)
+            fprintf (stderr, "CELS trace of %s:\n  %-22s %10s %14s %12s %10s %10s %10s %10s %10s\n", name,
+                     "service", "count", "bytes", "total ms", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+        fprintf (stderr, "  %-22s %10lld %14lld %12.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                 TraceServiceNames[i], (long long)h->count, (long long)h->bytes, h->total/1e6,
+                 TracePercentile(h,50), TracePercentile(h,90), TracePercentile(h,99), TracePercentile(h,99.9), h->max/1e3);
+    }
+}
+
+// Callback of the wrapped method, timing the application callback
+typedef struct {
+    TraceStats*    stats;
+    void*          ud;
+    CelsCallback*  cb;
+} TraceCall;
+
+static CelsResult __cdecl TraceCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    TraceCall* call = (TraceCall*) self;
+    CelsNum start = NanoTime();
+    CelsResult result = call->cb (call->ud, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+    CelsNum time = NanoTime() - start;
+    int callback = service >= CELS_READ  &&  service <= CELS_WRITEV;
+    CelsNum bytes = service==CELS_PROGRESS? insize : service==CELS_QUASI_WRITE? outsize : result > 0  &&  callback? result : 0;
+    TraceRecord (call->stats, TRACE_OPERATIONS + (callback? service-CELS_READ : TRACE_CALLBACKS), time, bytes);
+    return result;
+}
+
+static CelsResult __cdecl TraceMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    TraceMethod* m = (TraceMethod*) self;
+    switch (service)
+    {
+    case CELS_PARSE_VIEWS:
+    {
+        char str[CELS_MAX_METHOD_STRING_SIZE],  *method;
+        CelsResult errcode = SplitWrappedMethod ((const CelsStrView*)inbuf, insize, str, &method);
+        if (errcode < CELS_OK)  return errcode;
+        if (strcmp (str, "trace") != 0)  return CELS_ERROR_INVALID_COMPRESSOR;
+        m = (TraceMethod*) outbuf;
+        CelsNum offset = AlignChainData (sizeof(TraceMethod));
+        if (outsize <= offset)  return CELS_ERROR_INVALID_COMPRESSOR;
+        CelsResult size = CelsParseStr (method, TracedMethod(m), outsize-offset, ud,cb);
+        if (size < CELS_OK)  return size;
+        m->stats = (TraceStats*) calloc (1, sizeof(TraceStats));
+        if (m->stats == NULL)  {CallCels (TracedMethod(m), CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+        return offset + size;
+    }
+
+    case CELS_UNPARSE:
+    {
+        if (outsize < 8)  return CELS_ERROR_GENERAL;
+        strcpy ((char*)outbuf, "trace[");
+        CelsResult result = CallCels (TracedMethod(m), service,subservice, inbuf,insize, (char*)outbuf+6,outsize-7, ud,cb);
+        if (result >= CELS_OK)  strcat ((char*)outbuf, "]");
+        return result;
+    }
+
+    case CELS_FREE:
+        PrintTrace (m);
+        free (m->stats);
+        return CallCels (TracedMethod(m), service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+
+    case CELS_COMPRESS:
+    case CELS_DECOMPRESS:
+    case CELS_COMPRESS_STEP:
+    case CELS_DECOMPRESS_STEP:
+    {
+        TraceCall call = {m->stats, ud, cb};
+        CelsNum start = NanoTime();
+        CelsResult result = CallCels (TracedMethod(m), service,subservice, inbuf,insize, outbuf,outsize, cb? &call:ud, cb? (CelsCallback*)TraceCallback:cb);
+        if (result != CELS_ERROR_NOT_IMPLEMENTED)
+            TraceRecord (m->stats, service-CELS_COMPRESS, NanoTime()-start, result > 0  &&  service <= CELS_DECOMPRESS? result : 0);
+        return result;
+    }
+
+    // The wrapped method was initialized when parsed, and its direct handlers would bypass tracing
+    case CELS_INITIALIZE:
+    case CELS_GET_SERVICE_TABLE:
+        return CELS_ERROR_NOT_IMPLEMENTED;
+
+    default:
+        // Codec-level services don't have the parsed record
+        if (!IS_CELS_INSTANCE_SERVICE(service)  ||  m == NULL)  return CELS_ERROR_NOT_IMPLEMENTED;
+        return CallCels (TracedMethod(m), service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+    }
+}
+
+CELS_STATIC_CODEC (trace, "trace[*", NULL, TraceMain);
+#endif
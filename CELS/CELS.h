@@ -1,26 +1,74 @@
 #ifndef CELS_H
 #define CELS_H
 
+#include <stddef.h>   // for size_t
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#if !defined(_WIN32) && !defined(__cdecl)
+#define __cdecl   // calling convention qualifier is meaningful only for Windows
+#endif
+
 // Function types representing codecs and callbacks
 typedef long long CelsResult, CelsNum;
 typedef CelsResult __cdecl CelsCallback0(void);
 typedef CelsResult __cdecl CelsCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb);
 typedef CelsResult __cdecl CelsFunction (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
+// Direct handlers of frequent instance services, returned by the optional CELS_GET_SERVICE_TABLE service.
+// They are called with the same parameters as CelsMain(); NULL entries leave the service to CelsMain().
+typedef struct {
+    CelsFunction* compress;     // CELS_COMPRESS
+    CelsFunction* decompress;   // CELS_DECOMPRESS
+    CelsFunction* get;          // all CELS_GET_* services
+    CelsFunction* set;          // all CELS_SET_* services
+} CelsServiceTable;
+// Buffer of CELS_READV/CELS_WRITEV array; its layout matches POSIX struct iovec, so the array can be passed to readv()/writev()
+typedef struct {
+    void*   buf;
+    size_t  size;
+} CelsIoVec;
+// Buffers of CELS_COMPRESS_STEP/CELS_DECOMPRESS_STEP services, kept by the application between calls for the same stream
+typedef struct {
+    const void*  inbuf;         // input chunk
+    CelsNum      insize;
+    CelsNum      inpos;         // amount of input consumed by the codec, updated by the codec
+    void*        outbuf;        // space for output
+    CelsNum      outsize;
+    CelsNum      outpos;        // amount of output produced by the codec, updated by the codec
+    void*        state;         // codec state of the stream: NULL on the first call, then kept by the codec
+} CelsStepBuffers;
+// Counters returned by the CELS_STATS_SERVICE named service for a parsed method and by CelsGetCodecStats() for all methods of a codec
+typedef struct {
+    CelsNum  operations;        // finished CELS_COMPRESS/CELS_DECOMPRESS/*_STEP calls
+    CelsNum  errors;            // ... of them returned an error
+    CelsNum  bytes_in;          // data consumed by the codec: input buffer, CELS_READ/READV/RECEIVE_FILLED_INBUF results and STEP input
+    CelsNum  bytes_out;         // data produced by the codec: output buffer, CELS_WRITE/WRITEV/SEND_FILLED_OUTBUF data and STEP output
+    CelsNum  wall_time;         // nanoseconds spent in these calls
+    CelsNum  cpu_time;          // CPU nanoseconds of the calling thread (threads started by the codec aren't counted), only while CelsEnableCpuTimeStats(1)
+    CelsNum  callbacks;         // callback invocations made by the codec
+    CelsNum  peak_memory;       // maximum CELS_GET_COMPRESSION_MEMORY/CELS_GET_DECOMPRESSION_MEMORY reported for an operation
+} CelsStats;
 // Method registering/parsing
 CelsResult CelsRegister (const char* name, void* ud, CelsFunction* CelsMain);
+CelsResult CelsListCodecs (char* outbuf, CelsNum outsize);  // Store distinct names of registered and built-in codecs into outbuf as NUL-terminated strings followed by an empty one, return their number
+void CelsEnableCpuTimeStats (int enable);  // Start (1) or stop (0) measuring CelsStats.cpu_time, disabled by default; other counters are always collected
+CelsResult CelsGetCodecStats (const char* name, CelsStats* stats);  // Sum stats of all methods parsed by codecs registered under this exact name (f.e. "lzma" or "mt[*")
 CelsResult CelsParseStr (const char* method_str, void* method, CelsNum method_size, void* ud, CelsCallback* cb);
 CelsResult CelsParseSplitted (char const* const* parameters, void* method, CelsNum method_size, void* ud, CelsCallback* cb);
+typedef struct {const char* str;  CelsNum len;} CelsStrView;   // string that isn't NUL-terminated
+CelsResult CelsParseView  (const char* method_str, CelsNum len, void* method, CelsNum method_size, void* ud, CelsCallback* cb);  // Like CelsParseStr(), but without copying the string or limiting its length
+CelsResult CelsParseViews (const CelsStrView* parameters, CelsNum num_parameters, void* method, CelsNum method_size, void* ud, CelsCallback* cb);
 // DLL loading/unloading
 CelsResult CelsRegisterModule (void* dll, const char* method_name, CelsFunction* CelsMain);
 CelsResult CelsLoad();
+CelsResult CelsLoadLazy();  // Like CelsLoad(), but each library is loaded only when its method is parsed first time
 void CelsUnload();
 // Providing actual services
 CelsResult Cels (const void* method, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
 const char* CelsErrorMessage (CelsResult errcode);  // English description of error code
+void CelsMethodCacheStats (CelsNum* hits, CelsNum* misses);  // Hit/miss counters of the parsed method cache used by Cels() for read-only services on method strings
 // User-defined functions
 CelsResult __cdecl CelsMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
 
@@ -35,11 +83,14 @@ const int CELS_FREE                             = 0x00000001;   // Last operatio
 const int CELS_UNPARSE                          = 0x00000002;   // Put into (outbuf,outsize) buffer some variant of string representing the method instance, where variant is defined by the insize containing one of CELS_UNPARSE_* constants
 const int CELS_COMPRESS                         = 0x00000004;   // Compress (encode) data using CELS_READ/CELS_WRITE callbacks (and optionally CELS_PROGRESS/CELS_QUASI_WRITE to inform application about operation progress). Also: Compress buffer (inbuf,insize) into buffer (outbuf,outsize) and return compressed size. When inbuf and/or outbuf is NULL, read/write data via callbacks or return CELS_ERROR_NOT_IMPLEMENTED
 const int CELS_DECOMPRESS                       = 0x00000005;   // Like above but decompress (decode)
+const int CELS_COMPRESS_STEP                    = 0x00000006;   // Optional resumable compression: consume input and produce output in CelsStepBuffers pointed by inbuf without blocking. Subservice is one of CELS_STEP_* modes. Retcode: >0 - call again, 0 - stream finished (only in CELS_STEP_FINISH mode after all output produced), <0 - error. State should be freed on returning 0 or error, and on CELS_STEP_ABORT
+const int CELS_DECOMPRESS_STEP                  = 0x00000007;   // Like above but decompress (decode)
 // Information requests
 const int CELS_GET_EXPAND_DATA                  = 0x01000000;   // Can this compressor expand data (like precomp)?
 const int CELS_GET_NUM_INPUT_STREAMS            = 0x01000001;   // Number of input streams for compression (== number of output streams for decompression)
 const int CELS_GET_NUM_OUTPUT_STREAMS           = 0x01000002;   // Number of output streams for compression (== number of input streams for decompression)
 const int CELS_GET_MAX_COMPRESSED_SIZE          = 0x01000003;   // Upper limit of compressed size for given insize
+const int CELS_GET_SERVICE_TABLE                = 0x01000004;   // Store pointer to the CelsServiceTable of instance into *(const CelsServiceTable**)outbuf. Called once right after CELS_PARSE
 // Get algorithm parameters
 const int CELS_GET_COMPRESSION_MEMORY           = 0x02000000;   // How much memory for compression?
 const int CELS_GET_DECOMPRESSION_MEMORY         = 0x02000001;   // How much memory for decompression?
@@ -52,6 +103,7 @@ const int CELS_GET_DECOMPRESSION_CPU_LOAD       = 0x02000007;   // Percents of C
 const int CELS_GET_MINIMAL_INPUT_SIZE           = 0x02000008;   // Minimum input size the method is optimized for (f.e. LZ with 64 MB dictionary is optimized for minimum 64 MB of input data). Reducing this parameter may reduce memory usage without losing compression for the specified and lower input sizes.
 const int CELS_GET_CACHING                      = 0x02000009;   // 1: memory can be kept allocated between (de)compression operations, 0: memory always released
 const int CELS_GET_NAMED_SERVICE                = 0x0200000A;   // Service name (C string) passed in the inbuf, allowing to implement COMPRESSION_METHOD::doit()
+const char CELS_STATS_SERVICE[]                 = "stats";      // Named service served by the core for every parsed method: store CelsStats into (outbuf,outsize), return the number of bytes stored
 // Set algorithm parameters (to the value specified by insize)
 inline static int IS_CELS_SET_INSTANCE_PARAM_SERVICE (int service)  {return (service&0xFF000000)==0x03000000;}   // Family of CelsMain() "set param" codec instance services
 const int CELS_SET_COMPRESSION_MEMORY           = 0x03000000;   // How much memory for compression?
@@ -66,20 +118,26 @@ const int CELS_SET_MINIMAL_INPUT_SIZE           = 0x03000008;   // Minimum input
 const int CELS_SET_CACHING                      = 0x03000009;   // 1: enable caching, 0: disable caching and release previously allocated memory
 const int CELS_SET_NAMED_SERVICE                = 0x0300000A;   // Service name (C string) passed in the inbuf, allowing to implement COMPRESSION_METHOD::doit()
 // CELS_[DE]COMPRESS* callbacks
-const int CELS_READ                             = 0x10000000;   // Read up to inbytes bytes into inbuf. Retcode: <0 - error, 0 - EOF, >0 - amount of data read
-const int CELS_WRITE                            = 0x10000001;   // Write outbytes bytes from outbuf. Retcode: the same
+const int CELS_READ                             = 0x10000000;   // Read up to inbytes bytes into inbuf. Retcode: <0 - error, 0 - EOF, >0 - amount of data read. Subservice is the input stream number, 0 for the main stream
+const int CELS_WRITE                            = 0x10000001;   // Write outbytes bytes from outbuf. Retcode: the same. Subservice is the output stream number, 0 for the main stream
 const int CELS_QUASI_WRITE                      = 0x10000002;   // "Quasi-write" just informs application how much data (= outsize) will be written as the result of (de)compression of already read data
 const int CELS_PROGRESS                         = 0x10000003;   // Informs application that input was advanced by insize bytes, and output by outsize bytes
+// Buffers received by CELS_RECEIVE_FILLED_INBUF belong to the codec until sent back: it may process them in place and pass them to CELS_SEND_FILLED_OUTBUF,
+// unless it requested them with insize=CELS_INBUF_READ_ONLY
 const int CELS_RECEIVE_FILLED_INBUF             = 0x10000004;   // Receive next filled input buffer from the queue: bufsize returned as result, bufptr stored in *inbuf
 const int CELS_SEND_EMPTY_INBUF                 = 0x10000005;   // Send empty input buffer (inbuf,insize) into the queue
 const int CELS_RECEIVE_EMPTY_OUTBUF             = 0x10000006;   // Receive next empty output buffer from the queue: bufsize returned as result, bufptr stored in *outbuf
 const int CELS_SEND_FILLED_OUTBUF               = 0x10000007;   // Send filled output buffer (outbuf,outsize) into the queue
+const int CELS_READV                            = 0x10000008;   // Like CELS_READ, but read into insize CelsIoVec buffers pointed by inbuf, filling each one before the next; returns total amount of data read
+const int CELS_WRITEV                           = 0x10000009;   // Like CELS_WRITE, but write outsize CelsIoVec buffers pointed by outbuf; returns total amount of data written
+const int CELS_INBUF_READ_ONLY                  = 1;            // CELS_RECEIVE_FILLED_INBUF flag passed in insize: the codec only reads the buffer and sends it back with CELS_SEND_EMPTY_INBUF, so memory still needed by the application may be lent
 
 // Operations that can be implemented by codec in CelsMain()
 inline static int IS_CELS_CODEC_SERVICE (int service)  {return (service&0xFF000000)==0x04000000;}   // Family of codec services
 const int CELS_LOAD_CODEC                       = 0x04000000;   // Called on codec registration
 const int CELS_UNLOAD_CODEC                     = 0x04000001;   // Called before codec unload
 const int CELS_PARSE                            = 0x04000002;   // Parse method string
+const int CELS_PARSE_VIEWS                      = 0x04000003;   // Parse method string passed as insize CelsStrView parameters pointed by inbuf. Tried before CELS_PARSE, which is called only if this service isn't implemented
 
 // Operations that can be implemented by module in CelsMain()
 inline static int IS_CELS_MODULE_SERVICE (int service)  {return (service&0xFF000000)==0x05000000;}   // Family of module services
@@ -101,6 +159,10 @@ const int CELS_APPLICATION_CODES                = 0xC0000000;   // Codes availab
 const int CELS_UNPARSE_FULL                     = 0;    // Return string with canonical representation of the compression method
 const int CELS_UNPARSE_DISPLAY                  = 1;    // Return method string prepared for display, with sensitive information like encryption keys removed
 const int CELS_UNPARSE_PURE                     = 2;    // Return method string prepared for storing in archive, with sensitive information and compression-specific parameters removed
+const int CELS_LOAD_LAZY                        = 1;    // CELS_LOAD subservice: remember found libraries, loading each one on the first use of its method (equivalent to CelsLoadLazy())
+const int CELS_STEP_CONTINUE                    = 0;    // CELS_*_STEP subservice: more input will follow
+const int CELS_STEP_FINISH                      = 1;    // CELS_*_STEP subservice: the input chunk is the last one, so output everything
+const int CELS_STEP_ABORT                       = 2;    // CELS_*_STEP subservice: the stream is abandoned, free its state
 
 // Error codes
 const int CELS_OK                               =   0;  // ALL RIGHT
@@ -124,13 +186,51 @@ const int CELS_ERROR_INTERNAL                   = -15;  // It should never happe
 const int CELS_MAX_PARSED_METHOD_SIZE           = 1024;
 const int CELS_MAX_METHOD_STRING_SIZE           = 1024;
 const int CELS_MAX_METHOD_PARAMETERS            =  200;
+const int CELS_METHOD_CACHE_SIZE                =   64;   // Max. number of parsed methods kept by Cels() between calls with the same method string
+const int CELS_LOAD_THREADS                     =    8;   // Max. number of threads opening shared libraries in CelsLoad() and CelsLoadLazy()
+const int CELS_BUFFER_POOL_ALIGNMENT            = 4096;   // Alignment of buffers lent by CelsBufferPoolCallback()
+const int CELS_CHAIN_BUFFER_SIZE                = 8<<20;  // Total size of queues between methods of a chain executed by CelsCompressChain()/CelsDecompressChain()
+const int CELS_STREAM_STACK_SIZE                = 1<<20;  // Stack reserved for blocking codec driven by CelsStreamProcess()
+const int CELS_INSTANCE_POOL_MEMORY             = 256<<20; // Default limit of memory kept by parsed methods in the pool of every thread, see CelsAcquireMethod()
+const int CELS_MT_BLOCK_SIZE                    = 16<<20; // Default block size of the "mt" codec
 const char CELS_METHOD_PARAMETERS_DELIMITER     =  ':';
 
 // Handy operation shortcuts
 inline static CelsResult CelsRead  (CelsCallback* cb, void* ud, void* buf, CelsNum size)  {return cb(ud, CELS_READ,0,  buf,size, 0,0, 0,0);}
 inline static CelsResult CelsWrite (CelsCallback* cb, void* ud, void* buf, CelsNum size)  {return cb(ud, CELS_WRITE,0, 0,0, buf,size, 0,0);}
+inline static CelsResult CelsReadStream  (CelsCallback* cb, void* ud, int stream, void* buf, CelsNum size)  {return cb(ud, CELS_READ,stream,  buf,size, 0,0, 0,0);}
+inline static CelsResult CelsWriteStream (CelsCallback* cb, void* ud, int stream, void* buf, CelsNum size)  {return cb(ud, CELS_WRITE,stream, 0,0, buf,size, 0,0);}
+// Vectored read/write, performed by the sequence of CELS_READ/CELS_WRITE calls when the callback doesn't support CELS_READV/CELS_WRITEV
+inline static CelsResult CelsReadStreamV (CelsCallback* cb, void* ud, int stream, CelsIoVec* iov, int count)
+{
+    CelsResult result = cb(ud, CELS_READV,stream, iov,count, 0,0, 0,0),  total = 0;
+    int i;
+    if (result != CELS_ERROR_NOT_IMPLEMENTED)  return result;
+    for (i=0;  i<count;  i++) {
+        result = CelsReadStream (cb,ud, stream, iov[i].buf, iov[i].size);
+        if (result < CELS_OK)  return result;
+        total += result;
+        if (result < (CelsResult)iov[i].size)  break;
+    }
+    return total;
+}
+inline static CelsResult CelsWriteStreamV (CelsCallback* cb, void* ud, int stream, CelsIoVec* iov, int count)
+{
+    CelsResult result = cb(ud, CELS_WRITEV,stream, 0,0, iov,count, 0,0),  total = 0;
+    int i;
+    if (result != CELS_ERROR_NOT_IMPLEMENTED)  return result;
+    for (i=0;  i<count;  i++) {
+        result = CelsWriteStream (cb,ud, stream, iov[i].buf, iov[i].size);
+        if (result != (CelsResult)iov[i].size)  return result<CELS_OK? result : CELS_ERROR_WRITE;
+        total += result;
+    }
+    return total;
+}
+inline static CelsResult CelsReadV  (CelsCallback* cb, void* ud, CelsIoVec* iov, int count)  {return CelsReadStreamV  (cb,ud, 0, iov,count);}
+inline static CelsResult CelsWriteV (CelsCallback* cb, void* ud, CelsIoVec* iov, int count)  {return CelsWriteStreamV (cb,ud, 0, iov,count);}
 inline static CelsResult CelsProgress (CelsCallback* cb, void* ud, CelsNum insize, CelsNum outsize)    {return cb(ud, CELS_PROGRESS,0, 0,insize, 0,outsize, 0,0);}
 inline static CelsResult CelsReceiveFilledInbuf (CelsCallback* cb, void* ud, void** buf)               {return cb(ud, CELS_RECEIVE_FILLED_INBUF,0,  buf,0,    0,0, 0,0);}
+inline static CelsResult CelsReceiveReadOnlyInbuf (CelsCallback* cb, void* ud, const void** buf)       {return cb(ud, CELS_RECEIVE_FILLED_INBUF,0,  (void*)buf,CELS_INBUF_READ_ONLY, 0,0, 0,0);}
 inline static CelsResult CelsSendEmptyInbuf     (CelsCallback* cb, void* ud, void* buf, CelsNum size)  {return cb(ud, CELS_SEND_EMPTY_INBUF,0,      buf,size, 0,0, 0,0);}
 inline static CelsResult CelsReceiveEmptyOutbuf (CelsCallback* cb, void* ud, void** buf)               {return cb(ud, CELS_RECEIVE_EMPTY_OUTBUF,0,  0,0,    buf,0, 0,0);}
 inline static CelsResult CelsSendFilledOutbuf   (CelsCallback* cb, void* ud, void* buf, CelsNum size)  {return cb(ud, CELS_SEND_FILLED_OUTBUF,0,    0,0, buf,size, 0,0);}
@@ -154,6 +254,9 @@ inline static CelsResult CelsFree (void* method)
 inline static CelsResult CelsGetNamedService (const void* method, const char* serviceName, CelsNum size)
         {return Cels(method, CELS_GET_NAMED_SERVICE,0, (void*)serviceName,size, 0,0, 0,0);}
 
+inline static CelsResult CelsGetStats (const void* method, CelsStats* stats)
+        {return Cels(method, CELS_GET_NAMED_SERVICE,0, (void*)CELS_STATS_SERVICE,0, stats,sizeof(CelsStats), 0,0);}
+
 inline static CelsResult CelsSetNamedService (void* method, const char* serviceName, CelsNum size, char* outbuf)
         {return Cels(method, CELS_SET_NAMED_SERVICE,0, (void*)serviceName,size, outbuf,CELS_MAX_METHOD_STRING_SIZE, 0,0);}
 
@@ -199,6 +302,52 @@ CELS_DEFINE_GETTER_AND_SETTER (Caching,             CACHING);
 #undef CELS_DEFINE_SETTER
 
 
+// *** Built-in codecs ****************************************************************************************************
+
+// Codecs linked into the program can be declared with CELS_STATIC_CODEC(id, name, ud, CelsMain) at file scope instead of
+// calling CelsRegister() from static initializer. Declarations are collected by the linker into a table that
+// CelsParse*() searches after all codecs registered by CelsRegister()/CelsLoad(), so there is no registration work
+// at startup and dynamic codecs always override built-in ones. Built-in codecs matching the same method are tried
+// in the order of decreasing priority, given by CELS_STATIC_CODEC_PRIORITY() (0 for CELS_STATIC_CODEC()); the order of
+// codecs with equal priority depends on the linker. Built-in codecs don't receive CELS_LOAD_CODEC/CELS_UNLOAD_CODEC.
+typedef struct {
+    const char*   name;      // method name, may end with '*' like names passed to CelsRegister()
+    void*         self;
+    CelsFunction* CelsMain;
+    unsigned      hash;      // hash of the name (or of its fixed part), computed at compile time when possible, 0 otherwise
+    int           priority;
+} CelsStaticCodec;
+
+#if defined(__cplusplus) && (__cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900))
+// Name hash computed at compile time; should be the same as StringHash() in CELS.cpp
+constexpr unsigned CelsNameHashStep (unsigned hash)  {return hash + (hash>>17);}
+constexpr unsigned CelsNameHash (const char* name, unsigned hash)
+        {return *name=='\0' || *name=='*' ? hash : CelsNameHash (name+1, CelsNameHashStep ((hash + (unsigned char)*name) * 1234567891u));}
+#define CELS_NAME_HASH(name)  CelsNameHash (name, 314159265u)
+#else
+#define CELS_NAME_HASH(name)  0u
+#endif
+
+#if defined(_MSC_VER)
+// Entries are placed between the CelsStaticCodecs$a and CelsStaticCodecs$z markers defined in CELS.cpp
+#pragma section("CelsStaticCodecs$m", read)
+#define CELS_STATIC_CODEC_ATTRIBUTE      __declspec(allocate("CelsStaticCodecs$m"))
+#elif defined(_WIN32)
+#define CELS_STATIC_CODEC_ATTRIBUTE      __attribute__((used, section("CelsStaticCodecs$m"), aligned(sizeof(void*))))
+#elif defined(__APPLE__)
+#define CELS_STATIC_CODEC_ATTRIBUTE      __attribute__((used, section("__DATA,CelsStaticCodecs"), aligned(sizeof(void*))))
+#else
+#define CELS_STATIC_CODEC_ATTRIBUTE      __attribute__((used, section("CelsStaticCodecs"), aligned(sizeof(void*))))
+#endif
+
+// id should be unique in the program
+#define CELS_STATIC_CODEC_PRIORITY(id, name, ud, CelsMain, priority)                                       \
+extern const CelsStaticCodec CelsStaticCodec_##id;                                                      \
+CELS_STATIC_CODEC_ATTRIBUTE const CelsStaticCodec CelsStaticCodec_##id = {name, ud, CelsMain, CELS_NAME_HASH(name), priority}
+
+#define CELS_STATIC_CODEC(id, name, ud, CelsMain)   CELS_STATIC_CODEC_PRIORITY (id, name, ud, CelsMain, 0)
+
+
 // *** Extensions (not required for CELS functioning and use only official API) *******************************************
 
 // Compress/decompress data with CELS_COMPRESS/CELS_DECOMPRESS services from/to buffers or using callbacks.
@@ -206,6 +355,119 @@ CELS_DEFINE_GETTER_AND_SETTER (Caching,             CACHING);
 // Provides appropriate callback for codecs that doesn't support inbuf and/or outbuf.
 CelsResult CelsCompressMem   (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
 CelsResult CelsDecompressMem (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
+// Like above, but output is stored to the buffer allocated by the function (and growing as needed), and *outbuf receives it.
+// Return the output size or error code; on success the caller should free(*outbuf).
+CelsResult CelsCompressMemAlloc   (const void* method, void* inbuf, CelsNum insize, void** outbuf, void* ud, CelsCallback* cb);
+CelsResult CelsDecompressMemAlloc (const void* method, void* inbuf, CelsNum insize, void** outbuf, void* ud, CelsCallback* cb);
+
+// Compression chain parsed into graph of methods. Methods joined by "+" process the main (first) output of the previous method.
+// "method(chain1,chain2...)" lists chains processing outputs of the method in order: either all outputs, or all but the main one
+// that is processed by methods following "+". Outputs not mentioned leave the chain as is, and "storing" passes data unchanged.
+// F.e. "rep:c512+tor:d1m:h2m", "bcj2(storing,lzma:1m,lzma:1m)+lzma:64m" or "bcj2(lzma:64m,storing,lzma:1m,lzma:1m)".
+// Wrapper methods hold the wrapped method in brackets, like "mt:8[rep+lzma]"; delimiters inside brackets belong to the method.
+typedef struct {
+    int node;                   // node producing the stream, or -1 for the chain input
+    int stream;                 // output stream number of this node
+} CelsChainStream;
+
+typedef struct {
+    void* method;               // parsed method, usable with Cels()
+    int   input_node;           // node producing input of this one, or -1 for the chain input
+    int   input_stream;         // output stream number of the input_node
+} CelsChainNode;
+
+typedef struct {
+    int               num_nodes;
+    CelsChainNode*    nodes;        // every node follows the node producing its input
+    int               num_outputs;
+    CelsChainStream*  outputs;      // streams leaving the chain, in the order of their appearance in the chain string
+} CelsChain;
+
+CelsResult CelsParseChain (const char* chain_str, CelsChain** chain, void* ud, CelsCallback* cb);
+CelsResult CelsChainGet   (const CelsChain* chain, int service, CelsNum insize);    // CELS_GET_* value for the whole chain, f.e. total memory or max. dictionary
+void       CelsFreeChain  (CelsChain* chain);
+// (De)compress data from CELS_READ to CELS_WRITE of the callback with the whole chain, running each method in its own thread.
+// Calls to the callback are serialized. Output number i of the chain is the stream i of the callback (its subservice).
+CelsResult CelsCompressChain   (const CelsChain* chain, void* ud, CelsCallback* cb);
+CelsResult CelsDecompressChain (const CelsChain* chain, void* ud, CelsCallback* cb);
+// Cels() accepts chain strings too: CelsCompress("rep+lzma",ud,cb), CelsCompressMem() and CelsDecompressMem() parse the chain
+// and execute it as above, and CELS_GET_* services return CelsChainGet() values. Other services return CELS_ERROR_NOT_IMPLEMENTED.
+
+// Memory buffers holding streams of multi-stream (de)compression. CelsMemStreamsCallback() (with CelsMemStreams as userdata)
+// serves CELS_READ of stream i from inputs[i] and CELS_WRITE of stream i into outputs[i], passing streams without buffer
+// and all other services to (userdata,callback). F.e. compression of inbuf with every chain output written into own buffer:
+//   CelsStreamBuffer in = {inbuf, insize, 0},  out[MAX];  CelsAllocChainOutputs (chain, insize, out);
+//   CelsMemStreams streams = {&in, 1, out, chain->num_outputs, 0, 0};  CelsCompressChain (chain, &streams, CelsMemStreamsCallback);
+typedef struct {
+    void*    buf;               // NULL for the stream served by the callback
+    CelsNum  size;              // buffer size
+    CelsNum  pos;               // number of bytes already read/written
+} CelsStreamBuffer;
+
+typedef struct {
+    CelsStreamBuffer*  inputs;      int num_inputs;
+    CelsStreamBuffer*  outputs;     int num_outputs;
+    void*              userdata;    // data passed to the callback
+    CelsCallback*      callback;    // callback serving all other requests, may be NULL
+} CelsMemStreams;
+
+CelsResult __cdecl CelsMemStreamsCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb);
+// Allocate buffers for all outputs of the chain compressing insize bytes, each one sized by CELS_GET_MAX_COMPRESSED_SIZE of
+// the method producing it. Buffers should be freed with free()
+CelsResult CelsAllocChainOutputs (const CelsChain* chain, CelsNum insize, CelsStreamBuffer* outputs);
+
+// Fixed set of large aligned buffers lent to codecs via CELS_RECEIVE_FILLED_INBUF/CELS_RECEIVE_EMPTY_OUTBUF, so they can process
+// data in place. CelsBufferPoolCallback() (with the pool as userdata) fills and writes these buffers using CELS_READ/CELS_WRITE
+// of the application callback (ud,cb), and passes there all other services. F.e.:
+//   CelsCreateBufferPool (&pool, 4, 1<<20, ud, cb);  CelsCompress (method, pool, CelsBufferPoolCallback);  CelsDeleteBufferPool (pool);
+typedef struct CelsBufferPool CelsBufferPool;
+CelsResult CelsCreateBufferPool (CelsBufferPool** pool, int num_buffers, CelsNum buffer_size, void* ud, CelsCallback* cb);
+void       CelsDeleteBufferPool (CelsBufferPool* pool);
+CelsResult __cdecl CelsBufferPoolCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb);
+
+// Independent blocks (de)compressed by CelsCompressBlocks()/CelsDecompressBlocks() from inbuf into outbuf with CelsCompressMem()/
+// CelsDecompressMem(). Jobs are started in their order, each one as soon as the sum of CELS_GET_[DE]COMPRESSION_MEMORY of running
+// jobs fits into memory bytes and the sum of their CELS_GET_[DE]COMPRESSION_CPU_LOAD fits into cores (0: all cores of the computer).
+// Compression methods are first reduced with CelsLimitMinimalInputSize() to the block size and with CelsLimitCompressionMem()
+// to the memory budget. Reduced method may produce different compressed data, so CelsCompressBlocks() stores the method string
+// it actually used into used_method, and that string (rather than the original one) must be used to decompress the block.
+// A job that can't fit anyway runs alone. Returns the first error; jobs after it aren't started and get
+// CELS_ERROR_OPERATION_TERMINATED. The callback (ud,cb) serving other services may be called by several jobs simultaneously.
+typedef struct {
+    const char*  method;        // method string
+    void*        inbuf;
+    CelsNum      insize;
+    void*        outbuf;
+    CelsNum      outsize;
+    CelsResult   result;        // output size or error code of the job
+    char         used_method[CELS_MAX_METHOD_STRING_SIZE];   // compression method reduced for the block, set by CelsCompressBlocks()
+} CelsBlockJob;
+
+CelsResult CelsCompressBlocks   (CelsBlockJob* jobs, int num_jobs, CelsNum memory, int cores, void* ud, CelsCallback* cb);
+CelsResult CelsDecompressBlocks (CelsBlockJob* jobs, int num_jobs, CelsNum memory, int cores, void* ud, CelsCallback* cb);
+
+// Parsed methods kept between operations by every thread. CelsAcquireMethod() takes the method parsed from the same string out of
+// the pool of the current thread, or parses it anew, storing error code to *errcode and returning NULL on failure. CelsReleaseMethod()
+// returns the method into the pool if it reports CELS_GET_CACHING==1, so the codec keeps its tables allocated for the next
+// operation, or frees it otherwise. Methods released the least recently are freed when their CELS_GET_[DE]COMPRESSION_MEMORY
+// exceeds the limit of the pool, set by CelsSetInstancePoolMemory() for the current thread. Pools are freed on thread exit,
+// CelsFlushInstancePool() empties the pool of the current thread, and CelsUnload() empties pools of all threads.
+// The acquired method may be used in any thread, but its parameters besides caching shouldn't be changed.
+void* CelsAcquireMethod (const char* method_str, CelsResult* errcode, void* ud, CelsCallback* cb);
+void  CelsReleaseMethod (void* method);
+void  CelsSetInstancePoolMemory (CelsNum limit);
+void  CelsFlushInstancePool (void);
+
+// Resumable (push-style) (de)compression, allowing one thread to drive many streams. CelsStreamProcess() consumes input from
+// (inbuf,insize) and produces output into (outbuf,outsize) without blocking, storing the amounts into *inused/*outused;
+// the rest of input should be passed again in the next call. mode is CELS_STEP_CONTINUE or, once the last input chunk is passed,
+// CELS_STEP_FINISH. Returns >0 while the stream isn't finished, 0 when all output is produced, or error code.
+// Codecs implementing CELS_COMPRESS_STEP/CELS_DECOMPRESS_STEP are called directly, others run on own fiber (ucontext on Unix),
+// returning to the caller when they need more input or output space. The callback (ud,cb) serves other services.
+typedef struct CelsStream CelsStream;
+CelsResult CelsCreateStream  (CelsStream** stream, const char* method, int service, void* ud, CelsCallback* cb);    // service is CELS_COMPRESS or CELS_DECOMPRESS
+CelsResult CelsStreamProcess (CelsStream* stream, const void* inbuf, CelsNum insize, CelsNum* inused, void* outbuf, CelsNum outsize, CelsNum* outused, int mode);
+void       CelsDeleteStream  (CelsStream* stream);   // may be called at any moment, aborting unfinished stream
 
 #ifdef __cplusplus
 }       // extern "C"
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Startup time of CelsLoad() vs CelsLoadLazy() with 100 dummy libraries (copies of cels-test.so) placed next to cels-startup.
+# Run compile-gcc.sh first. Usage: bench-startup.sh [runs]
+set -e
+dir=startup-bench
+rm -rf $dir
+mkdir $dir
+cp cels-startup $dir/
+i=0
+while [ $i -lt 100 ]; do
+    cp cels-test.so $dir/cels-test$(printf %03d $i).so
+    i=$((i+1))
+done
+$dir/cels-startup ${1:-10} test050
@@ -0,0 +1,412 @@
+// Benchmark of codecs: speed, compression ratio and memory usage of memory-buffer and streaming (de)compression,
+// with every result verified by decompression. Usage: cels-bench [options] [method...], see Usage() below
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "CELS.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <time.h>
+#ifdef __APPLE__
+#include <sys/resource.h>
+#endif
+#endif
+
+static double Now (void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, freq;
+    QueryPerformanceCounter (&counter);
+    QueryPerformanceFrequency (&freq);
+    return (double)counter.QuadPart / freq.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec/1e9;
+#endif
+}
+
+// Current and peak memory of the process. The peak can be reset only on Linux, so elsewhere it's the peak since the start.
+// On Linux the peak is VmHWM, that clear_refs resets, unlike ru_maxrss of getrusage()
+static CelsNum CurrentMemory (void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    return GetProcessMemoryInfo (GetCurrentProcess(), &pmc, sizeof(pmc))?  (CelsNum)pmc.WorkingSetSize : 0;
+#else
+    long long pages = 0,  resident = 0;
+    FILE* f = fopen ("/proc/self/statm", "r");
+    if (f  &&  fscanf (f, "%lld %lld", &pages, &resident) != 2)  resident = 0;
+    if (f)  fclose (f);
+    return resident * 4096;
+#endif
+}
+
+static CelsNum PeakMemory (void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    return GetProcessMemoryInfo (GetCurrentProcess(), &pmc, sizeof(pmc))?  (CelsNum)pmc.PeakWorkingSetSize : 0;
+#elif defined(__APPLE__)
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;          // bytes
+#else
+    char line[256];
+    long long peak = 0;
+    FILE* f = fopen ("/proc/self/status", "r");
+    while (f  &&  fgets (line, sizeof(line), f))
+        if (sscanf (line, "VmHWM: %lld", &peak) == 1)  break;   // kilobytes
+    if (f)  fclose (f);
+    return peak * 1024;
+#endif
+}
+
+static void ResetPeakMemory (void)
+{
+#if !defined(_WIN32) && !defined(__APPLE__)
+    FILE* f = fopen ("/proc/self/clear_refs", "w");
+    if (f)  fputs ("5", f),  fclose (f);
+#endif
+}
+
+// Data read by the codec from memory and written into growing buffer
+typedef struct {
+    const char* in;   CelsNum insize,  inpos;
+    char*       out;  CelsNum outsize, outpos;
+} StreamData;
+
+CelsResult __cdecl StreamCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    StreamData* s = (StreamData*) self;
+    if (subservice != 0)  return CELS_ERROR_NOT_IMPLEMENTED;   // only the main stream
+    if (service == CELS_READ) {
+        CelsNum len = s->insize - s->inpos < insize?  s->insize - s->inpos : insize;
+        memcpy (inbuf, s->in + s->inpos, len);
+        s->inpos += len;
+        return len;
+    } else if (service == CELS_WRITE) {
+        if (s->outpos + outsize > s->outsize) {
+            CelsNum size = (s->outpos + outsize) * 2;
+            char* out = (char*) realloc (s->out, size);
+            if (out == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+            s->out = out,  s->outsize = size;
+        }
+        memcpy (s->out + s->outpos, outbuf, outsize);
+        s->outpos += outsize;
+        return outsize;
+    }
+    return CELS_ERROR_NOT_IMPLEMENTED;
+}
+
+typedef struct {
+    const char*  method;
+    const char*  mode;              // "mem" or "stream"
+    CelsNum      bufsize;           // size of independently compressed chunks in "mem" mode, 0: the whole input
+    CelsNum      insize, outsize;
+    double       ctime, dtime;      // best times
+    CelsNum      cmem, dmem;        // peak memory growth during compression and decompression
+    CelsNum      reported_cmem, reported_dmem;
+    CelsResult   errcode;
+    int          verified;
+} BenchResult;
+
+// Compress and decompress data chunk by chunk, keeping the best times. Returns errcode, or CELS_OK with verified result
+static CelsResult BenchMem (BenchResult* r, const char* data, CelsNum size, int repeats)
+{
+    CelsNum chunk = r->bufsize && r->bufsize < size?  r->bufsize : size,  total_bound = 0,  i;
+    CelsNum num_chunks = chunk? (size+chunk-1) / chunk : 1;
+    char*   out = NULL;
+    int pass;
+    for (pass=0;  pass<2  &&  out==NULL;  pass++) {
+        // The second pass replaces bounds that can't be allocated (f.e. LLONG_MAX of codecs that may inflate data) by the fallback
+        for (i=0, total_bound=0;  i<num_chunks;  i++) {
+            CelsNum len = size-i*chunk < chunk?  size-i*chunk : chunk,  fallback = len + len/2 + 65536;
+            CelsResult bound = CelsGetMaxCompressedSize (r->method, len);
+            if (bound < CELS_OK  ||  bound > LLONG_MAX/num_chunks  ||  (pass>0 && bound > fallback))
+                bound = fallback;   // the codec can't tell its limit
+            total_bound += bound;
+        }
+        if ((CelsNum)(size_t)total_bound == total_bound)  out = (char*) malloc (total_bound);
+    }
+    char*    back  = (char*) malloc (size+1);
+    CelsNum* sizes = (CelsNum*) malloc (num_chunks * sizeof(CelsNum));
+    CelsResult result = out && back && sizes?  CELS_OK : CELS_ERROR_NOT_ENOUGH_MEMORY;
+    if (result == CELS_OK)  memset (out, 1, total_bound),  memset (back, 1, size+1);   // commit own buffers before measuring the codec (zero fill may become calloc)
+
+    int rep;
+    for (rep=0;  rep<repeats  &&  result==CELS_OK;  rep++) {
+        CelsNum base = CurrentMemory(),  outpos = 0;
+        ResetPeakMemory();
+        double start = Now();
+        for (i=0;  i<num_chunks  &&  result==CELS_OK;  i++) {
+            CelsNum len = size-i*chunk < chunk?  size-i*chunk : chunk;
+            CelsResult csize = CelsCompressMem (r->method, (void*)(data+i*chunk), len, out+outpos, total_bound-outpos, 0,0);
+            if (csize < CELS_OK)  result = csize;
+            else                  sizes[i] = csize,  outpos += csize;
+        }
+        double time = Now() - start;
+        if (rep==0 || time < r->ctime)  r->ctime = time;
+        if (PeakMemory() - base > r->cmem)  r->cmem = PeakMemory() - base;
+        r->outsize = outpos;
+        if (result < CELS_OK)  break;
+
+        base = CurrentMemory(),  outpos = 0;
+        ResetPeakMemory();
+        start = Now();
+        for (i=0;  i<num_chunks  &&  result==CELS_OK;  i++) {
+            CelsNum len = size-i*chunk < chunk?  size-i*chunk : chunk;
+            CelsResult dsize = CelsDecompressMem (r->method, out+outpos, sizes[i], back+i*chunk, len, 0,0);
+            if (dsize < CELS_OK)   result = dsize;
+            else if (dsize != len) result = CELS_ERROR_BAD_COMPRESSED_DATA;
+            outpos += sizes[i];
+        }
+        time = Now() - start;
+        if (rep==0 || time < r->dtime)  r->dtime = time;
+        if (PeakMemory() - base > r->dmem)  r->dmem = PeakMemory() - base;
+        if (result == CELS_OK  &&  memcmp (data, back, size) != 0)  result = CELS_ERROR_BAD_COMPRESSED_DATA;
+    }
+    free (out);  free (back);  free (sizes);
+    return result;
+}
+
+static CelsResult BenchStream (BenchResult* r, const char* data, CelsNum size, int repeats)
+{
+    StreamData c = {data,size,0, NULL,0,0},  d = {NULL,0,0, NULL,0,0};
+    // Output buffers are allocated and committed before measuring the codec, and grow only for data larger than the fallback bound
+    c.outsize = size + size/2 + 65536,  c.out = (char*) malloc (c.outsize);
+    d.outsize = size + 1,               d.out = (char*) malloc (d.outsize);
+    CelsResult result = c.out && d.out?  CELS_OK : CELS_ERROR_NOT_ENOUGH_MEMORY;
+    if (result == CELS_OK)  memset (c.out, 1, c.outsize),  memset (d.out, 1, d.outsize);
+    int rep;
+    for (rep=0;  rep<repeats  &&  result==CELS_OK;  rep++) {
+        c.inpos = c.outpos = 0;
+        CelsNum base = CurrentMemory();
+        ResetPeakMemory();
+        double start = Now();
+        result = CelsCompress (r->method, &c, StreamCallback);
+        double time = Now() - start;
+        if (rep==0 || time < r->ctime)  r->ctime = time;
+        if (PeakMemory() - base > r->cmem)  r->cmem = PeakMemory() - base;
+        r->outsize = c.outpos;
+        if (result < CELS_OK)  break;
+
+        d.in = c.out,  d.insize = c.outpos,  d.inpos = d.outpos = 0;
+        base = CurrentMemory();
+        ResetPeakMemory();
+        start = Now();
+        result = CelsDecompress (r->method, &d, StreamCallback);
+        time = Now() - start;
+        if (rep==0 || time < r->dtime)  r->dtime = time;
+        if (PeakMemory() - base > r->dmem)  r->dmem = PeakMemory() - base;
+        if (result >= CELS_OK  &&  (d.outpos != size  ||  memcmp (data, d.out, size) != 0))  result = CELS_ERROR_BAD_COMPRESSED_DATA;
+        if (result > CELS_OK)  result = CELS_OK;
+    }
+    free (c.out);  free (d.out);
+    return result;
+}
+
+// Speeds are reported only for verified results
+static double Speed (const BenchResult* r, double time)  {return r->verified && time > 0?  r->insize / time / 1e6 : 0;}
+
+static FILE* Table = NULL;     // stdout, or stderr when JSON is written to stdout
+
+static void PrintHeader (void)
+{
+    fprintf (Table, "%-24s %-6s %8s %10s %10s %7s %10s %10s %9s %9s  %s\n",
+            "method", "mode", "buffer", "insize", "outsize", "ratio%", "comp MB/s", "dec MB/s", "cmem MB", "dmem MB", "status");
+}
+
+static void PrintResult (const BenchResult* r)
+{
+    char buffer[32];
+    if (r->bufsize)  sprintf (buffer, "%lld", (long long)r->bufsize);
+    else             strcpy (buffer, "-");
+    fprintf (Table, "%-24s %-6s %8s %10lld %10lld %7.2f %10.2f %10.2f %9.1f %9.1f  %s\n",
+            r->method, r->mode, buffer, (long long)r->insize, (long long)r->outsize,
+            r->insize? r->outsize*100.0/r->insize : 0.0, Speed(r,r->ctime), Speed(r,r->dtime),
+            r->cmem/1048576.0, r->dmem/1048576.0,
+            r->errcode==CELS_OK? "ok" : CelsErrorMessage(r->errcode));
+}
+
+static void PrintJsonString (FILE* f, const char* str)
+{
+    fputc ('"', f);
+    for (;  *str;  str++) {
+        if (*str=='"' || *str=='\\')         fprintf (f, "\\%c", *str);
+        else if ((unsigned char)*str < 32)   fprintf (f, "\\u%04x", *str);
+        else                                 fputc (*str, f);
+    }
+    fputc ('"', f);
+}
+
+// Memory reported by the codec, null if it doesn't tell
+static void PrintJsonMemory (FILE* f, CelsNum memory)
+{
+    if (memory >= 0)  fprintf (f, "%lld", (long long)memory);
+    else              fprintf (f, "null");
+}
+
+static void PrintJson (FILE* f, const BenchResult* results, int num_results)
+{
+    int i;
+    fprintf (f, "[\n");
+    for (i=0;  i<num_results;  i++) {
+        const BenchResult* r = &results[i];
+        fprintf (f, "  {\"method\": ");
+        PrintJsonString (f, r->method);
+        fprintf (f, ", \"mode\": \"%s\", \"buffer\": %lld, \"insize\": %lld, \"outsize\": %lld, \"ratio\": %.4f,"
+                    " \"compress_mbps\": %.3f, \"decompress_mbps\": %.3f, \"compress_peak_memory\": %lld, \"decompress_peak_memory\": %lld,"
+                    " \"compress_memory\": ",
+                 r->mode, (long long)r->bufsize, (long long)r->insize, (long long)r->outsize, r->insize? (double)r->outsize/r->insize : 0.0,
+                 Speed(r,r->ctime), Speed(r,r->dtime), (long long)r->cmem, (long long)r->dmem);
+        PrintJsonMemory (f, r->reported_cmem);
+        fprintf (f, ", \"decompress_memory\": ");
+        PrintJsonMemory (f, r->reported_dmem);
+        fprintf (f, ", \"verified\": %s, \"error\": ", r->verified? "true" : "false");
+        if (r->errcode == CELS_OK)  fprintf (f, "null");
+        else                        PrintJsonString (f, CelsErrorMessage(r->errcode));
+        fprintf (f, "}%s\n", i+1<num_results? "," : "");
+    }
+    fprintf (f, "]\n");
+}
+
+// Parse size like "64k" or "16m"
+static CelsNum ParseSize (const char* str)
+{
+    char* end;
+    CelsNum size = strtoll (str, &end, 10);
+    if (*end=='k' || *end=='K')  size <<= 10;
+    if (*end=='m' || *end=='M')  size <<= 20;
+    if (*end=='g' || *end=='G')  size <<= 30;
+    return size;
+}
+
+// Corpus used without -i: mix of repetitive text-like data and pseudo-random bytes
+static char* GenerateCorpus (CelsNum size)
+{
+    static const char* words[] = {"compression ", "method ", "codec ", "stream ", "buffer ", "block ", "the ", "of ", "data ", "\n"};
+    char* data = (char*) malloc (size+1);
+    unsigned seed = 12345;
+    CelsNum pos = 0;
+    while (data  &&  pos < size) {
+        seed = seed*1103515245 + 12345;
+        if ((seed>>16) % 8 == 0) {
+            data[pos++] = (char)(seed>>8);
+        } else {
+            const char* word = words[(seed>>16) % 10];
+            while (*word  &&  pos < size)  data[pos++] = *word++;
+        }
+    }
+    return data;
+}
+
+static char* ReadCorpus (const char* filename, CelsNum* size)
+{
+    FILE* f = fopen (filename, "rb");
+    if (f == NULL)  return NULL;
+    CelsNum max = 1<<20;
+    char* data = (char*) malloc (max);
+    *size = 0;
+    while (data) {
+        *size += fread (data + *size, 1, max - *size, f);
+        if (*size < max)  break;
+        char* bigger = (char*) realloc (data, max*2);
+        if (bigger == NULL)  free (data);
+        data = bigger,  max *= 2;
+    }
+    fclose (f);
+    return data;
+}
+
+static void Usage (void)
+{
+    printf ("Usage: cels-bench [options] [method...]\n"
+            "Benchmarks given methods, or all codecs found by CelsLoad() and built-in ones\n"
+            "  -i file     corpus file (default: generated data)\n"
+            "  -s size     size of generated corpus (default: 16m)\n"
+            "  -b sizes    comma-separated sizes of chunks compressed by CelsCompressMem(), 0 for the whole corpus (default: 0)\n"
+            "  -n count    repetitions, the best time is reported (default: 3)\n"
+            "  -j file     also write results as JSON into file, \"-\" for stdout\n");
+}
+
+int main (int argc, char **argv)
+{
+    const char* corpus_file = NULL;
+    const char* json_file = NULL;
+    const char* buffers = "0";
+    CelsNum size = 16<<20;
+    int repeats = 3,  i;
+    for (i=1;  i<argc  &&  argv[i][0]=='-';  i++) {
+        if (i+1 >= argc)  {Usage();  return 2;}
+        switch (argv[i][1]) {
+            case 'i':  corpus_file = argv[++i];      break;
+            case 's':  size = ParseSize (argv[++i]);  break;
+            case 'b':  buffers = argv[++i];          break;
+            case 'n':  repeats = atoi (argv[++i]);   break;
+            case 'j':  json_file = argv[++i];        break;
+            default:   Usage();  return 2;
+        }
+    }
+    if (repeats < 1)  repeats = 1;
+
+    CelsLoad();
+    char* data = corpus_file? ReadCorpus (corpus_file, &size) : GenerateCorpus (size);
+    if (data == NULL)  {printf ("Can't %s corpus\n", corpus_file? "read" : "allocate");  return 2;}
+
+    // Methods from the command line or names of all codecs, except for wildcard ones
+    static char names[65536];
+    const char* methods[4096];
+    int num_methods = 0;
+    for (;  i<argc  &&  num_methods<4096;  i++)
+        methods[num_methods++] = argv[i];
+    if (num_methods == 0  &&  CelsListCodecs (names, sizeof(names)) > 0) {
+        const char* name;
+        for (name=names;  *name  &&  num_methods<4096;  name += strlen(name)+1)
+            if (strchr (name, '*') == NULL)  methods[num_methods++] = name;
+    }
+
+    CelsNum bufsizes[64];
+    int num_bufsizes = 0;
+    const char* p;
+    for (p=buffers;  p  &&  num_bufsizes<64;  p = strchr(p,',')? strchr(p,',')+1 : NULL)
+        bufsizes[num_bufsizes++] = ParseSize (p);
+
+    BenchResult* results = (BenchResult*) calloc (num_methods * (num_bufsizes+1) + 1, sizeof(BenchResult));
+    int num_results = 0,  failed = 0,  m,  b;
+    Table = json_file && strcmp (json_file, "-") == 0?  stderr : stdout;
+    PrintHeader();
+    for (m=0;  m<num_methods;  m++) {
+        // Methods and chains that can't be parsed get a single row with the error
+        CelsChain* chain;
+        CelsResult errcode = CelsParseChain (methods[m], &chain, 0,0);
+        if (errcode >= CELS_OK)  CelsFreeChain (chain);
+        for (b=0;  b<=num_bufsizes;  b++) {
+            BenchResult* r = &results[num_results++];
+            r->method  = methods[m];
+            r->mode    = errcode < CELS_OK? "-" : b<num_bufsizes? "mem" : "stream";
+            r->bufsize = errcode >= CELS_OK && b<num_bufsizes? bufsizes[b] : 0;
+            r->insize  = size;
+            r->reported_cmem = CelsGetCompressionMem   (r->method);
+            r->reported_dmem = CelsGetDecompressionMem (r->method);
+            r->errcode = errcode < CELS_OK?  errcode : b<num_bufsizes?  BenchMem (r, data, size, repeats) : BenchStream (r, data, size, repeats);
+            r->verified = (r->errcode == CELS_OK);
+            if (r->errcode == CELS_ERROR_BAD_COMPRESSED_DATA)  failed = 1;   // the codec can't decompress its own data
+            PrintResult (r);
+            fflush (Table);
+            if (errcode < CELS_OK)  break;
+        }
+    }
+
+    if (json_file) {
+        FILE* f = strcmp (json_file, "-")? fopen (json_file, "w") : stdout;
+        if (f)  PrintJson (f, results, num_results);
+        if (f && f != stdout)  fclose (f);
+    }
+    free (results);
+    free (data);
+    return failed;
+}
@@ -0,0 +1,496 @@
+// Microbenchmarks of the CELS layer itself: every entry point of CELS.h is called with no-op codecs, so the time measured
+// is the cost of dispatching, parsing and callbacks. Each benchmark runs until it takes --min-time seconds, like Google
+// Benchmark does, and results are written to JSON in the Google Benchmark format, so they can be compared between versions.
+// Usage: cels-microbench [--filter substring] [--min-time seconds] [--json file]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "CELS.h"
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+static double Now (void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, freq;
+    QueryPerformanceCounter (&counter);
+    QueryPerformanceFrequency (&freq);
+    return (double)counter.QuadPart / freq.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec/1e9;
+#endif
+}
+
+
+// *** No-op codecs ***********************************************************************************************************
+
+// "nop[:memory][:c][:...]": memory is reported by CELS_GET_COMPRESSION_MEMORY, "c" enables caching, other parameters are ignored
+typedef struct {
+    CelsNum  memory;
+    int      caching;
+    int      num_params;
+} NopMethod;
+
+static CelsResult __cdecl NopMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    NopMethod* m = (NopMethod*) self;
+    switch (service)
+    {
+    case CELS_PARSE_VIEWS:
+    {
+        const CelsStrView* params = (const CelsStrView*) inbuf;
+        NopMethod* parsed = (NopMethod*) outbuf;
+        parsed->memory     = 1<<20;
+        parsed->caching    = 0;
+        parsed->num_params = (int) insize;
+        CelsNum i;
+        for (i=1;  i<insize;  i++) {
+            if (params[i].len == 1  &&  params[i].str[0] == 'c')   parsed->caching = 1;
+            else if (params[i].len > 0  &&  params[i].str[0] >= '0'  &&  params[i].str[0] <= '9')
+                parsed->memory = strtoll (params[i].str, NULL, 10);
+        }
+        return sizeof(NopMethod);
+    }
+
+    case CELS_UNPARSE:
+        if (outsize < 64)  return CELS_ERROR_GENERAL;
+        sprintf ((char*)outbuf, "nop:%lld%s", (long long)m->memory, m->caching? ":c" : "");
+        return CELS_OK;
+
+    case CELS_COMPRESS:
+    case CELS_DECOMPRESS:
+        return inbuf && outbuf?  insize : CELS_ERROR_NOT_IMPLEMENTED;
+
+    case CELS_COMPRESS_STEP:
+    case CELS_DECOMPRESS_STEP:
+    {
+        CelsStepBuffers* b = (CelsStepBuffers*) inbuf;
+        b->inpos = b->insize;
+        return subservice == CELS_STEP_CONTINUE?  1 : CELS_OK;
+    }
+
+    case CELS_GET_COMPRESSION_MEMORY:    return m->memory;
+    case CELS_SET_COMPRESSION_MEMORY:    m->memory = insize;  return CELS_OK;
+    case CELS_GET_CACHING:               return m->caching;
+    case CELS_GET_MAX_COMPRESSED_SIZE:   return insize;
+    default:                             return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+// "tnop": the same codec, but compression and getters are called directly via CELS_GET_SERVICE_TABLE, bypassing NopMain()
+static CelsResult __cdecl NopCompress (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    return inbuf && outbuf?  insize : CELS_ERROR_NOT_IMPLEMENTED;
+}
+
+static CelsResult __cdecl NopGet (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    NopMethod* m = (NopMethod*) self;
+    if (service == CELS_GET_COMPRESSION_MEMORY)  return m->memory;
+    return NopMain (self, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+}
+
+static const CelsServiceTable NopServices = {NopCompress, NopCompress, NopGet, NULL};
+
+static CelsResult __cdecl NopTableMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    if (service == CELS_GET_SERVICE_TABLE)  {*(const CelsServiceTable**)outbuf = &NopServices;  return CELS_OK;}
+    return NopMain (self, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+}
+
+// "rw:size": streaming-only codec copying data by CelsRead()/CelsWrite() calls of size bytes,
+// or between buffers received by buffer services with size 0
+static CelsResult __cdecl ReadWriteMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    switch (service)
+    {
+    case CELS_PARSE:
+    {
+        char const* const* params = (char const* const*) inbuf;
+        int size = params[1]? atoi (params[1]) : 64;
+        if (size < 0  ||  size > 65536)  return CELS_ERROR_INVALID_COMPRESSOR;
+        *(int*)outbuf = size;
+        return sizeof(int);
+    }
+
+    case CELS_COMPRESS:
+    case CELS_DECOMPRESS:
+    {
+        if (inbuf || outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;
+        char buf[65536];
+        int size = *(int*)self;
+        CelsResult len;
+        const void* in;
+        void* out;
+        if (size == 0) {
+            while ((len = CelsReceiveReadOnlyInbuf (cb,ud, &in)) != 0) {
+                if (len < CELS_OK  &&  len != CELS_ERROR_NOT_IMPLEMENTED)  return len;
+                CelsResult room = CelsReceiveEmptyOutbuf (cb,ud, &out);
+                if (room < CELS_OK)  return room;
+                if (len == CELS_ERROR_NOT_IMPLEMENTED) {
+                    // Input isn't lent by this host, so read data directly into the output buffer
+                    len = CelsRead (cb,ud, out,room);
+                    if (len < CELS_OK)  return len;
+                } else {
+                    if (room < len)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+                    memcpy (out, in, len);
+                    CelsSendEmptyInbuf (cb,ud, (void*)in,len);
+                }
+                CelsResult result = CelsSendFilledOutbuf (cb,ud, out,len);
+                if (result < CELS_OK)  return result;
+                if (len == 0)  break;
+            }
+            return CELS_OK;
+        }
+        while ((len = CelsRead (cb,ud, buf,size)) > 0) {
+            CelsResult result = CelsWrite (cb,ud, buf,len);
+            if (result != len)  return result<CELS_OK? result : CELS_ERROR_WRITE;
+        }
+        return len;
+    }
+
+    default:
+        return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+
+// *** Benchmarks *************************************************************************************************************
+
+// Benchmark function runs the operation iterations times and returns the number of items processed (0: one per iteration)
+typedef CelsNum BenchFunction (CelsNum iterations, CelsNum arg);
+
+static char Inbuf[65536], Outbuf[65536];
+static char Parsed[CELS_MAX_PARSED_METHOD_SIZE];   // "nop" parsed by main()
+static char ParsedTable[CELS_MAX_PARSED_METHOD_SIZE];  // "tnop" parsed by main()
+static volatile CelsResult Sink;                   // keeps results alive
+
+static CelsNum CelsStringCompress (CelsNum n, CelsNum arg)
+{
+    for (;  n>0;  n--)  Sink = Cels ("nop", CELS_COMPRESS,0, Inbuf,arg, Outbuf,arg, 0,0);
+    return 0;
+}
+
+static CelsNum CelsParsedCompress (CelsNum n, CelsNum arg)
+{
+    for (;  n>0;  n--)  Sink = Cels (Parsed, CELS_COMPRESS,0, Inbuf,arg, Outbuf,arg, 0,0);
+    return 0;
+}
+
+static CelsNum CelsTableCompress (CelsNum n, CelsNum arg)
+{
+    for (;  n>0;  n--)  Sink = Cels (ParsedTable, CELS_COMPRESS,0, Inbuf,arg, Outbuf,arg, 0,0);
+    return 0;
+}
+
+static CelsNum CelsStringGet (CelsNum n, CelsNum arg)
+{
+    for (;  n>0;  n--)  Sink = CelsGetCompressionMem ("nop");
+    return 0;
+}
+
+static CelsNum CelsParsedGet (CelsNum n, CelsNum arg)
+{
+    for (;  n>0;  n--)  Sink = CelsGetCompressionMem (Parsed);
+    return 0;
+}
+
+static CelsNum CelsTableGet (CelsNum n, CelsNum arg)
+{
+    for (;  n>0;  n--)  Sink = CelsGetCompressionMem (ParsedTable);
+    return 0;
+}
+
+static CelsNum CelsParsedUnparse (CelsNum n, CelsNum arg)
+{
+    char str[CELS_MAX_METHOD_STRING_SIZE];
+    for (;  n>0;  n--)  Sink = CelsCanonize (Parsed, str);
+    return 0;
+}
+
+static CelsNum CelsCompressMemFallback (CelsNum n, CelsNum arg)
+{
+    // "rw" doesn't implement buffers, so CelsReadWriteMem() serves every transfer
+    char method[32];
+    sprintf (method, "rw:%lld", (long long)arg);
+    CelsResult errcode;
+    void* parsed = CelsAcquireMethod (method, &errcode, 0,0);
+    if (parsed == NULL)  return 0;
+    CelsNum i;
+    for (i=0;  i<n;  i++)  Sink = CelsCompressMem (parsed, Inbuf,sizeof(Inbuf), Outbuf,sizeof(Outbuf), 0,0);
+    CelsReleaseMethod (parsed);
+    return n * (sizeof(Inbuf)/arg) * 2;   // reads and writes
+}
+
+static CelsNum CelsCompressMemLend (CelsNum n, CelsNum arg)
+{
+    // "rw:0" receives the whole Outbuf from CelsReadWriteMem() and reads Inbuf directly into it, copying data once
+    CelsResult errcode;
+    void* parsed = CelsAcquireMethod ("rw:0", &errcode, 0,0);
+    if (parsed == NULL)  return 0;
+    CelsNum i;
+    for (i=0;  i<n;  i++)  Sink = CelsCompressMem (parsed, Inbuf,sizeof(Inbuf), Outbuf,sizeof(Outbuf), 0,0);
+    CelsReleaseMethod (parsed);
+    return 0;
+}
+
+// Application callback of CelsBufferPool benchmarks: CELS_READ serves Inbuf from the position in userdata, CELS_WRITE discards data
+static CelsResult __cdecl PoolAppCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsNum* inpos = (CelsNum*) self;
+    if (service == CELS_READ) {
+        CelsNum len = (CelsNum)sizeof(Inbuf) - *inpos < insize?  (CelsNum)sizeof(Inbuf) - *inpos : insize;
+        memcpy (inbuf, Inbuf + *inpos, len);
+        *inpos += len;
+        return len;
+    }
+    return service == CELS_WRITE?  outsize : CELS_ERROR_NOT_IMPLEMENTED;
+}
+
+static CelsNum BufferPoolLend (CelsNum n, CelsNum arg)
+{
+    // "rw:0" receives Inbuf read into pool buffers of arg bytes and sends it back in another pool buffer
+    CelsBufferPool* pool;
+    CelsNum inpos = 0;
+    CelsResult errcode;
+    void* parsed = CelsAcquireMethod ("rw:0", &errcode, 0,0);
+    if (parsed == NULL)  return 0;
+    if (CelsCreateBufferPool (&pool, 2, arg, &inpos, PoolAppCallback) < CELS_OK)  {CelsReleaseMethod (parsed);  return 0;}
+    CelsNum i;
+    for (i=0;  i<n;  i++) {
+        inpos = 0;
+        Sink = CelsCompress (parsed, pool, CelsBufferPoolCallback);
+    }
+    CelsDeleteBufferPool (pool);
+    CelsReleaseMethod (parsed);
+    return n * (sizeof(Inbuf)/arg);   // buffers lent for input
+}
+
+static CelsNum ParseStrParams (CelsNum n, CelsNum arg)
+{
+    char method[CELS_MAX_METHOD_STRING_SIZE] = "nop";
+    char parsed[CELS_MAX_PARSED_METHOD_SIZE];
+    CelsNum i;
+    for (i=1;  i<arg;  i++)  strcat (method, ":x");
+    for (;  n>0;  n--) {
+        Sink = CelsParseStr (method, parsed,sizeof(parsed), 0,0);
+        CelsFree (parsed);
+    }
+    return 0;
+}
+
+static CelsNum ParseStrRegistered (CelsNum n, CelsNum arg)
+{
+    // Codecs are registered once, and stay registered for the following benchmarks.
+    // The registry keeps name pointers, so names are static
+    static char names[1000][16];
+    static CelsNum registered = 0;
+    for (;  registered < arg  &&  registered < 1000;  registered++) {
+        sprintf (names[registered], "nop%lld", (long long)registered);
+        CelsRegister (names[registered], NULL, NopMain);
+    }
+    char parsed[CELS_MAX_PARSED_METHOD_SIZE];
+    for (;  n>0;  n--) {
+        Sink = CelsParseStr ("nop", parsed,sizeof(parsed), 0,0);
+        CelsFree (parsed);
+    }
+    return 0;
+}
+
+static CelsNum LimitString (CelsNum n, CelsNum arg)
+{
+    // arg=1: limit below the current value, so the method is changed and unparsed; arg=0: it's only canonized
+    char str[CELS_MAX_METHOD_STRING_SIZE];
+    for (;  n>0;  n--)  Sink = CelsLimitCompressionMem ((void*)"nop:1000000", arg? 1000 : 2000000, str);
+    return 0;
+}
+
+static CelsNum AcquireRelease (CelsNum n, CelsNum arg)
+{
+    const char* method = arg? "nop:4096:c" : "nop:4096";
+    CelsResult errcode;
+    for (;  n>0;  n--)  CelsReleaseMethod (CelsAcquireMethod (method, &errcode, 0,0));
+    return 0;
+}
+
+static CelsNum ParseChain (CelsNum n, CelsNum arg)
+{
+    CelsChain* chain;
+    for (;  n>0;  n--) {
+        Sink = CelsParseChain ("nop+nop:c+nop", &chain, 0,0);
+        if (Sink >= CELS_OK)  CelsFreeChain (chain);
+    }
+    return 0;
+}
+
+static CelsNum StreamProcess (CelsNum n, CelsNum arg)
+{
+    // arg=1: native CELS_COMPRESS_STEP; arg=0: "rw" on the fiber, switching twice per call
+    CelsStream* stream;
+    CelsNum inused, outused;
+    if (CelsCreateStream (&stream, arg? "nop" : "rw:64", CELS_COMPRESS, 0,0) < CELS_OK)  return 0;
+    for (;  n>0;  n--)  Sink = CelsStreamProcess (stream, Inbuf,64, &inused, Outbuf,64, &outused, CELS_STEP_CONTINUE);
+    CelsDeleteStream (stream);
+    return 0;
+}
+
+static CelsNum CompressBlocks (CelsNum n, CelsNum arg)
+{
+    CelsBlockJob jobs[64];
+    int i;
+    for (i=0;  i<arg;  i++) {
+        jobs[i].method = "nop";
+        jobs[i].inbuf  = Inbuf,   jobs[i].insize  = 1024;
+        jobs[i].outbuf = Outbuf,  jobs[i].outsize = 1024;
+    }
+    for (;  n>0;  n--)  Sink = CelsCompressBlocks (jobs, (int)arg, 1<<30, 0, 0,0);
+    return 0;
+}
+
+static CelsNum ListCodecs (CelsNum n, CelsNum arg)
+{
+    char names[65536];
+    for (;  n>0;  n--)  Sink = CelsListCodecs (names, sizeof(names));
+    return 0;
+}
+
+static CelsNum ErrorMessage (CelsNum n, CelsNum arg)
+{
+    for (;  n>0;  n--)  Sink = (CelsResult) (size_t) CelsErrorMessage (CELS_ERROR_INTERNAL);
+    return 0;
+}
+
+typedef struct {
+    const char*     name;
+    BenchFunction*  function;
+    CelsNum         arg;
+} Benchmark;
+
+static const Benchmark Benchmarks[] = {
+    {"BM_Cels/string/compress/1024",           CelsStringCompress,       1024},
+    {"BM_Cels/parsed/compress/1024",           CelsParsedCompress,       1024},
+    {"BM_Cels/parsed_table/compress/1024",     CelsTableCompress,        1024},
+    {"BM_Cels/string/get",                     CelsStringGet,            0},
+    {"BM_Cels/parsed/get",                     CelsParsedGet,            0},
+    {"BM_Cels/parsed_table/get",               CelsTableGet,             0},
+    {"BM_CallCels/unparse",                    CelsParsedUnparse,        0},
+    {"BM_CelsReadWriteMem/transfer/16",        CelsCompressMemFallback,  16},
+    {"BM_CelsReadWriteMem/transfer/4096",      CelsCompressMemFallback,  4096},
+    {"BM_CelsReadWriteMem/lend/65536",         CelsCompressMemLend,      0},
+    {"BM_CelsBufferPool/lend/4096",            BufferPoolLend,           4096},
+    {"BM_CelsBufferPool/lend/65536",           BufferPoolLend,           65536},
+    {"BM_CelsParseStr/params/1",               ParseStrParams,           1},
+    {"BM_CelsParseStr/params/4",               ParseStrParams,           4},
+    {"BM_CelsParseStr/params/16",              ParseStrParams,           16},
+    {"BM_CelsParseStr/params/64",              ParseStrParams,           64},
+    {"BM_CelsLimitCompressionMem/unchanged",   LimitString,              0},
+    {"BM_CelsLimitCompressionMem/reduced",     LimitString,              1},
+    {"BM_CelsAcquireMethod/not_caching",       AcquireRelease,           0},
+    {"BM_CelsAcquireMethod/caching",           AcquireRelease,           1},
+    {"BM_CelsParseChain/3",                    ParseChain,               0},
+    {"BM_CelsStreamProcess/fiber",             StreamProcess,            0},
+    {"BM_CelsStreamProcess/native",            StreamProcess,            1},
+    {"BM_CelsCompressBlocks/jobs/1",           CompressBlocks,           1},
+    {"BM_CelsCompressBlocks/jobs/16",          CompressBlocks,           16},
+    {"BM_CelsListCodecs",                      ListCodecs,               0},
+    {"BM_CelsErrorMessage",                    ErrorMessage,             0},
+    {"BM_CelsParseStr/registered/1000",        ParseStrRegistered,       1000},   // should be the last one
+};
+
+typedef struct {
+    const char*  name;
+    CelsNum      iterations;
+    double       real_time, cpu_time;    // ns per iteration
+    double       items_per_second;       // 0 if the benchmark doesn't count items
+} BenchResult;
+
+// Double the number of iterations until the run takes min_time seconds
+static void RunBenchmark (const Benchmark* b, double min_time, BenchResult* r)
+{
+    CelsNum iterations = 1,  items;
+    double real, cpu;
+    for (;;) {
+        clock_t cpu_start = clock();
+        double start = Now();
+        items = b->function (iterations, b->arg);
+        real = Now() - start;
+        cpu  = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+        if (real >= min_time  ||  iterations >= (CelsNum)1<<40)  break;
+        CelsNum next = real > 0?  (CelsNum)(iterations * min_time * 1.4 / real) : iterations*10;
+        iterations = next > iterations*10? iterations*10 : next > iterations? next : iterations*2;
+    }
+    r->name             = b->name;
+    r->iterations       = iterations;
+    r->real_time        = real * 1e9 / iterations;
+    r->cpu_time         = cpu  * 1e9 / iterations;
+    r->items_per_second = items && real > 0?  items / real : 0;
+}
+
+static void PrintJson (FILE* f, const BenchResult* results, int num_results, double min_time)
+{
+    char date[64];
+    time_t t = time (NULL);
+    strftime (date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime (&t));
+    fprintf (f, "{\n  \"context\": {\n    \"date\": \"%s\",\n    \"executable\": \"cels-microbench\",\n"
+                "    \"min_time\": %g\n  },\n  \"benchmarks\": [\n",
+             date, min_time);
+    int i;
+    for (i=0;  i<num_results;  i++) {
+        const BenchResult* r = &results[i];
+        fprintf (f, "    {\n      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n      \"run_type\": \"iteration\",\n"
+                    "      \"iterations\": %lld,\n      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n      \"time_unit\": \"ns\"",
+                 r->name, r->name, (long long)r->iterations, r->real_time, r->cpu_time);
+        if (r->items_per_second)  fprintf (f, ",\n      \"items_per_second\": %.1f", r->items_per_second);
+        fprintf (f, "\n    }%s\n", i+1<num_results? "," : "");
+    }
+    fprintf (f, "  ]\n}\n");
+}
+
+int main (int argc, char **argv)
+{
+    const char* filter = "";
+    const char* json_file = "cels-microbench.json";
+    double min_time = 0.5;
+    int i;
+    for (i=1;  i+1<argc;  i+=2) {
+        if      (strcmp (argv[i], "--filter")   == 0)  filter = argv[i+1];
+        else if (strcmp (argv[i], "--min-time") == 0)  min_time = atof (argv[i+1]);
+        else if (strcmp (argv[i], "--json")     == 0)  json_file = argv[i+1];
+        else break;
+    }
+    if (i < argc) {
+        printf ("Usage: cels-microbench [--filter substring] [--min-time seconds] [--json file]\n");
+        return 2;
+    }
+
+    CelsRegister ("nop", NULL, NopMain);
+    CelsRegister ("tnop", NULL, NopTableMain);
+    CelsRegister ("rw",  NULL, ReadWriteMain);
+    if (CelsParse ("nop", Parsed) < CELS_OK)  {printf ("Can't parse \"nop\" method\n");  return 1;}
+    if (CelsParse ("tnop", ParsedTable) < CELS_OK)  {printf ("Can't parse \"tnop\" method\n");  return 1;}
+
+    int num_benchmarks = sizeof(Benchmarks) / sizeof(*Benchmarks),  num_results = 0;
+    BenchResult results[sizeof(Benchmarks) / sizeof(*Benchmarks)];
+    printf ("%-40s %14s %14s %14s %14s\n", "Benchmark", "Time", "CPU", "Iterations", "Items/s");
+    for (i=0;  i<num_benchmarks;  i++) {
+        if (strstr (Benchmarks[i].name, filter) == NULL)  continue;
+        BenchResult* r = &results[num_results++];
+        RunBenchmark (&Benchmarks[i], min_time, r);
+        printf ("%-40s %11.1f ns %11.1f ns %14lld", r->name, r->real_time, r->cpu_time, (long long)r->iterations);
+        if (r->items_per_second)  printf (" %12.3fM/s", r->items_per_second/1e6);
+        printf ("\n");
+        fflush (stdout);
+    }
+    CelsFree (Parsed);
+    CelsFree (ParsedTable);
+
+    FILE* f = fopen (json_file, "w");
+    if (f == NULL)  {printf ("Can't write %s\n", json_file);  return 1;}
+    PrintJson (f, results, num_results, min_time);
+    fclose (f);
+    return 0;
+}
@@ -0,0 +1,81 @@
+// Startup time of CelsLoad() vs CelsLoadLazy(). Every run loads all libraries found next to the program and in CELS_PATH,
+// lists codecs and parses one method (like a short command working with a single codec), then unloads everything.
+// The first run of each mode is reported separately, since it fills the disk cache and writes cels.manifest.
+// bench-startup.sh runs it with 100 copies of cels-test.so. Usage: cels-startup [runs] [method]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "CELS.h"
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+static double Now (void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, freq;
+    QueryPerformanceCounter (&counter);
+    QueryPerformanceFrequency (&freq);
+    return (double)counter.QuadPart / freq.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec/1e9;
+#endif
+}
+
+static char Codecs[1<<20];
+
+typedef struct {
+    double  load, parse;    // seconds spent in CelsLoad*() and in parsing of the method after it
+    int     codecs;         // codecs listed after loading
+    int     parsed;         // parsing succeeded
+} StartupTime;
+
+static void RunStartup (int lazy, const char* method, StartupTime* t)
+{
+    char parsed[CELS_MAX_PARSED_METHOD_SIZE];
+    double start = Now();
+    if (lazy)  CelsLoadLazy();
+    else       CelsLoad();
+    double loaded = Now();
+    t->codecs = (int) CelsListCodecs (Codecs, sizeof(Codecs));
+    double listed = Now();
+    t->parsed = method  &&  CelsParseStr (method, parsed,sizeof(parsed), 0,0) >= CELS_OK;
+    if (t->parsed)  CelsFree (parsed);
+    t->load  = loaded - start;
+    t->parse = Now() - listed;
+    CelsUnload();
+}
+
+static void Report (const char* mode, int runs, const char* method, StartupTime* first, StartupTime* sum, StartupTime* min)
+{
+    printf ("%-12s %5d codecs  first: %9.3f ms", mode, first->codecs, first->load*1000);
+    if (runs > 0)  printf ("  min: %9.3f ms  avg: %9.3f ms", min->load*1000, sum->load*1000/runs);
+    if (method)    printf ("  + parse \"%s\": %s%.3f ms", method, min->parsed? "":"failed, ", (runs>0? min->parse : first->parse)*1000);
+    printf ("\n");
+}
+
+int main (int argc, char **argv)
+{
+    int runs = argc>1? atoi(argv[1]) : 10;
+    const char* method = argc>2? argv[2] : NULL;
+    int lazy, i;
+    for (lazy=0;  lazy<2;  lazy++) {
+        StartupTime first, t, sum, min;
+        RunStartup (lazy, method, &first);
+        memset (&sum, 0, sizeof(sum));
+        min = first;
+        for (i=0;  i<runs;  i++) {
+            RunStartup (lazy, method, &t);
+            sum.load  += t.load;
+            sum.parse += t.parse;
+            if (i==0  ||  t.load  < min.load)   min.load  = t.load;
+            if (i==0  ||  t.parse < min.parse)  min.parse = t.parse;
+            min.parsed = t.parsed;
+        }
+        Report (lazy? "CelsLoadLazy" : "CelsLoad", runs, method, &first, &sum, &min);
+    }
+    return 0;
+}
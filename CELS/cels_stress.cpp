@@ -0,0 +1,137 @@
+// Stress test of the codec registry: 64 threads register codecs and parse methods at the same time. Every thread parses
+// its own codecs just registered and random codecs of other threads, each returning its own id, so finding a wrong codec
+// or missing a codec that is surely registered (own or after all threads finished) is counted as a failure. Build it with -fsanitize=address or
+// -fsanitize=thread (see compile-gcc.sh) to check the snapshot reclamation too. Exit code is 1 if any lookup failed,
+// sanitizer builds stop with their own non-zero exit code on the first report.
+// Usage: cels-stress [rounds]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CELS.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+// ASan stops on the first error by default, TSan only when asked to
+#if defined(__has_feature)
+#if __has_feature(thread_sanitizer) && !defined(__SANITIZE_THREAD__)
+#define __SANITIZE_THREAD__ 1
+#endif
+#endif
+#ifdef __SANITIZE_THREAD__
+extern "C" const char* __tsan_default_options (void)  {return "halt_on_error=1";}
+#endif
+
+#define NUM_THREADS        64
+#define CODECS_PER_THREAD  64
+
+// Codec "s<thread>_<i>" registered with its id as userdata: the id is stored by CELS_PARSE and returned as compression memory
+static CelsResult __cdecl StressMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    switch (service)
+    {
+    case CELS_PARSE:
+        if (outsize < (CelsNum)sizeof(CelsNum))  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        *(CelsNum*)outbuf = (CelsNum)(size_t)self;
+        return sizeof(CelsNum);
+
+    case CELS_GET_COMPRESSION_MEMORY:
+        return *(CelsNum*)self;
+
+    default:
+        return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+typedef struct {
+    int       id;
+    unsigned  random;
+    CelsNum   lookups, failures;
+} StressThread;
+
+static StressThread Threads[NUM_THREADS];
+static char* Names[NUM_THREADS][CODECS_PER_THREAD];    // strdup'ed, since the registry keeps the name pointers
+
+static CelsNum CodecId (int thread, int i)  {return (CelsNum)thread*CODECS_PER_THREAD + i + 1;}
+
+static unsigned Random (StressThread* t)  {return t->random = t->random*1103515245 + 12345;}
+
+// Parse the method and check that it's served by the codec with the expected id. Codecs may be missing only if may_miss!=0
+static void Lookup (StressThread* t, const char* name, CelsNum expected, int may_miss)
+{
+    CelsResult id = CelsGetCompressionMem (name);
+    t->lookups++;
+    if (id != expected  &&  !(may_miss && id < CELS_OK))  t->failures++;
+}
+
+static void StressThreadMain (StressThread* t)
+{
+    int i, k;
+    for (i=0;  i<CODECS_PER_THREAD;  i++) {
+        if (CelsRegister (Names[t->id][i], (void*)(size_t)CodecId(t->id,i), StressMain) < CELS_OK)  t->failures++;
+        Lookup (t, Names[t->id][i], CodecId(t->id,i), 0);
+
+        // Codecs of other threads, which may be not registered yet
+        for (k=0;  k<8;  k++) {
+            int other = Random(t) % NUM_THREADS,  j = Random(t) % CODECS_PER_THREAD;
+            Lookup (t, Names[other][j], CodecId(other,j), 1);
+        }
+
+        // Miss scanning the whole registry
+        t->lookups++;
+        if (CelsGetCompressionMem ("s_unregistered") >= CELS_OK)  t->failures++;
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI ThreadFunction (void* arg)  {StressThreadMain ((StressThread*)arg);  return 0;}
+#else
+static void* ThreadFunction (void* arg)  {StressThreadMain ((StressThread*)arg);  return NULL;}
+#endif
+
+int main (int argc, char **argv)
+{
+    int rounds = argc>1? atoi(argv[1]) : 10;
+    CelsNum lookups = 0,  failures = 0;
+    int round, i, j;
+    for (round=0;  round<rounds;  round++) {
+        for (i=0;  i<NUM_THREADS;  i++) {
+            for (j=0;  j<CODECS_PER_THREAD;  j++) {
+                char name[32];
+                sprintf (name, "s%d_%d", i, j);
+                Names[i][j] = strdup (name);
+            }
+            memset (&Threads[i], 0, sizeof(Threads[i]));
+            Threads[i].id     = i;
+            Threads[i].random = round*NUM_THREADS + i;
+        }
+
+#ifdef _WIN32
+        HANDLE threads[NUM_THREADS];
+        for (i=0;  i<NUM_THREADS;  i++)  threads[i] = CreateThread (NULL, 0, ThreadFunction, &Threads[i], 0, NULL);
+        for (i=0;  i<NUM_THREADS;  i++)  {WaitForSingleObject (threads[i], INFINITE);  CloseHandle (threads[i]);}
+#else
+        pthread_t threads[NUM_THREADS];
+        for (i=0;  i<NUM_THREADS;  i++)  pthread_create (&threads[i], NULL, ThreadFunction, &Threads[i]);
+        for (i=0;  i<NUM_THREADS;  i++)  pthread_join (threads[i], NULL);
+#endif
+
+        // After all threads finished, every codec should be found
+        for (i=0;  i<NUM_THREADS;  i++) {
+            for (j=0;  j<CODECS_PER_THREAD;  j++)
+                Lookup (&Threads[i], Names[i][j], CodecId(i,j), 0);
+            lookups  += Threads[i].lookups;
+            failures += Threads[i].failures;
+        }
+
+        CelsUnload();
+        for (i=0;  i<NUM_THREADS;  i++)
+            for (j=0;  j<CODECS_PER_THREAD;  j++)
+                free (Names[i][j]);
+    }
+
+    printf ("%d rounds, %d threads, %lld lookups, %lld failures\n", rounds, NUM_THREADS, (long long)lookups, (long long)failures);
+    return failures? 1 : 0;
+}
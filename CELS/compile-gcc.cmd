@@ -3,4 +3,9 @@ gcc -O3 CELS.cpp simple_host.cpp -o simple_host.exe
 gcc -O3 -DCELS_REGISTER_CODECS CELS.cpp simple_host.cpp easy_codec.cpp -o simple_host_with_easy_codec.exe
 gcc -c -O3 easy_codec.cpp
 dllwrap --driver-name c++ easy_codec.o -def cels-test.def -s -o cels-test.dll
+gcc -O3 CELS.cpp cels_bench.cpp -o cels-bench.exe -lpsapi
+gcc -O3 CELS.cpp cels_microbench.cpp -o cels-microbench.exe
+gcc -O3 CELS.cpp cels_stress.cpp -o cels-stress.exe
+gcc -O3 CELS.cpp cels_startup.cpp -o cels-startup.exe
+gcc -O3 CELS.cpp file_host.cpp -o file_host.exe
 @del *.o
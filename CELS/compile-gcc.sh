@@ -0,0 +1,11 @@
+#!/bin/sh
+g++ -O3 CELS.cpp simple_host.cpp -o simple_host -ldl -lpthread
+g++ -O3 -DCELS_REGISTER_CODECS CELS.cpp simple_host.cpp easy_codec.cpp -o simple_host_with_easy_codec -ldl -lpthread
+g++ -O3 -shared -fPIC -s easy_codec.cpp -o cels-test.so
+g++ -O3 CELS.cpp cels_bench.cpp -o cels-bench -ldl -lpthread
+g++ -O3 CELS.cpp cels_microbench.cpp -o cels-microbench -ldl -lpthread
+g++ -O3 CELS.cpp cels_stress.cpp -o cels-stress -ldl -lpthread
+g++ -O1 -g -fsanitize=address CELS.cpp cels_stress.cpp -o cels-stress-asan -ldl -lpthread
+g++ -O1 -g -fsanitize=thread  CELS.cpp cels_stress.cpp -o cels-stress-tsan -ldl -lpthread
+g++ -O3 CELS.cpp cels_startup.cpp -o cels-startup -ldl -lpthread
+g++ -O3 CELS.cpp file_host.cpp -o file_host -ldl -lpthread
@@ -2,4 +2,9 @@
 gcc -m64 -O3 -DCELS_REGISTER_CODECS CELS.cpp simple_host.cpp easy_codec.cpp -o simple_host_with_easy_codec64.exe
 gcc -m64 -c -O3 easy_codec.cpp
 dllwrap -m64 --driver-name c++ easy_codec.o -def cels-test.def -s -o cels64-test.dll
+gcc -m64 -O3 CELS.cpp cels_bench.cpp -o cels-bench64.exe -lpsapi
+gcc -m64 -O3 CELS.cpp cels_microbench.cpp -o cels-microbench64.exe
+gcc -m64 -O3 CELS.cpp cels_stress.cpp -o cels-stress64.exe
+gcc -m64 -O3 CELS.cpp cels_startup.cpp -o cels-startup64.exe
+gcc -m64 -O3 CELS.cpp file_host.cpp -o file_host64.exe
 @del *.o
@@ -1,3 +1,8 @@
 @call "C:\Program Files (x86)\Microsoft Visual Studio 12.0\VC\vcvarsall.bat"
 cl -O2 /EHsc simple_host.cpp simple_codec.cpp -o simple_host_with_simple_codec.exe
 link -DLL -DEF:cls-test.def -out:cls-test.dll simple_codec.obj
+cl -O2 /EHsc CELS.cpp cels_bench.cpp psapi.lib -o cels-bench.exe
+cl -O2 /EHsc CELS.cpp cels_microbench.cpp -o cels-microbench.exe
+cl -O2 /EHsc CELS.cpp cels_stress.cpp -o cels-stress.exe
+cl -O2 /EHsc CELS.cpp cels_startup.cpp -o cels-startup.exe
+cl -O2 /EHsc CELS.cpp file_host.cpp -o file_host.exe
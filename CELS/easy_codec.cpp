@@ -28,5 +28,5 @@ CelsResult __cdecl CelsMain (void* self, int service, CelsNum subservice, void*
 }
 
 #ifdef CELS_REGISTER_CODECS
-static CelsResult dummy = CelsRegister ("test", NULL, CelsMain);
+CELS_STATIC_CODEC (test, "test", NULL, CelsMain);
 #endif
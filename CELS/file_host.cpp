@@ -0,0 +1,330 @@
+// File (de)compressor passing the whole memory-mapped input file to CelsCompressMem()/CelsDecompressMem().
+// Usage: file_host c|d method infile outfile
+// Compressed output goes directly into the output file mapped at CelsGetMaxCompressedSize() bytes and then truncated,
+// other output is written sequentially by pwrite()/pwritev() into the space preallocated in large steps.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // for fallocate()
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "CELS.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
+
+static char Empty[1];   // input of empty file: non-NULL pointer keeps CelsCompressMem() reading from memory
+
+// Description of the last failed system call
+static const char* SystemError (void)
+{
+#ifdef _WIN32
+    static char msg[256];
+    if (!FormatMessageA (FORMAT_MESSAGE_FROM_SYSTEM|FORMAT_MESSAGE_IGNORE_INSERTS, NULL, GetLastError(), 0, msg, sizeof(msg), NULL))
+        sprintf (msg, "error %lu", (unsigned long) GetLastError());
+    return msg;
+#else
+    return strerror (errno);
+#endif
+}
+
+// Input file mapped as a whole
+typedef struct {
+    char*    data;
+    CelsNum  size;
+#ifdef _WIN32
+    HANDLE   file, mapping;
+#endif
+} InputFile;
+
+// Output file, either mapped at its maximum size (map!=NULL) or written sequentially
+typedef struct {
+    char*    map;
+    CelsNum  size;          // size of the mapping, or bytes written
+    CelsNum  allocated;     // space reserved for sequential writes
+#ifdef _WIN32
+    HANDLE   file, mapping;
+#else
+    int      fd;
+#endif
+} OutputFile;
+
+#ifdef _WIN32
+
+static int OpenInput (InputFile* in, const char* name)
+{
+    LARGE_INTEGER size;
+    in->data = Empty,  in->size = 0,  in->mapping = NULL;
+    in->file = CreateFileA (name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (in->file == INVALID_HANDLE_VALUE)  return 0;
+    if (!GetFileSizeEx (in->file, &size))  return 0;
+    if (size.QuadPart == 0)  return 1;
+    if ((ULONGLONG)size.QuadPart > (SIZE_T)-1)  return 0;    // doesn't fit into the address space
+    in->mapping = CreateFileMappingA (in->file, NULL, PAGE_READONLY, 0,0, NULL);
+    if (in->mapping == NULL)  return 0;
+    in->data = (char*) MapViewOfFile (in->mapping, FILE_MAP_READ, 0,0,0);
+    in->size = size.QuadPart;
+    return in->data != NULL;
+}
+
+static void CloseInput (InputFile* in)
+{
+    if (in->data  &&  in->data != Empty)  UnmapViewOfFile (in->data);
+    if (in->mapping)  CloseHandle (in->mapping);
+    if (in->file != INVALID_HANDLE_VALUE)  CloseHandle (in->file);
+}
+
+static int CreateOutput (OutputFile* out, const char* name)
+{
+    out->map = NULL,  out->size = out->allocated = 0,  out->mapping = NULL;
+    out->file = CreateFileA (name, GENERIC_READ|GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    return out->file != INVALID_HANDLE_VALUE;
+}
+
+static int ResizeOutput (OutputFile* out, CelsNum size)
+{
+    LARGE_INTEGER pos;
+    pos.QuadPart = size;
+    return SetFilePointerEx (out->file, pos, NULL, FILE_BEGIN)  &&  SetEndOfFile (out->file);
+}
+
+// Extend the file to size bytes (that allocates the disk space) and map it for writing
+static int MapOutput (OutputFile* out, CelsNum size)
+{
+    if (size <= 0  ||  (ULONGLONG)size > (SIZE_T)-1  ||  !ResizeOutput (out, size))  return 0;
+    out->mapping = CreateFileMappingA (out->file, NULL, PAGE_READWRITE, (DWORD)(size>>32), (DWORD)size, NULL);
+    if (out->mapping == NULL)  return 0;
+    out->map = (char*) MapViewOfFile (out->mapping, FILE_MAP_WRITE, 0,0,0);
+    if (out->map == NULL)  {CloseHandle (out->mapping);  out->mapping = NULL;  return 0;}
+    out->size = size;
+    return 1;
+}
+
+static void UnmapOutput (OutputFile* out)
+{
+    if (out->map)  UnmapViewOfFile (out->map);
+    if (out->mapping)  CloseHandle (out->mapping);
+    out->map = NULL,  out->mapping = NULL;
+}
+
+// Write at the current output size, like pwrite(), since the file pointer was moved by ResizeOutput()
+static CelsResult WriteOutput (OutputFile* out, const char* buf, CelsNum size)
+{
+    while (size > 0) {
+        OVERLAPPED pos;
+        DWORD len;
+        memset (&pos, 0, sizeof(pos));
+        pos.Offset     = (DWORD) out->size;
+        pos.OffsetHigh = (DWORD) (out->size >> 32);
+        if (!WriteFile (out->file, buf, size < (1<<30)? (DWORD)size : (1<<30), &len, &pos)  ||  len == 0)  return CELS_ERROR_WRITE;
+        buf += len,  size -= len,  out->size += len;
+    }
+    return CELS_OK;
+}
+
+// Windows can gather writes only from page-aligned buffers of unbuffered files, so buffers are written one by one
+static CelsResult WriteOutputV (OutputFile* out, const CelsIoVec* iov, CelsNum count)
+{
+    CelsNum total = 0,  i;
+    for (i=0;  i<count;  i++) {
+        CelsResult result = WriteOutput (out, (const char*)iov[i].buf, iov[i].size);
+        if (result < CELS_OK)  return result;
+        total += iov[i].size;
+    }
+    return total;
+}
+
+static int CloseOutput (OutputFile* out, CelsNum size)
+{
+    UnmapOutput (out);
+    int ok = ResizeOutput (out, size);
+    return CloseHandle (out->file)  &&  ok;
+}
+
+#else
+
+static int OpenInput (InputFile* in, const char* name)
+{
+    struct stat st;
+    in->data = Empty,  in->size = 0;
+    int fd = open (name, O_RDONLY);
+    if (fd < 0)  return 0;
+    if (fstat (fd, &st) < 0)  {close (fd);  return 0;}
+    if (st.st_size > 0) {
+        if ((CelsNum)(size_t)st.st_size != st.st_size)  {close (fd);  errno = EFBIG;  return 0;}
+        void* data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)  {close (fd);  return 0;}
+        madvise (data, st.st_size, MADV_SEQUENTIAL);
+        madvise (data, st.st_size, MADV_WILLNEED);
+        in->data = (char*) data;
+        in->size = st.st_size;
+    }
+    close (fd);     // the mapping stays valid
+    return 1;
+}
+
+static void CloseInput (InputFile* in)
+{
+    if (in->data != Empty)  munmap (in->data, in->size);
+}
+
+static int CreateOutput (OutputFile* out, const char* name)
+{
+    out->map = NULL,  out->size = out->allocated = 0;
+    out->fd = open (name, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    return out->fd >= 0;
+}
+
+// Reserve disk space for size bytes from offset, so writing into mapped pages can't fail with SIGBUS on full disk.
+// keep_size leaves the file size intact, so the space beyond the data is released by the final ftruncate()
+static int Preallocate (OutputFile* out, CelsNum offset, CelsNum size, int keep_size)
+{
+#ifdef __linux__
+    if (fallocate (out->fd, keep_size? FALLOC_FL_KEEP_SIZE : 0, offset, size) == 0)  return 1;
+    return errno == EOPNOTSUPP  ||  errno == ENOSYS;    // filesystem can't reserve space, but writes may still succeed
+#else
+    return 1;
+#endif
+}
+
+// Extend the file to size bytes and map it for writing
+static int MapOutput (OutputFile* out, CelsNum size)
+{
+    if (size <= 0  ||  (CelsNum)(size_t)size != size)  return 0;
+    if (!Preallocate (out, 0, size, 0)  ||  ftruncate (out->fd, size) < 0)  return 0;
+    void* map = mmap (NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, out->fd, 0);
+    if (map == MAP_FAILED)  return 0;
+    madvise (map, size, MADV_SEQUENTIAL);
+    out->map = (char*) map;
+    out->size = size;
+    return 1;
+}
+
+static void UnmapOutput (OutputFile* out)
+{
+    if (out->map)  munmap (out->map, out->size);
+    out->map = NULL;
+}
+
+// Reserve space for size more bytes in steps growing with the file, keeping it contiguous without fallocate() call per write
+static int ReserveOutput (OutputFile* out, CelsNum size)
+{
+    if (out->size + size <= out->allocated)  return 1;
+    CelsNum step = out->allocated < (1<<20)? (1<<20) : out->allocated;
+    if (step < size)  step = size;
+    if (!Preallocate (out, out->allocated, step, 1))  return 0;
+    out->allocated += step;
+    return 1;
+}
+
+static CelsResult WriteOutput (OutputFile* out, const char* buf, CelsNum size)
+{
+    if (!ReserveOutput (out, size))  return CELS_ERROR_WRITE;
+    while (size > 0) {
+        ssize_t len = pwrite (out->fd, buf, size, out->size);
+        if (len < 0  &&  errno == EINTR)  continue;
+        if (len <= 0)  return CELS_ERROR_WRITE;
+        buf += len,  size -= len,  out->size += len;
+    }
+    return CELS_OK;
+}
+
+// CelsIoVec matches struct iovec, so the buffers go to pwritev() as is, IOV_MAX at a time. CELS callbacks should write
+// entire output buffers, so the buffer written partially is completed by WriteOutput()
+static CelsResult WriteOutputV (OutputFile* out, const CelsIoVec* iov, CelsNum count)
+{
+    CelsNum total = 0,  i;
+    for (i=0;  i<count;  i++)
+        total += iov[i].size;
+    if (!ReserveOutput (out, total))  return CELS_ERROR_WRITE;
+    for (;;) {
+        while (count > 0  &&  iov->size == 0)  iov++, count--;
+        if (count == 0)  return total;
+        ssize_t len = pwritev (out->fd, (const struct iovec*)iov, count < IOV_MAX? (int)count : IOV_MAX, out->size);
+        if (len < 0  &&  errno == EINTR)  continue;
+        if (len <= 0)  return CELS_ERROR_WRITE;
+        out->size += len;
+        // Skip the buffers written completely, and finish the partially written one
+        for (;  count > 0  &&  (size_t)len >= iov->size;  iov++, count--)
+            len -= iov->size;
+        if (len > 0) {
+            CelsResult result = WriteOutput (out, (const char*)iov->buf + len, iov->size - len);
+            if (result < CELS_OK)  return result;
+            iov++, count--;
+        }
+    }
+}
+
+static int CloseOutput (OutputFile* out, CelsNum size)
+{
+    UnmapOutput (out);
+    int ok = ftruncate (out->fd, size) == 0;
+    return close (out->fd) == 0  &&  ok;
+}
+
+#endif
+
+// Callback writing output of (de)compression from the input buffer to the file; userdata is OutputFile
+CelsResult __cdecl WriteFileCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    OutputFile* out = (OutputFile*) self;
+    if (subservice != 0)  return CELS_ERROR_NOT_IMPLEMENTED;   // only the main stream
+    CelsResult result;
+    switch(service)
+    {
+        case CELS_WRITE:
+            result = WriteOutput (out, (const char*)outbuf, outsize);
+            return result < CELS_OK? result : outsize;
+        case CELS_WRITEV:
+            return WriteOutputV (out, (const CelsIoVec*)outbuf, outsize);
+        default:
+            return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+// (De)compress mapped input into the output file, returning the output size or error code
+static CelsResult Process (int compress, const char* method, InputFile* in, OutputFile* out)
+{
+    CelsResult result;
+    if (compress) {
+        // Output fits into the bound, so the codec can write it right into the page cache.
+        // Bounds too large for the disk or the address space (f.e. of codecs that may inflate data) are written sequentially
+        CelsResult bound = CelsGetMaxCompressedSize (method, in->size);
+        if (bound > 0  &&  MapOutput (out, bound)) {
+            result = CelsCompressMem (method, in->data,in->size, out->map,out->size, NULL,NULL);
+            UnmapOutput (out);
+            if (result != CELS_ERROR_OUTBLOCK_TOO_SMALL)  return result;    // otherwise the bound was wrong
+        }
+    }
+    out->size = 0;
+    result = compress? CelsCompressMem   (method, in->data,in->size, NULL,0, out,WriteFileCallback)
+                     : CelsDecompressMem (method, in->data,in->size, NULL,0, out,WriteFileCallback);
+    return result < CELS_OK? result : out->size;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 5  ||  (strcmp (argv[1], "c") != 0  &&  strcmp (argv[1], "d") != 0)) {
+        printf ("Usage: file_host c|d method infile outfile\n");
+        return 2;
+    }
+    CelsLoad();
+
+    InputFile in;
+    OutputFile out;
+    if (!OpenInput (&in, argv[3]))     {printf ("Can't open %s: %s\n", argv[3], SystemError());  return 1;}
+    if (!CreateOutput (&out, argv[4])) {printf ("Can't create %s: %s\n", argv[4], SystemError());  CloseInput (&in);  return 1;}
+
+    CelsResult result = Process (argv[1][0]=='c', argv[2], &in, &out);
+    if (!CloseOutput (&out, result < CELS_OK? 0 : result)  &&  result >= CELS_OK)  result = CELS_ERROR_WRITE;
+    CloseInput (&in);
+    if (result < CELS_OK)  {printf ("%s\n", CelsErrorMessage(result));  remove (argv[4]);  return 1;}
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>  // only for debugging
+#include <string.h> // for memcpy
 #include "CELS.h"
 
 // Structure representing parsed codec
@@ -7,6 +8,68 @@ struct MyCodec
     int level;
 };
 
+// CELS_COMPRESS/CELS_DECOMPRESS handler, called directly by the framework
+static CelsResult __cdecl MyCompress (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    // Memory buffer compression: from inbuf to outbuf
+    if (inbuf && outbuf)
+    {
+        if (insize > outsize)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+        memcpy (outbuf, inbuf, insize);
+        return insize;
+    }
+
+    // Remaining services require callback
+    if (!cb)  return CELS_ERROR_GENERAL;
+
+    // Mixed mode: from inbuf to CelsWrite()
+    if (inbuf)
+    {
+        int result = CelsWrite (cb,ud, inbuf,insize);
+        if (result != insize)  return result<CELS_OK? result : CELS_ERROR_WRITE;
+    }
+
+    // Mixed mode: from CelsRead() to outbuf. We don't want to implement it.
+    if (outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;
+
+    // Zero-copy streaming when the host lends its buffers: send input buffers back as output after in-place processing
+    void* inptr;
+    CelsResult size = CelsReceiveFilledInbuf (cb,ud, &inptr);
+    if (size != CELS_ERROR_NOT_IMPLEMENTED)
+    {
+        for (;  size > 0;  size = CelsReceiveFilledInbuf (cb,ud, &inptr))
+        {
+            CelsResult result = CelsSendFilledOutbuf (cb,ud, inptr,size);
+            if (result < CELS_OK)  return result;
+        }
+        return size;   // 0 on EOF or errcode
+    }
+
+    // Streaming compression: from CelsRead() to CelsWrite()
+    char buf[4096];
+    while (CelsResult len = CelsRead (cb,ud, buf,4096))
+    {
+        if (len < CELS_OK)  return len;  // Return errcode on error
+        int result = CelsWrite (cb,ud, buf,len);
+        if (result != len)  return result<CELS_OK? result : CELS_ERROR_WRITE;
+    }
+    return CELS_OK;
+}
+
+// CELS_COMPRESS_STEP/CELS_DECOMPRESS_STEP handler: copy as much as both buffers allow on each call.
+// This codec needs no state between calls, so CELS_STEP_ABORT has nothing to free
+static CelsResult MyStep (CelsNum mode, CelsStepBuffers* b)
+{
+    if (mode == CELS_STEP_ABORT)  return CELS_OK;
+    CelsNum len = b->insize - b->inpos;
+    if (len > b->outsize - b->outpos)  len = b->outsize - b->outpos;
+    memcpy ((char*)b->outbuf + b->outpos, (const char*)b->inbuf + b->inpos, len);
+    b->inpos += len,  b->outpos += len;
+    return (mode == CELS_STEP_FINISH  &&  b->inpos == b->insize)? CELS_OK : 1;
+}
+
+static const CelsServiceTable MyServices = {MyCompress, MyCompress, NULL, NULL};
+
 CelsResult __cdecl CelsMain (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
 {
     switch (service)
@@ -18,40 +81,17 @@ CelsResult __cdecl CelsMain (void* self, int service, CelsNum subservice, void*
             return sizeof(MyCodec);
         }
 
+    case CELS_GET_SERVICE_TABLE:
+        *(const CelsServiceTable**)outbuf = &MyServices;
+        return CELS_OK;
+
     case CELS_COMPRESS:
     case CELS_DECOMPRESS:
-        {
-            // Memory buffer compression: from inbuf to outbuf
-            if (inbuf && outbuf)
-            {
-                if (insize > outsize)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
-                memcpy (outbuf, inbuf, insize);
-                return insize;
-            }
-
-            // Remaining services require callback
-            if (!cb)  return CELS_ERROR_GENERAL;
-
-            // Mixed mode: from inbuf to CelsWrite()
-            if (inbuf)
-            {
-                int result = CelsWrite (cb,ud, inbuf,insize);
-                if (result != insize)  return result<CELS_OK? result : CELS_ERROR_WRITE;
-            }
-
-            // Mixed mode: from CelsRead() to outbuf. We don't want to implement it.
-            if (outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;
-
-            // Streaming compression: from CelsRead() to CelsWrite()
-            char buf[4096];
-            while (CelsResult len = CelsRead (cb,ud, buf,4096))
-            {
-                if (len < CELS_OK)  return len;  // Return errcode on error
-                int result = CelsWrite (cb,ud, buf,len);
-                if (result != len)  return result<CELS_OK? result : CELS_ERROR_WRITE;
-            }
-            return CELS_OK;
-        }
+        return MyCompress (self, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+
+    case CELS_COMPRESS_STEP:
+    case CELS_DECOMPRESS_STEP:
+        return MyStep (subservice, (CelsStepBuffers*)inbuf);
 
     default:
         return CELS_ERROR_NOT_IMPLEMENTED;
@@ -59,5 +99,5 @@ CelsResult __cdecl CelsMain (void* self, int service, CelsNum subservice, void*
 }
 
 #ifdef CELS_REGISTER_CODECS
-static CelsResult dummy = CelsRegister ("test", NULL, CelsMain);
+CELS_STATIC_CODEC (test, "test", NULL, CelsMain);
 #endif
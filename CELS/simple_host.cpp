@@ -1,4 +1,4 @@
-#include <stdio.h>
+#include <stdio.h>  // for fread/fwrite/printf
 #include "CELS.h"
 
 CelsResult __cdecl ReadWrite (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)